@@ -6,6 +6,9 @@
 #define STACK_SIZE 1024
 #define TICK_HZ 1000
 #define IRQ_MAX 32
+// MSIs are not supported.
+#define IRQ_MSI_BASE 0
+#define IRQ_MSI_END  0
 #define STRAIGHT_MAP_ADDR 0 // Unused.
 #define STRAIGHT_MAP_END  0 // Unused.
 
@@ -41,6 +44,13 @@ static inline bool mp_is_bsp(void) {
     return mp_self() == 0;
 }
 
+/// Tells the CPU that we're in a spin-wait loop.
+static inline void arch_cpu_relax(void) {
+    __asm__ __volatile__("nop");
+}
+
+// We don't support multiprocessors.
+#define CPU_NUM_MAX 1
 
 struct arch_cpuvar {
 };
@@ -50,4 +60,8 @@ static inline struct cpuvar *get_cpuvar(void) {
     return &cpuvar;
 }
 
+static inline struct cpuvar *get_cpuvar_of(int cpu) {
+    return &cpuvar;
+}
+
 #endif
@@ -2,6 +2,7 @@
 #include <main.h>
 #include <printk.h>
 #include <string.h>
+#include <task.h>
 #include "peripherals.h"
 
 void arch_idle(void) {
@@ -10,6 +11,12 @@ void arch_idle(void) {
     }
 }
 
+/// Returns the cycle counter used for CPU time accounting. Not available on
+/// this CPU: CPU time is not accounted.
+uint64_t arch_read_cycles(void) {
+    return 0;
+}
+
 extern char __bss[];
 extern char __bss_end[];
 
@@ -20,10 +20,15 @@ void irq_handler(void) {
     handle_irq(irq);
 }
 
-void arch_enable_irq(unsigned irq){
+void arch_enable_irq(unsigned irq, int cpu) {
     // TODO:
 }
 
 void arch_disable_irq(unsigned irq) {
     // TODO:
 }
+
+error_t arch_msi_message(unsigned irq, int cpu, uint64_t *addr,
+                         uint32_t *data) {
+    return ERR_UNAVAILABLE;
+}
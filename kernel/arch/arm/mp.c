@@ -8,6 +8,10 @@ void halt(void) {
     }
 }
 
+int mp_num_cpus(void) {
+    return 1;
+}
+
 void panic_lock(void) {
     // Do nothing: we don't support multiprocessors.
 }
@@ -16,6 +20,10 @@ void mp_start(void) {
     // Do nothing: we don't support multiprocessors.
 }
 
-void mp_reschedule(void) {
+void mp_reschedule(int cpu) {
+    // Do nothing: we don't support multiprocessors.
+}
+
+void mp_timer_reload(int cpu) {
     // Do nothing: we don't support multiprocessors.
 }
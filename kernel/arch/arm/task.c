@@ -32,7 +32,7 @@ static void init_stack(struct task *task, vaddr_t pc) {
     task->arch.stack = (vaddr_t) sp;
 }
 
-error_t arch_task_create(struct task *task, vaddr_t pc) {
+error_t arch_task_create(struct task *task, vaddr_t pc, vaddr_t sp) {
     task->arch.stack_bottom = kernel_stacks[task->tid];
     init_stack(task, pc);
     return OK;
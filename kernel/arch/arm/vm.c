@@ -21,7 +21,11 @@ void vm_unlink(struct vm *vm, vaddr_t vaddr) {
     // Do nothing: we don't support virtual memory.
 }
 
-paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr) {
+void vm_shootdown(struct vm *vm) {
+    // Do nothing: we don't support virtual memory.
+}
+
+paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr, unsigned flags) {
     return vaddr;
 }
 
@@ -6,6 +6,9 @@
 #define STACK_SIZE 4096
 #define TICK_HZ 1000
 #define IRQ_MAX 32
+// MSIs are not supported.
+#define IRQ_MSI_BASE 0
+#define IRQ_MSI_END  0
 #define KERNEL_BASE_ADDR  0xffff000000000000
 #define STRAIGHT_MAP_ADDR 0x03000000
 #define STRAIGHT_MAP_END  0x3f000000
@@ -15,6 +18,9 @@ struct vm {
     uint64_t *entries;
     /// The user's page table paddr.
     paddr_t ttbr0;
+    /// The ASID tagged with its generation (see vm_switch()) or 0 if it's not
+    /// yet assigned.
+    uint64_t asid;
 };
 
 struct arch_task {
@@ -55,6 +61,13 @@ static inline bool mp_is_bsp(void) {
     return mp_self() == 0;
 }
 
+/// Tells the CPU that we're in a spin-wait loop.
+static inline void arch_cpu_relax(void) {
+    __asm__ __volatile__("yield");
+}
+
+// We don't support multiprocessors.
+#define CPU_NUM_MAX 1
 
 struct arch_cpuvar {
 };
@@ -64,4 +77,8 @@ static inline struct cpuvar *get_cpuvar(void) {
     return &cpuvar;
 }
 
+static inline struct cpuvar *get_cpuvar_of(int cpu) {
+    return &cpuvar;
+}
+
 #endif
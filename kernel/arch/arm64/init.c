@@ -8,6 +8,7 @@
 extern uint8_t exception_vector;
 
 void arch_idle(void) {
+    spin_lock(&CURRENT->lock);
     task_switch();
 
     // Enable IRQ.
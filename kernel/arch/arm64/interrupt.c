@@ -11,8 +11,24 @@ extern char arm64_usercopy1[];
 extern char arm64_usercopy2[];
 extern char arm64_usercopy3[];
 
+/// Converts the ESR of an instruction/data abort into EXP_PF_* flags.
+static unsigned page_fault_reason(uint64_t esr, bool is_data_abort) {
+    unsigned fault = EXP_PF_USER;
+    // DFSC/IFSC 0b0011xx: permission fault, i.e. the page is mapped.
+    if ((esr & 0x3c) == 0x0c) {
+        fault |= EXP_PF_PRESENT;
+    }
+    // WnR: the abort was caused by a write.
+    if (is_data_abort && (esr & (1 << 6))) {
+        fault |= EXP_PF_WRITE;
+    }
+    return fault;
+}
+
 void arm64_handle_interrupt(void) {
+#ifndef CONFIG_TICKLESS
     arm64_timer_reload();
+#endif
     handle_timer_irq();
 }
 
@@ -33,7 +49,7 @@ void arm64_handle_exception(void) {
             TRACE("Instruction Abort: task=%s, far=%p, elr=%p",
                   CURRENT->name, far, elr);
 #endif
-            handle_page_fault(far, elr, EXP_PF_USER | EXP_PF_WRITE /* FIXME: */);
+            handle_page_fault(far, elr, page_fault_reason(esr, false));
             break;
         // Data abort in userspace (page fault).
         case 0x24:
@@ -41,7 +57,7 @@ void arm64_handle_exception(void) {
             TRACE("Data Abort: task=%s, far=%p, elr=%p",
                   CURRENT->name, far, elr);
 #endif
-            handle_page_fault(far, elr, EXP_PF_USER | EXP_PF_WRITE /* FIXME: */);
+            handle_page_fault(far, elr, page_fault_reason(esr, true));
             break;
         // Data abort in kernel.
         case 0x25:
@@ -54,7 +70,7 @@ void arm64_handle_exception(void) {
                       CURRENT->name, far, elr);
             }
 
-            handle_page_fault(far, elr, EXP_PF_USER | EXP_PF_WRITE /* FIXME: */);
+            handle_page_fault(far, elr, page_fault_reason(esr, true));
             break;
         default:
             PANIC("unknown exception: ec=%d (0x%x), elr=%p, far=%p",
@@ -1,5 +1,7 @@
 #include <types.h>
 #include <printk.h>
+#include <task.h>
+#include <trace.h>
 #include "asm.h"
 #include "peripherals.h"
 
@@ -21,6 +23,42 @@ char kdebug_readchar(void) {
     return '\0'; // TODO:
 }
 
+/// Returns the cycle counter used for CPU time accounting and trace records.
+uint64_t arch_read_cycles(void) {
+    return ARM64_MRS(cntvct_el0);
+}
+
+#ifdef CONFIG_TRACE_BUFFER
+uint64_t arch_cycles_per_ms(void) {
+    return ARM64_MRS(cntfrq_el0) / 1000;
+}
+#endif
+
+#ifdef CONFIG_TICKLESS
+/// Returns the number of ticks since the boot.
+uint64_t arch_timer_now(void) {
+    return ARM64_MRS(cntvct_el0) / (ARM64_MRS(cntfrq_el0) / TICK_HZ);
+}
+
+/// Programs the virtual timer to fire at the `deadline` tick. If it's 0,
+/// stops the timer.
+void arch_timer_set_deadline(uint64_t deadline) {
+    if (!deadline) {
+        ARM64_MSR(cntv_ctl_el0, 0ull);
+        return;
+    }
+
+    ARM64_MSR(cntv_cval_el0, deadline * (ARM64_MRS(cntfrq_el0) / TICK_HZ));
+    ARM64_MSR(cntv_ctl_el0, 1ull);
+}
+
+static void timer_init(void) {
+    ASSERT(ARM64_MRS(cntfrq_el0) >= TICK_HZ);
+    // The timer is programmed in timer_reload().
+    ARM64_MSR(cntv_ctl_el0, 0ull);
+    mmio_write(CORE0_TIMER_IRQCNTL, 1 << 3 /* Enable nCNTVIRQ IRQ */);
+}
+#else
 void arm64_timer_reload(void) {
     uint64_t hz = ARM64_MRS(cntfrq_el0);
     ASSERT(hz >= 1000);
@@ -33,15 +71,21 @@ static void timer_init(void) {
     ARM64_MSR(cntv_ctl_el0, 1ull);
     mmio_write(CORE0_TIMER_IRQCNTL, 1 << 3 /* Enable nCNTVIRQ IRQ */);
 }
+#endif
 
 void arm64_peripherals_init(void) {
     timer_init();
 }
 
-void arch_enable_irq(unsigned irq) {
+void arch_enable_irq(unsigned irq, int cpu) {
     // TODO:
 }
 
 void arch_disable_irq(unsigned irq) {
     // TODO:
 }
+
+error_t arch_msi_message(unsigned irq, int cpu, uint64_t *addr,
+                         uint32_t *data) {
+    return ERR_UNAVAILABLE;
+}
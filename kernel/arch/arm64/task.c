@@ -3,6 +3,7 @@
 #include <main.h>
 #include <task.h>
 #include "asm.h"
+#include "vm.h"
 
 void arm64_start_task(void);
 
@@ -11,9 +12,10 @@ static uint8_t kernel_stacks[CONFIG_NUM_TASKS][STACK_SIZE] __aligned(STACK_SIZE)
 static uint8_t exception_stacks[CONFIG_NUM_TASKS][STACK_SIZE] __aligned(STACK_SIZE);
 
 // Prepare the initial stack for arm64_task_switch().
-static void init_stack(struct task *task, vaddr_t pc) {
+static void init_stack(struct task *task, vaddr_t pc, vaddr_t user_sp) {
     uint64_t *sp = (uint64_t *) ((vaddr_t) task->arch.exception_stack_bottom + STACK_SIZE);
     // Fill the stack values for arm64_start_task().
+    *--sp = user_sp;
     *--sp = pc;
 
     int num_zeroed_regs = 11; // x19-x29
@@ -25,14 +27,17 @@ static void init_stack(struct task *task, vaddr_t pc) {
     task->arch.stack = (vaddr_t) sp;
 }
 
-error_t arch_task_create(struct task *task, vaddr_t pc) {
+error_t arch_task_create(struct task *task, vaddr_t pc, vaddr_t sp) {
     void *syscall_stack = (void *) kernel_stacks[task->tid];
     void *exception_stack = (void *) exception_stacks[task->tid];
-    task->vm.entries = page_tables[task->tid];
+    // Threads share the page table with the task owning the address space.
+    if (task->vm_owner == task) {
+        task->own_vm.entries = page_tables[task->tid];
+    }
     task->arch.syscall_stack = (vaddr_t) syscall_stack + STACK_SIZE;
     task->arch.syscall_stack_bottom = syscall_stack;
     task->arch.exception_stack_bottom = exception_stack;
-    init_stack(task, pc);
+    init_stack(task, pc, sp);
     return OK;
 }
 
@@ -42,12 +47,6 @@ void arch_task_destroy(struct task *task) {
 void arm64_task_switch(vaddr_t *prev_sp, vaddr_t next_sp);
 
 void arch_task_switch(struct task *prev, struct task *next) {
-    ARM64_MSR(ttbr0_el1, next->vm.ttbr0);
-    __asm__ __volatile__("dsb ish");
-    __asm__ __volatile__("isb");
-    __asm__ __volatile__("tlbi vmalle1is");
-    __asm__ __volatile__("dsb ish");
-    __asm__ __volatile__("isb");
-
+    vm_switch(next->vm);
     arm64_task_switch(&prev->arch.stack, next->arch.stack);
 }
@@ -2,8 +2,21 @@
 #include <syscall.h>
 #include <printk.h>
 #include <string.h>
+#include "asm.h"
 #include "vm.h"
 
+// ASIDs tag TLB entries with an address space so that switching TTBR0_EL1
+// doesn't flush the whole TLB. ASIDs are assigned to `struct vm` lazily in
+// vm_switch(). Once all ASIDs are used, we flush the TLB and start a new
+// generation: address spaces get new ASIDs when they're switched to. We use
+// 8-bit ASIDs (TCR_EL1.AS is 0).
+#define ASID_BITS 8
+#define ASID_MASK ((1ull << ASID_BITS) - 1)
+
+// We don't support multiprocessors: no locks are needed.
+static uint64_t asid_generation = 1;
+static uint64_t next_asid = 1;
+
 static uint64_t *traverse_page_table(uint64_t *table, vaddr_t vaddr,
                                      paddr_t kpage, uint64_t attrs) {
     ASSERT(vaddr < KERNEL_BASE_ADDR);
@@ -36,9 +49,49 @@ static uint64_t *traverse_page_table(uint64_t *table, vaddr_t vaddr,
     return &table[NTH_LEVEL_INDEX(1, vaddr)];
 }
 
+/// Invalidates the TLB entry for `vaddr` in `vm`.
+static void invalidate(struct vm *vm, vaddr_t vaddr) {
+    if ((vm->asid >> ASID_BITS) != asid_generation) {
+        // TLB entries of the address space have been flushed when the
+        // current generation started.
+        return;
+    }
+
+    uint64_t operand = ((vm->asid & ASID_MASK) << 48) | (vaddr >> 12);
+    __asm__ __volatile__("dsb ishst");
+    __asm__ __volatile__("tlbi vae1is, %0" :: "r"(operand));
+    __asm__ __volatile__("dsb ish");
+    __asm__ __volatile__("isb");
+}
+
+/// Switches the user page table to `vm`.
+void vm_switch(struct vm *vm) {
+    bool flush = false;
+    if ((vm->asid >> ASID_BITS) != asid_generation) {
+        if (next_asid > ASID_MASK) {
+            // Ran out of ASIDs. Start a new generation.
+            asid_generation++;
+            next_asid = 1;
+            flush = true;
+        }
+
+        vm->asid = (asid_generation << ASID_BITS) | next_asid++;
+    }
+
+    ARM64_MSR(ttbr0_el1, vm->ttbr0 | ((vm->asid & ASID_MASK) << 48));
+    __asm__ __volatile__("isb");
+    if (flush) {
+        __asm__ __volatile__("dsb ish");
+        __asm__ __volatile__("tlbi vmalle1is");
+        __asm__ __volatile__("dsb ish");
+        __asm__ __volatile__("isb");
+    }
+}
+
 error_t vm_create(struct vm *vm) {
     memset(vm->entries, 0, PAGE_SIZE);
     vm->ttbr0 = into_paddr(vm->entries);
+    vm->asid = 0;
     return OK;
 }
 
@@ -50,22 +103,17 @@ error_t vm_link(struct vm *vm, vaddr_t vaddr, paddr_t paddr, paddr_t kpage,
                 unsigned flags) {
     ASSERT(IS_ALIGNED(paddr, PAGE_SIZE));
 
-    uint64_t attrs = 1 << 6; // user
-    // TODO: MAP_W
-
+    uint64_t attrs = ARM64_PAGE_USER | ARM64_PAGE_NG;
     uint64_t *entry = traverse_page_table(vm->entries, vaddr, kpage, attrs);
     if (!entry) {
         return (kpage) ? ERR_TRY_AGAIN : ERR_EMPTY;
     }
 
-    *entry = paddr | attrs | ARM64_PAGE_ACCESS | ARM64_PAGE_TABLE;
-
-    // FIXME: Flush only the affected page.
-    __asm__ __volatile__("dsb ish");
-    __asm__ __volatile__("isb");
-    __asm__ __volatile__("tlbi vmalle1is");
-    __asm__ __volatile__("dsb ish");
-    __asm__ __volatile__("isb");
+    // AP[2] applies to EL1 as well: the kernel can't write into the page
+    // either.
+    uint64_t perm = (flags & MAP_W) ? 0 : ARM64_PAGE_RDONLY;
+    *entry = paddr | attrs | perm | ARM64_PAGE_ACCESS | ARM64_PAGE_TABLE;
+    invalidate(vm, vaddr);
     return OK;
 }
 
@@ -73,16 +121,26 @@ void vm_unlink(struct vm *vm, vaddr_t vaddr) {
     uint64_t *entry = traverse_page_table(vm->entries, vaddr, 0, 0);
     if (entry) {
         *entry = 0;
-        // FIXME: Flush only the affected page.
-        __asm__ __volatile__("dsb ish");
-        __asm__ __volatile__("isb");
-        __asm__ __volatile__("tlbi vmalle1is");
-        __asm__ __volatile__("dsb ish");
-        __asm__ __volatile__("isb");
+        invalidate(vm, vaddr);
     }
 }
 
-paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr) {
+void vm_shootdown(struct vm *vm) {
+    // Do nothing: TLBI instructions in invalidate() are broadcast to all CPUs
+    // in the inner shareable domain.
+}
+
+/// Returns the physical address of the page mapped at `vaddr` (page-aligned)
+/// if it's accessible from the user with `flags` (MAP_W), or 0 otherwise.
+paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr, unsigned flags) {
     uint64_t *entry = traverse_page_table(vm->entries, vaddr, 0, 0);
-    return (entry) ? ENTRY_PADDR(*entry) : 0;
+    if (!entry || !(*entry & ARM64_PAGE_VALID) || !(*entry & ARM64_PAGE_USER)) {
+        return 0;
+    }
+
+    if ((flags & MAP_W) && (*entry & ARM64_PAGE_RDONLY)) {
+        return 0;
+    }
+
+    return ENTRY_PADDR(*entry);
 }
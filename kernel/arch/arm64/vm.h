@@ -5,7 +5,14 @@
     (((vaddr) >> ((((level) -1) * 9) + 12)) & 0x1ff)
 #define ENTRY_PADDR(entry) ((entry) & 0x0000fffffffff000)
 
+#define ARM64_PAGE_VALID  (1ULL << 0)
 #define ARM64_PAGE_TABLE  0x3
+#define ARM64_PAGE_USER   (1ULL << 6)  // AP[1]: accessible from EL0
+#define ARM64_PAGE_RDONLY (1ULL << 7)  // AP[2]: read-only
 #define ARM64_PAGE_ACCESS (1ULL << 10)
+#define ARM64_PAGE_NG     (1ULL << 11)
+
+struct vm;
+void vm_switch(struct vm *vm);
 
 #endif
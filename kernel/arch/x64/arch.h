@@ -5,6 +5,9 @@
 
 #define STACK_SIZE 4096
 #define IRQ_MAX   256
+/// IRQs allocated for MSIs. They're not connected to the IOAPIC.
+#define IRQ_MSI_BASE 32
+#define IRQ_MSI_END  (256 - VECTOR_IRQ_BASE)
 #define TIMER_IRQ 0
 
 #define KERNEL_BASE_ADDR  0xffff800000000000
@@ -13,6 +16,12 @@
 
 struct vm {
     paddr_t pml4;
+    /// The PCID tagged with its generation (see vm_switch()) or 0 if it's not
+    /// yet assigned.
+    uint64_t pcid;
+    /// The bitmap of CPUs which may have stale TLB entries of this address
+    /// space.
+    uint32_t stale_cpus;
 };
 
 struct arch_task {
@@ -24,6 +33,9 @@ struct arch_task {
     void *xsave;
     uint64_t gsbase;
     uint64_t fsbase;
+    /// The CPU which has loaded the FPU state of the task most recently, or
+    /// -1 if none.
+    int fpu_cpu;
 } __packed;
 
 static inline void *from_paddr(paddr_t addr) {
@@ -68,6 +80,11 @@ static inline bool mp_is_bsp(void) {
     return mp_self() == 0;
 }
 
+/// Tells the CPU that we're in a spin-wait loop.
+static inline void arch_cpu_relax(void) {
+    __asm__ __volatile__("pause");
+}
+
 //
 //  Global Descriptor Table (GDT)
 //
@@ -126,6 +143,9 @@ struct idtr {
 #define CR0_MP          (1ul << 1)
 #define CR0_EM          (1ul << 2)
 #define CR0_TS          (1ul << 3)
+#define CR0_WP          (1ul << 16)
+#define CR4_PGE         (1ul << 7)
+#define CR4_PCIDE       (1ul << 17)
 #define CR4_FSGSBASE    (1ul << 16)
 #define CR4_OSXSAVE     (1ul << 18)
 #define CR4_OSFXSR      (1ul << 9)
@@ -155,6 +175,8 @@ struct idtr {
 //  Task State Segment (TSS)
 //
 #define TSS_IOMAP_SIZE 8191
+/// An I/O permission bitmap offset beyond the TSS limit: no ports are allowed.
+#define TSS_IOMAP_DISABLED 0xffff
 struct tss {
     uint32_t reserved0;
     uint64_t rsp0;
@@ -208,6 +230,8 @@ extern char __kernel_pml4[];  // paddr_t
 #define IOAPIC_IOWIN_OFFSET             0x10
 #define VECTOR_IPI_RESCHEDULE           32
 #define VECTOR_IPI_HALT                 33
+#define VECTOR_IPI_TLB_SHOOTDOWN        34
+#define VECTOR_IPI_TIMER_RELOAD         35
 #define VECTOR_IRQ_BASE                 48
 #define IOAPIC_ADDR                     0xfec00000
 #define IOAPIC_REG_IOAPICVER            0x01
@@ -254,6 +278,23 @@ struct arch_cpuvar {
     struct gdt gdt;
     struct idt idt;
     struct tss tss;
+    /// The PCID generation of TLB entries in this CPU.
+    uint64_t pcid_generation;
+    /// The address space loaded in CR3.
+    struct vm *vm;
+    /// Set by another CPU which waits for this CPU to flush TLB entries of
+    /// `vm`. Cleared once they're flushed.
+    uint32_t tlb_shootdown;
+    /// The task whose FPU state is (or was most recently) loaded in this CPU.
+    struct task *fpu_owner;
+    /// True if CR0.TS is cleared: the current task has used the FPU.
+    bool fpu_enabled;
+    /// True while the CPU is waiting in MWAIT for a write to `wakeup`.
+    bool mwait_idle;
+    /// The flag monitored by MWAIT. Other CPUs set it to wake up the CPU
+    /// instead of sending a reschedule IPI. It occupies a cache line so
+    /// that unrelated writes don't wake up the CPU.
+    uint32_t wakeup __aligned(64);
 };
 
 struct cpuvar;
@@ -263,6 +304,11 @@ static inline struct cpuvar *get_cpuvar(void) {
     return (struct cpuvar *) gsbase;
 }
 
+static inline struct cpuvar *get_cpuvar_of(int cpu) {
+    return (struct cpuvar *) from_paddr((paddr_t) __cpuvar_base
+                                        + cpu * CPUVAR_SIZE_MAX);
+}
+
 //
 //  SYSCALL/SYSRET
 //
@@ -296,6 +342,16 @@ static inline void asm_stihlt(void) {
     __asm__ __volatile__("sti; hlt");
 }
 
+static inline void asm_monitor(void *addr) {
+    __asm__ __volatile__("monitor" ::"a"(addr), "c"(0), "d"(0));
+}
+
+/// Enables interrupts and waits for a write to the monitored address or an
+/// interrupt. STI delays enabling interrupts until MWAIT is executed.
+static inline void asm_stimwait(void) {
+    __asm__ __volatile__("sti; mwait" ::"a"(0), "c"(0));
+}
+
 // Disable clang-format temporarily because it does not handles "::" as desire.
 // clang-format off
 static inline void asm_lgdt(uint64_t gdtr) {
@@ -322,6 +378,12 @@ static inline uint64_t asm_read_cr2(void) {
     return value;
 }
 
+static inline uint64_t asm_read_cr3(void) {
+    uint64_t value;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
 static inline uint64_t asm_read_cr4(void) {
     uint64_t value;
     __asm__ __volatile__("mov %%cr4, %0" : "=r"(value));
@@ -352,6 +414,27 @@ static inline uint64_t asm_rdmsr(uint32_t reg) {
     return ((uint64_t) high << 32) | low;
 }
 
+static inline uint64_t asm_rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline void asm_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                             uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(subleaf));
+}
+
+static inline void asm_invpcid(uint64_t type, uint64_t pcid, uint64_t vaddr) {
+    struct {
+        uint64_t pcid;
+        uint64_t vaddr;
+    } desc = { .pcid = pcid, .vaddr = vaddr };
+    __asm__ __volatile__("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
 static inline void asm_invlpg(uint64_t vaddr) {
     __asm__ __volatile__("invlpg (%0)" :: "b"(vaddr) : "memory");
 }
@@ -381,11 +464,15 @@ static inline void asm_wrfsbase(uint64_t fsbase) {
 }
 
 static inline void asm_xsave(void *xsave) {
-    __asm__ __volatile__("xsave (%0)" :: "r"(xsave) : "memory");
+    __asm__ __volatile__("xsave (%0)"
+                         :: "r"(xsave), "a"(0xffffffff), "d"(0xffffffff)
+                         : "memory");
 }
 
 static inline void asm_xrstor(void *xsave) {
-    __asm__ __volatile__("xrstor (%0)" :: "r"(xsave) : "memory");
+    __asm__ __volatile__("xrstor (%0)"
+                         :: "r"(xsave), "a"(0xffffffff), "d"(0xffffffff)
+                         : "memory");
 }
 
 static inline uint64_t asm_xgetbv(uint32_t xcr) {
@@ -1,10 +1,13 @@
 #include <arch.h>
 #include <main.h>
 #include <printk.h>
+#include <string.h>
 #include <task.h>
+#include <trace.h>
 #include "serial.h"
 #include "task.h"
 #include "trap.h"
+#include "vm.h"
 
 static void gdt_init(void) {
     uint64_t tss_addr = (uint64_t) &ARCH_CPUVAR->tss;
@@ -67,7 +70,10 @@ static void pic_init(void) {
 static void tss_init(void) {
     struct tss *tss = &ARCH_CPUVAR->tss;
     tss->rsp0 = 0;
-    tss->iomap_offset = offsetof(struct tss, iomap);
+    // The bitmap allows all ports. It's enabled only while a task with
+    // TASK_IO is running (see update_tss_iomap()).
+    memset(tss->iomap, 0x00, TSS_IOMAP_SIZE);
+    tss->iomap_offset = TSS_IOMAP_DISABLED;
     tss->iomap_last_byte = 0xff;
     asm_ltr(TSS_SEG);
 }
@@ -83,17 +89,97 @@ static void syscall_init(void) {
     asm_wrmsr(MSR_EFER, asm_rdmsr(MSR_EFER) | EFER_SCE);
 }
 
+#if defined(CONFIG_TICKLESS) || defined(CONFIG_TRACE_BUFFER)
+/// The number of TSC cycles per tick.
+static uint64_t tsc_per_tick = 0;
+
+/// Measures the TSC frequency using the local APIC timer, which counts
+/// CONFIG_LAPIC_TIMER_1MS_COUNT in a tick. We assume that the TSC is invariant
+/// and synchronized among CPUs.
+static void calibrate_tsc(void) {
+    write_apic(APIC_REG_LVT_TIMER, 1 << 16 /* masked */);
+    write_apic(APIC_REG_TIMER_DIV, APIC_TIMER_DIV);
+    uint64_t start = asm_rdtsc();
+    write_apic(APIC_REG_TIMER_INITCNT, CONFIG_LAPIC_TIMER_1MS_COUNT);
+    while (read_apic(APIC_REG_TIMER_CURRENT) > 0) {
+        __asm__ __volatile__("pause");
+    }
+
+    tsc_per_tick = asm_rdtsc() - start;
+    ASSERT(tsc_per_tick > 0);
+}
+#endif
+
+/// Returns the cycle counter used for CPU time accounting and trace records.
+uint64_t arch_read_cycles(void) {
+    return asm_rdtsc();
+}
+
+#ifdef CONFIG_TRACE_BUFFER
+uint64_t arch_cycles_per_ms(void) {
+    return (tsc_per_tick * TICK_HZ) / 1000;
+}
+#endif
+
+#ifdef CONFIG_TICKLESS
+/// The maximum number of ticks which the local APIC timer can count at once.
+#define ONESHOT_MAX_TICKS (0xffffffff / CONFIG_LAPIC_TIMER_1MS_COUNT)
+
+/// Returns the number of ticks since the boot.
+uint64_t arch_timer_now(void) {
+    return asm_rdtsc() / tsc_per_tick;
+}
+
+/// Programs the local APIC timer to fire at the `deadline` tick. If it's 0,
+/// stops the timer.
+void arch_timer_set_deadline(uint64_t deadline) {
+    if (!deadline) {
+        write_apic(APIC_REG_TIMER_INITCNT, 0);
+        return;
+    }
+
+    // Compute the count in TSC cycles to avoid firing a tick earlier or later.
+    uint64_t now = asm_rdtsc();
+    uint64_t target = deadline * tsc_per_tick;
+    uint64_t count = 1;
+    if (target > now) {
+        uint64_t cycles = MIN(target - now, ONESHOT_MAX_TICKS * tsc_per_tick);
+        count = (cycles * CONFIG_LAPIC_TIMER_1MS_COUNT) / tsc_per_tick;
+        count = MAX(count, 1);
+    }
+
+    write_apic(APIC_REG_TIMER_INITCNT, count);
+}
+
+static void apic_timer_init(void) {
+    if (mp_is_bsp()) {
+        calibrate_tsc();
+    }
+
+    // One-shot mode. It's programmed in timer_reload().
+    write_apic(APIC_REG_TIMER_INITCNT, 0);
+    write_apic(APIC_REG_LVT_TIMER, VECTOR_IRQ_BASE + TIMER_IRQ);
+    write_apic(APIC_REG_TIMER_DIV, APIC_TIMER_DIV);
+}
+#else
 static void calibrate_apic_timer(void) {
     // TODO: Calibrate the timer automatically.
     write_apic(APIC_REG_TIMER_INITCNT, CONFIG_LAPIC_TIMER_1MS_COUNT);
 }
 
 static void apic_timer_init(void) {
+#ifdef CONFIG_TRACE_BUFFER
+    if (mp_is_bsp()) {
+        calibrate_tsc();
+    }
+#endif
+
     write_apic(APIC_REG_TIMER_INITCNT, 0xffffffff);
     write_apic(APIC_REG_LVT_TIMER, (VECTOR_IRQ_BASE + TIMER_IRQ) | 0x20000);
     write_apic(APIC_REG_TIMER_DIV, APIC_TIMER_DIV);
     calibrate_apic_timer();
 }
+#endif
 
 static void apic_init(void) {
     asm_wrmsr(MSR_APIC_BASE, (asm_rdmsr(MSR_APIC_BASE) & 0xfffff100) | 0x0800);
@@ -105,12 +191,25 @@ static void apic_init(void) {
     write_apic(APIC_REG_LVT_ERROR, 1 << 16 /* masked */);
 }
 
+/// True if MONITOR/MWAIT is available.
+static bool mwait_supported = false;
+
+static void mwait_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    asm_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    mwait_supported = (ecx & (1 << 3)) != 0;
+    ARCH_CPUVAR->mwait_idle = false;
+    ARCH_CPUVAR->wakeup = 0;
+}
+
 static void common_setup(void) {
     STATIC_ASSERT(sizeof(struct cpuvar) <= CPUVAR_SIZE_MAX);
     STATIC_ASSERT(IS_ALIGNED(CPUVAR_SIZE_MAX, PAGE_SIZE));
 
-    // Enable some CPU features.
-    asm_write_cr0((asm_read_cr0() | CR0_MP) & (~CR0_EM) & (~CR0_TS));
+    // Enable some CPU features. CR0.TS is set to trap the first FPU
+    // instruction (lazy FPU switching). CR0.WP makes the kernel honor
+    // read-only user pages when copying into them.
+    asm_write_cr0((asm_read_cr0() | CR0_MP | CR0_TS | CR0_WP) & (~CR0_EM));
     asm_write_cr4(asm_read_cr4() | CR4_FSGSBASE | CR4_OSXSAVE | CR4_OSFXSR
                   | CR4_OSXMMEXCPT);
     asm_xsetbv(0, asm_xgetbv(0) | XCR0_SSE | XCR0_AVX);
@@ -119,6 +218,10 @@ static void common_setup(void) {
     struct gsbase *gsbase =
         from_paddr((paddr_t) __cpuvar_base + mp_self() * CPUVAR_SIZE_MAX);
     asm_wrgsbase((uint64_t) gsbase);
+    ARCH_CPUVAR->fpu_owner = NULL;
+    ARCH_CPUVAR->fpu_enabled = false;
+    pcid_init();
+    mwait_init();
 
     apic_init();
     gdt_init();
@@ -129,7 +232,6 @@ static void common_setup(void) {
 }
 
 void init(void) {
-    lock();
     serial_init();
     pic_init();
     common_setup();
@@ -138,19 +240,45 @@ void init(void) {
 }
 
 void mpinit(void) {
-    lock();
     INFO("Booting CPU #%d...", mp_self());
     common_setup();
     mpmain();
 }
 
+/// Waits for an interrupt or a wake-up from mp_reschedule(): other CPUs wake
+/// up this CPU by writing to the monitored flag instead of sending an IPI.
+static void mwait_idle(void) {
+    struct arch_cpuvar *arch = ARCH_CPUVAR;
+    asm_monitor(&arch->wakeup);
+    __atomic_store_n(&arch->mwait_idle, true, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&arch->wakeup, __ATOMIC_SEQ_CST)) {
+        asm_stimwait();
+        asm_cli();
+    }
+
+    __atomic_store_n(&arch->mwait_idle, false, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&arch->wakeup, 0, __ATOMIC_SEQ_CST)) {
+        spin_lock(&CURRENT->lock);
+        task_switch();
+    }
+}
+
 void arch_idle(void) {
+    spin_lock(&CURRENT->lock);
     task_switch();
     while (true) {
-        unlock();
-        asm_stihlt();
-        asm_cli();
-        lock();
+        if (mwait_supported) {
+            mwait_idle();
+        } else {
+            asm_stihlt();
+            asm_cli();
+        }
+#ifdef CONFIG_TICKLESS
+        // The interrupt might have made a task runnable. Since the timer no
+        // longer fires periodically, switch to it here.
+        spin_lock(&CURRENT->lock);
+        task_switch();
+#endif
     }
 }
 
@@ -1,6 +1,7 @@
 #include <arch.h>
 #include <kdebug.h>
 #include <printk.h>
+#include <profiler.h>
 #include <syscall.h>
 #include <task.h>
 #include "interrupt.h"
@@ -39,9 +40,11 @@ static void ioapic_init(void) {
     ack_irq();
 }
 
-void arch_enable_irq(unsigned irq) {
+/// Unmasks the IRQ and routes it to `cpu` (its local APIC ID, in the physical
+/// destination mode).
+void arch_enable_irq(unsigned irq, int cpu) {
     ASSERT(irq <= 255);
-    ioapic_write(IOAPIC_REG_NTH_IOREDTBL_HIGH(irq), 0);
+    ioapic_write(IOAPIC_REG_NTH_IOREDTBL_HIGH(irq), (uint32_t) cpu << 24);
     ioapic_write(IOAPIC_REG_NTH_IOREDTBL_LOW(irq), VECTOR_IRQ_BASE + irq);
 }
 
@@ -51,6 +54,16 @@ void arch_disable_irq(unsigned irq) {
     ioapic_write(IOAPIC_REG_NTH_IOREDTBL_LOW(irq), 1 << 16 /* masked */);
 }
 
+/// Computes the MSI message which delivers `irq` to `cpu` (in the physical
+/// destination mode, as an edge-triggered fixed interrupt).
+error_t arch_msi_message(unsigned irq, int cpu, uint64_t *addr,
+                         uint32_t *data) {
+    ASSERT(irq >= IRQ_MSI_BASE && irq < IRQ_MSI_END);
+    *addr = 0xfee00000 | ((uint32_t) cpu << 12);
+    *data = VECTOR_IRQ_BASE + irq;
+    return OK;
+}
+
 // Dumps the interrupt frame (for debugging).
 static void dump_frame(struct iframe *frame) {
     TRACE("RIP = %p CS  = %p  RFL = %p", frame->rip, frame->cs, frame->rflags);
@@ -62,17 +75,48 @@ static void dump_frame(struct iframe *frame) {
     TRACE("R14 = %p R15 = %p  ERR = %p", frame->r14, frame->r15, frame->error);
 }
 
+/// Returns the user RIP saved when CURRENT entered the kernel, which has been
+/// interrupted with `frame`, or 0 if it's unknown. The kernel stack which was
+/// in use tells how the task entered the kernel.
+static vaddr_t saved_user_ip(struct iframe *frame) {
+    if (CURRENT == IDLE_TASK) {
+        return 0;
+    }
+
+    struct arch_task *arch = &CURRENT->arch;
+    uint64_t *syscall_stack = (uint64_t *) arch->syscall_stack;
+    if ((uint64_t) arch->syscall_stack_bottom <= frame->rsp
+        && frame->rsp < arch->syscall_stack) {
+        // SYSCALL: the user RSP, RFLAGS, and RIP are pushed first (see
+        // syscall_entry).
+#ifdef CONFIG_ABI_EMU
+        if (CURRENT->flags & TASK_ABI_EMU) {
+            return syscall_stack[-16];
+        }
+#endif
+        return syscall_stack[-3];
+    }
+
+    struct iframe *user_frame =
+        (struct iframe *) (arch->interrupt_stack - sizeof(struct iframe));
+    if ((uint64_t) arch->interrupt_stack_bottom <= frame->rsp
+        && frame->rsp < arch->interrupt_stack && user_frame->cs != KERNEL_CS) {
+        // An exception or an interrupt from the user space.
+        return user_frame->rip;
+    }
+
+    return 0;
+}
+
 void x64_handle_interrupt(uint8_t vec, struct iframe *frame) {
     if (vec == VECTOR_IPI_HALT) {
         // Halt the CPU silently...
-        panic_unlock();
         while (true) {
             __asm__ __volatile__("cli; hlt");
         }
     }
 
     ack_irq();
-    bool needs_unlock = true;
     switch (vec) {
         case EXP_PAGE_FAULT: {
             if (frame->error & (1 << 3)) {
@@ -88,28 +132,40 @@ void x64_handle_interrupt(uint8_t vec, struct iframe *frame) {
             fault |= (frame->error & X64_PF_WRITE) ? EXP_PF_WRITE : 0;
 
             if (ip == (uint64_t) usercopy) {
-                // We don't do lock() here beucase we already have the lock
-                // in usercopy functions.
+                // A page fault in usercopy functions. Note that no locks
+                // are held in usercopy.
                 fault |= EXP_PF_USER;
-                needs_unlock = false;
             } else if ((fault & EXP_PF_USER) == 0) {
                 // This will never occur. NEVER!
                 panic_lock();
                 dump_frame(frame);
                 PANIC("page fault in the kernel space (addr=%p)", addr);
-            } else {
-                lock();
             }
 
             handle_page_fault(addr, ip, fault);
             break;
         }
+        case EXP_DEVICE_NOT_AVAILABLE:
+            if (frame->cs == KERNEL_CS) {
+                dump_frame(frame);
+                PANIC("#NM in the kernel space!");
+            }
+
+            switch_fpu();
+            break;
         case VECTOR_IPI_RESCHEDULE:
-            lock();
+            spin_lock(&CURRENT->lock);
             task_switch();
             break;
+        case VECTOR_IPI_TLB_SHOOTDOWN:
+            vm_handle_tlb_shootdown();
+            break;
+#ifdef CONFIG_TICKLESS
+        case VECTOR_IPI_TIMER_RELOAD:
+            timer_reload(CURRENT);
+            break;
+#endif
         default:
-            lock();
             if (vec <= 20) {
                 WARN_DBG("Exception #%d\n", vec);
                 dump_frame(frame);
@@ -123,6 +179,11 @@ void x64_handle_interrupt(uint8_t vec, struct iframe *frame) {
                 if (irq == SERIAL_IRQ) {
                     kdebug_handle_interrupt();
                 } else if (irq == TIMER_IRQ) {
+                    if (frame->cs == KERNEL_CS) {
+                        profiler_sample(saved_user_ip(frame), frame->rip);
+                    } else {
+                        profiler_sample(frame->rip, 0);
+                    }
                     handle_timer_irq();
                 } else {
                     handle_irq(irq);
@@ -132,26 +193,17 @@ void x64_handle_interrupt(uint8_t vec, struct iframe *frame) {
                 PANIC("Unexpected interrupt #%d", vec);
             }
     }
-
-    if (needs_unlock) {
-        unlock();
-    }
 }
 
 uintmax_t x64_handle_syscall(uintmax_t arg1, uintmax_t arg2, uintmax_t arg3,
                              uintmax_t arg4, uintmax_t arg5, uintmax_t type) {
-    lock();
-    uint64_t ret = handle_syscall(arg1, arg2, arg3, arg4, arg5, type);
-    unlock();
-    return ret;
+    return handle_syscall(arg1, arg2, arg3, arg4, arg5, type);
 }
 
 #ifdef CONFIG_ABI_EMU
 
 void x64_abi_emu_hook(trap_frame_t *frame) {
-    lock();
     abi_emu_hook(frame, ABI_HOOK_TYPE_SYSCALL);
-    unlock();
 }
 
 void x64_abi_emu_hook_initial(trap_frame_t *frame) {
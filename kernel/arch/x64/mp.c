@@ -118,44 +118,34 @@ void mp_start(void) {
     start_aps();
 }
 
-void mp_reschedule(void) {
-    send_ipi(VECTOR_IPI_RESCHEDULE, IPI_DEST_ALL_BUT_SELF, 0, IPI_MODE_FIXED);
-}
-
-static void halt_other_cpus(void) {
-    send_ipi(VECTOR_IPI_HALT, IPI_DEST_ALL_BUT_SELF, 0, IPI_MODE_FIXED);
-}
-
-static int big_lock = UNLOCKED;
-static int lock_owner = NO_LOCK_OWNER;
-
-void lock(void) {
-    if (mp_self() == lock_owner) {
-        PANIC("recursive lock (#%d)", mp_self());
+/// Asks `cpu` to run the scheduler. If it's waiting in MWAIT, a write to its
+/// monitored flag wakes it up without an IPI.
+void mp_reschedule(int cpu) {
+    struct arch_cpuvar *arch = &get_cpuvar_of(cpu)->arch;
+    if (__atomic_load_n(&arch->mwait_idle, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&arch->wakeup, 1, __ATOMIC_SEQ_CST);
+        return;
     }
 
-    while (!__sync_bool_compare_and_swap(&big_lock, UNLOCKED, LOCKED)) {
-        __asm__ __volatile__("pause");
-    }
+    send_ipi(VECTOR_IPI_RESCHEDULE, IPI_DEST_UNICAST, cpu, IPI_MODE_FIXED);
+}
 
-    lock_owner = mp_self();
+/// Asks `cpu` to reprogram its timer by timer_reload(), e.g. for an earlier
+/// deadline. Unlike mp_reschedule(), it doesn't switch the running task.
+void mp_timer_reload(int cpu) {
+    send_ipi(VECTOR_IPI_TIMER_RELOAD, IPI_DEST_UNICAST, cpu, IPI_MODE_FIXED);
 }
 
-void panic_lock(void) {
-    halt_other_cpus();
-    lock_owner = mp_self();
+void mp_send_tlb_shootdown(int cpu) {
+    send_ipi(VECTOR_IPI_TLB_SHOOTDOWN, IPI_DEST_UNICAST, cpu, IPI_MODE_FIXED);
 }
 
-void unlock(void) {
-    DEBUG_ASSERT(lock_owner == mp_self());
-    lock_owner = NO_LOCK_OWNER;
-    __sync_bool_compare_and_swap(&big_lock, LOCKED, UNLOCKED);
+static void halt_other_cpus(void) {
+    send_ipi(VECTOR_IPI_HALT, IPI_DEST_ALL_BUT_SELF, 0, IPI_MODE_FIXED);
 }
 
-void panic_unlock(void) {
-    if (mp_self() == lock_owner) {
-        lock_owner = NO_LOCK_OWNER;
-    }
+void panic_lock(void) {
+    halt_other_cpus();
 }
 
 void halt(void) {
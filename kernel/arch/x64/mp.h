@@ -102,13 +102,6 @@ enum ipi_mode {
     IPI_MODE_STARTUP = 6,
 };
 
-//
-//  Kernel Big Lock
-//
-#define LOCKED        0x12ab
-#define UNLOCKED      0xc0be
-#define NO_LOCK_OWNER -1
-
-void panic_unlock(void);
+void mp_send_tlb_shootdown(int cpu);
 
 #endif
@@ -35,5 +35,5 @@ void serial_init(void) {
 }
 
 void serial_enable_interrupt(void) {
-    arch_enable_irq(SERIAL_IRQ);
+    arch_enable_irq(SERIAL_IRQ, 0);
 }
@@ -3,19 +3,25 @@
 #include <syscall.h>
 #include <task.h>
 #include "interrupt.h"
+#include "task.h"
 #include "trap.h"
+#include "vm.h"
 
 static uint64_t pml4_tables[CONFIG_NUM_TASKS][512] __aligned(PAGE_SIZE);
 static uint8_t kernel_stacks[CONFIG_NUM_TASKS][STACK_SIZE] __aligned(STACK_SIZE);
 static uint8_t syscall_stacks[CONFIG_NUM_TASKS][STACK_SIZE] __aligned(STACK_SIZE);
 static uint8_t xsave_areas[CONFIG_NUM_TASKS][4096] __aligned(4096);
 
-error_t arch_task_create(struct task *task, vaddr_t ip) {
+error_t arch_task_create(struct task *task, vaddr_t ip, vaddr_t sp) {
     void *kstack = (void *) kernel_stacks[task->tid];
     void *syscall_stack_bottom = (void *) syscall_stacks[task->tid];
     void *xsave = (void *) xsave_areas[task->tid];
 
-    task->vm.pml4 = into_paddr(pml4_tables[task->tid]);
+    // Kernel stacks and the XSAVE area are per-thread. Threads share the page
+    // table with the task owning the address space.
+    if (task->vm_owner == task) {
+        task->own_vm.pml4 = into_paddr(pml4_tables[task->tid]);
+    }
     task->arch.interrupt_stack_bottom = kstack;
     task->arch.interrupt_stack = (uint64_t) kstack + STACK_SIZE;
     task->arch.syscall_stack = (uint64_t) syscall_stack_bottom + STACK_SIZE;
@@ -23,13 +29,17 @@ error_t arch_task_create(struct task *task, vaddr_t ip) {
     task->arch.xsave = xsave;
     task->arch.gsbase = 0;
     task->arch.fsbase = 0;
+    task->arch.fpu_cpu = -1;
+
+    // Clear the XSAVE header: XRSTOR initializes all FPU registers.
+    memset((uint8_t *) xsave + 512, 0, 64);
 
     // Set up a temporary kernel stack frame.
     uint64_t *rsp = (uint64_t *) task->arch.interrupt_stack;
 
     // Push a IRET frame.
     *--rsp = USER_DS | USER_RPL;    // SS
-    *--rsp = 0;                     // RSP
+    *--rsp = sp;                    // RSP
     *--rsp = 0x202;                 // RFLAGS (interrupts enabled).
     *--rsp = USER_CS64 | USER_RPL;  // CS
     *--rsp = ip;                    // RIP
@@ -52,9 +62,13 @@ error_t arch_task_create(struct task *task, vaddr_t ip) {
 void arch_task_destroy(struct task *task) {
 }
 
+/// Enables the I/O permission bitmap (which allows all ports) if the task has
+/// TASK_IO. Otherwise, the bitmap offset is set beyond the TSS limit: the CPU
+/// denies all port accesses from the user mode.
 static void update_tss_iomap(struct task *task) {
     struct tss *tss = &ARCH_CPUVAR->tss;
-    memset(tss->iomap, (task->flags & TASK_IO) ? 0x00 : 0xff, TSS_IOMAP_SIZE);
+    tss->iomap_offset = (task->flags & TASK_IO) ? offsetof(struct tss, iomap)
+                                                : TSS_IOMAP_DISABLED;
 }
 
 void arch_task_switch(struct task *prev, struct task *next) {
@@ -69,7 +83,7 @@ void arch_task_switch(struct task *prev, struct task *next) {
     prev->arch.fsbase = asm_rdfsbase();
     asm_wrfsbase(next->arch.fsbase);
     // Switch the page table.
-    asm_write_cr3(next->vm.pml4);
+    vm_switch(next->vm);
     // Enable ABI emulation if needed.
     ARCH_CPUVAR->abi_emu = (next->flags & TASK_ABI_EMU) ? 1 : 0;
     // Update the kernel stack for syscall and interrupt/exception handlers.
@@ -77,14 +91,36 @@ void arch_task_switch(struct task *prev, struct task *next) {
     ARCH_CPUVAR->tss.rsp0 = next->arch.interrupt_stack;
     // Update the I/O bitmap.
     update_tss_iomap(next);
-    // Save and restore FPU registers. This may be expensive operation: I
-    // think we should implement "lazy FPU switching".
-    asm_xsave(prev->arch.xsave);
-    asm_xrstor(next->arch.xsave);
+    // Lazy FPU switching: save the FPU registers only if the previous task
+    // has used them, and let the next task trap (#NM) on its first FPU
+    // instruction. See switch_fpu().
+    if (ARCH_CPUVAR->fpu_enabled) {
+        asm_xsave(prev->arch.xsave);
+        asm_write_cr0(asm_read_cr0() | CR0_TS);
+        ARCH_CPUVAR->fpu_enabled = false;
+    }
+    // An interrupt may have switched from the idle task in MWAIT. Other CPUs
+    // now need to send an IPI to us.
+    ARCH_CPUVAR->mwait_idle = false;
     // Restore registers (resume the next thread).
     switch_context(&prev->arch.rsp, &next->arch.rsp);
 }
 
+/// Handles the device-not-available exception (#NM): the current task has
+/// executed a FPU instruction for the first time in its time slice. We restore
+/// its FPU registers unless they're still loaded in this CPU.
+void switch_fpu(void) {
+    struct task *current = CURRENT;
+    asm_write_cr0(asm_read_cr0() & ~CR0_TS);
+    ARCH_CPUVAR->fpu_enabled = true;
+    if (ARCH_CPUVAR->fpu_owner != current
+        || current->arch.fpu_cpu != mp_self()) {
+        asm_xrstor(current->arch.xsave);
+        ARCH_CPUVAR->fpu_owner = current;
+        current->arch.fpu_cpu = mp_self();
+    }
+}
+
 error_t arch_caps_updated(struct task *task) {
     update_tss_iomap(task);
     return OK;
@@ -1,8 +1,28 @@
 #include <arch.h>
 #include <printk.h>
 #include <string.h>
+#include <task.h>
+#include "mp.h"
 #include "vm.h"
 
+// PCID (process-context identifier) tags TLB entries with an address space
+// so that switching CR3 doesn't flush the whole TLB. PCIDs are assigned to
+// `struct vm` lazily in vm_switch(). Once all PCIDs are used, we start a new
+// generation: every CPU flushes its TLB and address spaces get new PCIDs
+// when they're switched to.
+#define PCID_BITS   12
+#define PCID_MASK   ((1ull << PCID_BITS) - 1)
+#define CR3_NOFLUSH (1ull << 63)
+#define INVPCID_ADDR             0
+#define INVPCID_ALL_NON_GLOBAL   3
+
+static bool pcid_enabled = false;
+static bool invpcid_supported = false;
+static uint64_t pcid_generation = 1;
+static uint64_t next_pcid = 1;
+/// The lock for `pcid_generation` and `next_pcid`.
+static struct spinlock pcid_lock;
+
 static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
                                      paddr_t kpage, uint64_t attrs) {
     ASSERT(vaddr < KERNEL_BASE_ADDR);
@@ -37,6 +57,155 @@ static uint64_t *traverse_page_table(uint64_t pml4, vaddr_t vaddr,
     return &table[NTH_LEVEL_INDEX(1, vaddr)];
 }
 
+/// Flushes all non-global TLB entries in all PCIDs.
+static void flush_all(void) {
+    if (invpcid_supported) {
+        asm_invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+    } else {
+        // Toggling CR4.PGE flushes the whole TLB including global entries.
+        uint64_t cr4 = asm_read_cr4();
+        asm_write_cr4(cr4 & ~CR4_PGE);
+        asm_write_cr4(cr4);
+    }
+}
+
+/// Invalidates the TLB entry for `vaddr` in `vm`. Other CPUs flush TLB entries
+/// of `vm` when they switch to it next time, or in vm_shootdown() if they're
+/// running it.
+static void invalidate(struct vm *vm, vaddr_t vaddr) {
+    if (!pcid_enabled) {
+        asm_invlpg(vaddr);
+        return;
+    }
+
+    uint32_t self = 1u << mp_self();
+    __atomic_fetch_or(&vm->stale_cpus, ~self, __ATOMIC_RELAXED);
+    if (vm == CURRENT->vm) {
+        asm_invlpg(vaddr);
+    } else if (invpcid_supported) {
+        asm_invpcid(INVPCID_ADDR, vm->pcid & PCID_MASK, vaddr);
+    } else {
+        __atomic_fetch_or(&vm->stale_cpus, self, __ATOMIC_RELAXED);
+    }
+}
+
+/// Enables PCID in the current CPU if it's supported.
+void pcid_init(void) {
+    if (mp_is_bsp()) {
+        spin_lock_init(&pcid_lock);
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    asm_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1 << 17))) {
+        return;
+    }
+
+    asm_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    invpcid_supported = (ebx & (1 << 10)) != 0;
+    asm_write_cr4(asm_read_cr4() | CR4_PCIDE);
+    pcid_enabled = true;
+    ARCH_CPUVAR->pcid_generation = 0;
+}
+
+/// Switches the page table to `vm`. TLB entries of other address spaces are
+/// kept if PCID is enabled.
+void vm_switch(struct vm *vm) {
+    // Publish the address space before loading it: vm_shootdown() updates
+    // page table entries and `stale_cpus` and then reads this.
+    __atomic_store_n(&ARCH_CPUVAR->vm, vm, __ATOMIC_SEQ_CST);
+
+    if (!pcid_enabled) {
+        asm_write_cr3(vm->pml4);
+        return;
+    }
+
+    uint64_t generation = __atomic_load_n(&pcid_generation, __ATOMIC_ACQUIRE);
+    if ((vm->pcid >> PCID_BITS) != generation) {
+        spin_lock(&pcid_lock);
+        // Another CPU running a thread in the same address space may have
+        // assigned a PCID in the meantime.
+        if ((vm->pcid >> PCID_BITS) != pcid_generation) {
+            if (next_pcid > PCID_MASK) {
+                // Ran out of PCIDs. Start a new generation.
+                __atomic_store_n(&pcid_generation, pcid_generation + 1,
+                                 __ATOMIC_RELEASE);
+                next_pcid = 1;
+            }
+
+            vm->pcid = (pcid_generation << PCID_BITS) | next_pcid++;
+        }
+
+        generation = vm->pcid >> PCID_BITS;
+        spin_unlock(&pcid_lock);
+    }
+
+    // PCIDs in older generations may have been reassigned to other address
+    // spaces.
+    if (ARCH_CPUVAR->pcid_generation != generation) {
+        flush_all();
+        ARCH_CPUVAR->pcid_generation = generation;
+    }
+
+    uint64_t cr3 = vm->pml4 | (vm->pcid & PCID_MASK);
+    uint32_t self = 1u << mp_self();
+    if (__atomic_load_n(&vm->stale_cpus, __ATOMIC_SEQ_CST) & self) {
+        // Writing CR3 without the no-flush bit invalidates TLB entries
+        // associated with the PCID.
+        __atomic_fetch_and(&vm->stale_cpus, ~self, __ATOMIC_RELAXED);
+        asm_write_cr3(cr3);
+    } else {
+        asm_write_cr3(cr3 | CR3_NOFLUSH);
+    }
+}
+
+/// Flushes TLB entries of the address space loaded in this CPU on a request
+/// from vm_shootdown().
+void vm_handle_tlb_shootdown(void) {
+    struct arch_cpuvar *arch = ARCH_CPUVAR;
+    if (!__atomic_load_n(&arch->tlb_shootdown, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // Reloading CR3 without the no-flush bit invalidates TLB entries of the
+    // current PCID (or all non-global entries if PCID is disabled).
+    asm_write_cr3(asm_read_cr3());
+    __atomic_store_n(&arch->tlb_shootdown, 0, __ATOMIC_RELEASE);
+}
+
+/// Makes sure that no other CPU uses stale TLB entries of `vm` after
+/// vm_link() or vm_unlink(): it sends an IPI to every CPU running `vm` and
+/// waits for them to flush their TLBs. It must be called without holding any
+/// locks since the CPUs may be spinning on them with interrupts disabled.
+void vm_shootdown(struct vm *vm) {
+    int self = mp_self();
+    uint32_t targets = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        struct arch_cpuvar *arch = &get_cpuvar_of(cpu)->arch;
+        if (cpu != self && __atomic_load_n(&arch->vm, __ATOMIC_SEQ_CST) == vm) {
+            __atomic_store_n(&arch->tlb_shootdown, 1, __ATOMIC_RELEASE);
+            mp_send_tlb_shootdown(cpu);
+            targets |= 1u << cpu;
+        }
+    }
+
+    while (targets) {
+        for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+            struct arch_cpuvar *arch = &get_cpuvar_of(cpu)->arch;
+            if ((targets & (1u << cpu))
+                && !__atomic_load_n(&arch->tlb_shootdown, __ATOMIC_ACQUIRE)) {
+                targets &= ~(1u << cpu);
+            }
+        }
+
+        // Another CPU may be waiting for us in the same way with interrupts
+        // disabled.
+        vm_handle_tlb_shootdown();
+        arch_cpu_relax();
+    }
+}
+
 extern char __kernel_heap[];
 
 error_t vm_create(struct vm *vm) {
@@ -47,6 +216,8 @@ error_t vm_create(struct vm *vm) {
     // the area to catch bugs (especially NULL pointer dereferences in the
     // kernel).
     table[0] = 0;
+    vm->pcid = 0;
+    vm->stale_cpus = 0;
     return OK;
 }
 
@@ -56,7 +227,7 @@ void vm_destroy(struct vm *vm) {
 error_t vm_link(struct vm *vm, vaddr_t vaddr, paddr_t paddr, paddr_t kpage,
                 unsigned flags) {
     ASSERT(IS_ALIGNED(paddr, PAGE_SIZE));
-    uint64_t attrs = (1 << 2) | 1 /* user, present */;
+    uint64_t attrs = X64_PAGE_USER | X64_PAGE_PRESENT;
     attrs |= (flags & MAP_W) ? X64_PAGE_WRITABLE : 0;
 
     uint64_t *entry = traverse_page_table(vm->pml4, vaddr, kpage, attrs);
@@ -65,7 +236,7 @@ error_t vm_link(struct vm *vm, vaddr_t vaddr, paddr_t paddr, paddr_t kpage,
     }
 
     *entry = paddr | attrs;
-    asm_invlpg(vaddr);
+    invalidate(vm, vaddr);
     return OK;
 }
 
@@ -73,11 +244,19 @@ void vm_unlink(struct vm *vm, vaddr_t vaddr) {
     uint64_t *entry = traverse_page_table(vm->pml4, vaddr, 0, 0);
     if (entry) {
         *entry = 0;
-        asm_invlpg(vaddr);
+        invalidate(vm, vaddr);
     }
 }
 
-paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr) {
+/// Returns the physical address of the page mapped at `vaddr` (page-aligned)
+/// if it's accessible from the user with `flags` (MAP_W), or 0 otherwise.
+paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr, unsigned flags) {
     uint64_t *entry = traverse_page_table(vm->pml4, vaddr, 0, 0);
-    return (entry) ? ENTRY_PADDR(*entry) : 0;
+    if (!entry) {
+        return 0;
+    }
+
+    uint64_t required = X64_PAGE_USER | X64_PAGE_PRESENT;
+    required |= (flags & MAP_W) ? X64_PAGE_WRITABLE : 0;
+    return ((*entry & required) == required) ? ENTRY_PADDR(*entry) : 0;
 }
@@ -11,6 +11,13 @@
 #define X64_PF_WRITE   (1 << 1)
 #define X64_PF_USER    (1 << 2)
 
+#define X64_PAGE_PRESENT  (1 << 0)
 #define X64_PAGE_WRITABLE (1 << 1)
+#define X64_PAGE_USER     (1 << 2)
+
+struct vm;
+void pcid_init(void);
+void vm_switch(struct vm *vm);
+void vm_handle_tlb_shootdown(void);
 
 #endif
@@ -1,2 +1,4 @@
-obj-y += main.o task.o ipc.o syscall.o printk.o kdebug.o
+obj-y += main.o task.o ipc.o syscall.o printk.o kdebug.o lock.o timer.o notification.o
+obj-$(CONFIG_TRACE_BUFFER) += trace.o
+obj-$(CONFIG_PROFILER) += profiler.o
 subdir-y += arch/$(ARCH)
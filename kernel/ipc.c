@@ -2,67 +2,385 @@
 #include <string.h>
 #include <types.h>
 #include "ipc.h"
+#include "notification.h"
 #include "printk.h"
 #include "syscall.h"
 #include "task.h"
+#include "trace.h"
+
+/// Copies a message from the user buffer. Only the header and the payload
+/// used by the message type are copied.
+static void copy_msg_from_user(struct message *dst, userptr_t src) {
+    memcpy_from_user(dst, src, MESSAGE_HEADER_LEN);
+    memcpy_from_user(&dst->raw, src + MESSAGE_HEADER_LEN,
+                     msg_payload_len(dst->type));
+}
+
+#ifndef CONFIG_NOMMU
+/// Validates the ool payload in the message being sent and touches its pages
+/// in advance: page faults must not occur while we're holding task locks.
+static error_t prefault_ool(struct message *m) {
+    vaddr_t base = (vaddr_t) m->ool_ptr;
+    if (m->ool_len > CONFIG_OOL_BUFFER_LEN) {
+        return ERR_TOO_LARGE;
+    }
+
+    if (is_kernel_addr_range(base, m->ool_len)) {
+        return ERR_INVALID_ARG;
+    }
+
+    vaddr_t end = base + m->ool_len;
+    for (vaddr_t vaddr = base; vaddr < end;
+         vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE) + PAGE_SIZE) {
+        uint8_t byte;
+        memcpy_from_user(&byte, vaddr, sizeof(byte));
+    }
+
+    return OK;
+}
+
+/// Locks the page tables of two tasks. They may be the same one if the tasks
+/// are threads in the same address space.
+static void vm_lock_two(struct task *a, struct task *b) {
+    struct spinlock *la = &a->vm_owner->vm_lock;
+    struct spinlock *lb = &b->vm_owner->vm_lock;
+    if (la == lb) {
+        spin_lock(la);
+    } else if (la < lb) {
+        spin_lock(la);
+        spin_lock(lb);
+    } else {
+        spin_lock(lb);
+        spin_lock(la);
+    }
+}
+
+/// Releases locks acquired by vm_lock_two().
+static void vm_unlock_two(struct task *a, struct task *b) {
+    spin_unlock(&a->vm_owner->vm_lock);
+    if (a->vm_owner != b->vm_owner) {
+        spin_unlock(&b->vm_owner->vm_lock);
+    }
+}
+
+/// Copies the ool payload from the current task into the receiver's ool
+/// buffer through the kernel's straight mapping. The buffer is not consumed
+/// until deliver_ool() is called: if it fails or the caller gives up sending
+/// the message, nothing has changed except the contents of the unused buffer.
+/// The source pages must be readable and the buffer writable by the user. The
+/// caller must hold locks of both tasks. The page tables are locked during the
+/// copy so that other threads can't unmap the pages in the middle of it.
+static error_t copy_ool(struct task *dst, struct message *m) {
+    vaddr_t dst_buf = dst->ool_buf;
+    if (!dst_buf) {
+        // The receiver does not accept ool payloads.
+        return ERR_NOT_ACCEPTABLE;
+    }
+
+    vm_lock_two(CURRENT, dst);
+    error_t err = OK;
+    vaddr_t src_buf = (vaddr_t) m->ool_ptr;
+    size_t remaining = m->ool_len;
+    while (remaining > 0) {
+        offset_t src_off = src_buf % PAGE_SIZE;
+        offset_t dst_off = dst_buf % PAGE_SIZE;
+        size_t copy_len =
+            MIN(remaining, MIN(PAGE_SIZE - src_off, PAGE_SIZE - dst_off));
+
+        paddr_t src_paddr =
+            vm_resolve(CURRENT->vm, ALIGN_DOWN(src_buf, PAGE_SIZE), 0);
+        if (!src_paddr) {
+            // The page has been unmapped after prefault_ool().
+            err = ERR_NOT_FOUND;
+            break;
+        }
+
+        paddr_t dst_paddr =
+            vm_resolve(dst->vm, ALIGN_DOWN(dst_buf, PAGE_SIZE), MAP_W);
+        if (!dst_paddr) {
+            WARN_DBG("%s: ool buffer is not mapped or not writable (%p)",
+                     dst->name, dst_buf);
+            err = ERR_NOT_ACCEPTABLE;
+            break;
+        }
+
+        memcpy(from_paddr(dst_paddr + dst_off), from_paddr(src_paddr + src_off),
+               copy_len);
+        remaining -= copy_len;
+        src_buf += copy_len;
+        dst_buf += copy_len;
+    }
+
+    vm_unlock_two(CURRENT, dst);
+    return err;
+}
+
+/// Consumes the receiver's ool buffer filled by copy_ool() and replaces
+/// `m->ool_ptr` with the address in the receiver. The caller must hold locks
+/// of both tasks.
+static void deliver_ool(struct task *dst, struct message *m) {
+    m->ool_ptr = (void *) dst->ool_buf;
+    dst->ool_buf = 0;
+}
+#else
+static error_t prefault_ool(struct message *m) {
+    return OK;
+}
+
+static error_t copy_ool(struct task *dst, struct message *m) {
+    return OK;
+}
+
+static void deliver_ool(struct task *dst, struct message *m) {
+}
+#endif
+
+/// Returns true if the message being sent from the userland has an ool
+/// payload to be copied by the kernel.
+static bool has_ool(struct message *m, unsigned flags) {
+#ifdef CONFIG_NOMMU
+    // All tasks share the same address space: pass the pointer as it is.
+    return false;
+#else
+    return (flags & IPC_KERNEL) == 0 && !IS_ERROR(m->type)
+           && (m->type & MSG_OOL) != 0;
+#endif
+}
 
 /// Resumes a sender task for the `receiver` tasks and updates `receiver->src`
-/// properly.
-static void resume_sender(struct task *receiver, task_t src) {
-    LIST_FOR_EACH (sender, &receiver->senders, struct task, sender_next) {
-        if (src == IPC_ANY || src == sender->tid) {
-            DEBUG_ASSERT(sender->state == TASK_BLOCKED);
-            DEBUG_ASSERT(sender->src == IPC_DENY);
-            task_resume(sender);
-            list_remove(&sender->sender_next);
-
-            // If src == IPC_ANY, allow only `sender` to send a message since
-            // in the send phase in ipc_slowpath(), `sener` won't recheck
-            // whether the `receiver` is ready for receiving from `sender`.
-            receiver->src = sender->tid;
-            return;
+/// properly. If `src` is IPC_ANY, the sender with the highest priority is
+/// resumed (the oldest one among the same priority). The caller must hold
+/// `receiver->lock`.
+///
+/// Locking a sender while holding the receiver's lock may cause a deadlock.
+/// Thus it returns ERR_TRY_AGAIN if the sender's lock is held by another CPU:
+/// the caller should release the receiver's lock and retry.
+static error_t resume_sender(struct task *receiver, task_t src) {
+    struct task *sender = NULL;
+    LIST_FOR_EACH (t, &receiver->senders, struct task, sender_next) {
+        if (src == t->tid) {
+            sender = t;
+            break;
+        }
+
+        // Senders' priorities are peeked without their locks: it only
+        // affects the order.
+        if (src == IPC_ANY && (!sender || t->prio > sender->prio)) {
+            sender = t;
+        }
+    }
+
+    if (!sender) {
+        receiver->src = src;
+        return OK;
+    }
+
+    if (!spin_trylock(&sender->lock)) {
+        return ERR_TRY_AGAIN;
+    }
+
+    DEBUG_ASSERT(sender->state == TASK_BLOCKED);
+    DEBUG_ASSERT(sender->src == IPC_DENY);
+    task_resume(sender);
+    list_remove(&sender->sender_next);
+    sender->receiver = NULL;
+    spin_unlock(&sender->lock);
+    task_update_prio(receiver);
+
+    // If src == IPC_ANY, allow only `sender` to send a message since
+    // in the send phase in ipc_slowpath(), `sener` won't recheck
+    // whether the `receiver` is ready for receiving from `sender`.
+    receiver->src = sender->tid;
+    return OK;
+}
+
+/// Scheduling context donation: if the current task is going to wait for a
+/// reply from `dst`, `dst` runs on the current task's scheduling context until
+/// it replies, that is, the time spent by `dst` on the call is charged to the
+/// caller (or the caller's caller, and so on). If `dst` has lent its context
+/// to the current task, the message is considered as a reply and the current
+/// task gets back its own context. The caller must hold locks of both tasks.
+///
+/// Priority inheritance: the lender's priority is lent as well (see
+/// task_update_prio()).
+static void donate_sc(struct task *dst, task_t src, unsigned flags) {
+    if (CURRENT->sc_lender == dst) {
+        __atomic_store_n(&CURRENT->sc_lender, NULL, __ATOMIC_RELAXED);
+        task_update_prio(CURRENT);
+    }
+
+    if ((flags & IPC_RECV) && src == dst->tid) {
+        __atomic_store_n(&dst->sc_lender, CURRENT, __ATOMIC_RELAXED);
+        task_update_prio(dst);
+    }
+}
+
+/// Returns true if a sender acceptable for `src` is waiting in the receiver's
+/// `senders` queue. The caller must hold `receiver->lock`.
+static bool has_sender(struct task *receiver, task_t src) {
+    LIST_FOR_EACH (t, &receiver->senders, struct task, sender_next) {
+        if (src == IPC_ANY || src == t->tid) {
+            return true;
         }
     }
 
-    receiver->src = src;
+    return false;
+}
+
+/// Gets ready for blocking in an IPC operation with IPC_TIMEOUT. It returns
+/// false if the timeout has already expired. The caller must hold
+/// `CURRENT->lock`.
+static bool ipc_timer_block(void) {
+    if (CURRENT->ipc_timer_state == IPC_TIMER_EXPIRED) {
+        return false;
+    }
+
+    CURRENT->ipc_timer_state = IPC_TIMER_BLOCKING;
+    return true;
+}
+
+/// Checks whether the current task has been woken up by the IPC timeout. The
+/// caller must hold `CURRENT->lock`.
+static bool ipc_timer_aborted(void) {
+    int state = CURRENT->ipc_timer_state;
+    if (state == IPC_TIMER_BLOCKING) {
+        CURRENT->ipc_timer_state = IPC_TIMER_RUNNING;
+    }
+
+    return state == IPC_TIMER_ABORTED;
+}
+
+/// Waits for a message. The caller must hold `CURRENT->lock`. It returns
+/// without the lock. If `timeout` is true, it returns ERR_TIMEOUT when the IPC
+/// timeout expires.
+static error_t wait_for_message(task_t src, bool timeout) {
+    while (resume_sender(CURRENT, src) != OK) {
+        spin_unlock(&CURRENT->lock);
+        arch_cpu_relax();
+        spin_lock(&CURRENT->lock);
+    }
+
+    if (timeout && !ipc_timer_block()) {
+        // The call has timed out before waiting for the reply.
+        while (task_abort_call(CURRENT) != OK) {
+            spin_unlock(&CURRENT->lock);
+            arch_cpu_relax();
+            spin_lock(&CURRENT->lock);
+        }
+
+        spin_unlock(&CURRENT->lock);
+        return ERR_TIMEOUT;
+    }
+
+    task_block(CURRENT);
+    task_switch();
+
+    if (timeout) {
+        spin_lock(&CURRENT->lock);
+        bool aborted = ipc_timer_aborted();
+        spin_unlock(&CURRENT->lock);
+        if (aborted) {
+            return ERR_TIMEOUT;
+        }
+    }
+
+    return OK;
 }
 
 /// Sends and receives a message. Note that `m` is a user pointer if
 /// IPC_KERNEL is not set!
 static error_t ipc_slowpath(struct task *dst, task_t src, struct message *m,
                             unsigned flags) {
+    bool timeout = IPC_TIMEOUT_FROM_FLAGS(flags) != 0;
+
     // Send a message.
     if (flags & IPC_SEND) {
         // Copy the message into the receiver's buffer.
         // TODO: Do we still need to handle page faults here?
         struct message tmp_m;
         if (flags & IPC_KERNEL) {
-            memcpy(&tmp_m, m, sizeof(struct message));
+            memcpy(&tmp_m, m, msg_len(m->type));
         } else {
-            memcpy_from_user(&tmp_m, (userptr_t) m, sizeof(struct message));
+            copy_msg_from_user(&tmp_m, (userptr_t) m);
+        }
+
+        bool ool = has_ool(&tmp_m, flags);
+        if (ool) {
+            error_t err = prefault_ool(&tmp_m);
+            if (err != OK) {
+                return err;
+            }
         }
 
-        // Check whether the destination (receiver) task is ready for receiving.
-        bool receiver_is_ready =
-            dst->state == TASK_BLOCKED
-            && (dst->src == IPC_ANY || dst->src == CURRENT->tid);
-        if (!receiver_is_ready) {
+        bool slept = false;
+        while (true) {
+            task_lock_two(CURRENT, dst);
+            if (slept && (CURRENT->notifications & NOTIFY_ABORTED)) {
+                // The receiver task has exited. Abort the system call.
+                CURRENT->notifications &= ~NOTIFY_ABORTED;
+                task_unlock_two(CURRENT, dst);
+                return ERR_ABORTED;
+            }
+
+            if (slept && timeout && ipc_timer_aborted()) {
+                task_unlock_two(CURRENT, dst);
+                return ERR_TIMEOUT;
+            }
+
+            if (dst->state == TASK_UNUSED) {
+                // The receiver task has been destroyed.
+                task_unlock_two(CURRENT, dst);
+                return ERR_ABORTED;
+            }
+
+            // Check whether the destination (receiver) task is ready for
+            // receiving.
+            bool receiver_is_ready =
+                dst->state == TASK_BLOCKED
+                && (dst->src == IPC_ANY || dst->src == CURRENT->tid);
+            if (receiver_is_ready) {
+                if (ool) {
+                    // Copy the ool payload into the receiver's buffer.
+                    error_t err = copy_ool(dst, &tmp_m);
+                    if (err != OK) {
+                        task_unlock_two(CURRENT, dst);
+                        return err;
+                    }
+
+                    deliver_ool(dst, &tmp_m);
+                }
+
+                donate_sc(dst, src, flags);
+                break;
+            }
+
+            if (CURRENT->sc_lender == dst) {
+                // The client is not waiting for the reply (e.g. it has timed
+                // out). Don't keep running on its scheduling context.
+                __atomic_store_n(&CURRENT->sc_lender, NULL, __ATOMIC_RELAXED);
+                task_update_prio(CURRENT);
+            }
+
             if (flags & IPC_NOBLOCK) {
+                task_unlock_two(CURRENT, dst);
                 return ERR_WOULD_BLOCK;
             }
 
+            if (timeout && !ipc_timer_block()) {
+                task_unlock_two(CURRENT, dst);
+                return ERR_TIMEOUT;
+            }
+
             // The receiver task is not ready. Sleep until it resumes the
-            // current task.
+            // current task. Meanwhile, the receiver inherits our priority.
             CURRENT->src = IPC_DENY;
             task_block(CURRENT);
             list_push_back(&dst->senders, &CURRENT->sender_next);
+            CURRENT->receiver = dst;
+            task_update_prio(dst);
+            spin_unlock(&dst->lock);
             task_switch();
-
-            if (CURRENT->notifications & NOTIFY_ABORTED) {
-                // The receiver task has exited. Abort the system call.
-                CURRENT->notifications &= ~NOTIFY_ABORTED;
-                return ERR_ABORTED;
-            }
+            slept = true;
         }
 
         // We've gone beyond the point of no return. We must not abort the
@@ -70,11 +388,14 @@ static error_t ipc_slowpath(struct task *dst, task_t src, struct message *m,
 
         // Copy the message.
         tmp_m.src = (flags & IPC_KERNEL) ? KERNEL_TASK : CURRENT->tid;
-        memcpy(&dst->m, &tmp_m, sizeof(dst->m));
+        memcpy(&dst->m, &tmp_m, msg_len(tmp_m.type));
 
         // Resume the receiver task.
         task_resume(dst);
+        task_unlock_two(CURRENT, dst);
 
+        trace_event(TRACE_IPC_SEND, CURRENT->tid, dst->tid, tmp_m.type);
+        CURRENT->stats.ipc_sent++;
 #ifdef CONFIG_TRACE_IPC
         TRACE("IPC: %s: %s -> %s",
               msgtype2str(tmp_m.type), CURRENT->name, dst->name);
@@ -84,36 +405,86 @@ static error_t ipc_slowpath(struct task *dst, task_t src, struct message *m,
     // Receive a message.
     if (flags & IPC_RECV) {
         struct message tmp_m;
-        if (src == IPC_ANY && CURRENT->notifications) {
+        spin_lock(&CURRENT->lock);
+        // Hold NOTIFY_ASYNC back until messages queued by ipc_async() are
+        // received: they may have been sent before the messages the receiver
+        // pulls by async_recv() on NOTIFY_ASYNC (see async_send()).
+        notifications_t pending = CURRENT->notifications;
+        if (CURRENT->async_num > 0) {
+            pending &= ~NOTIFY_ASYNC;
+        }
+
+        if (src == IPC_ANY && pending) {
             // Receive pending notifications as a message.
             bzero(&tmp_m, sizeof(tmp_m));
             tmp_m.type = NOTIFICATIONS_MSG;
             tmp_m.src = KERNEL_TASK;
-            tmp_m.notifications.data = CURRENT->notifications;
-            CURRENT->notifications = 0;
+            tmp_m.notifications.data = pending;
+            tmp_m.notifications.timers =
+                __atomic_exchange_n(&CURRENT->expired_timers, 0,
+                                    __ATOMIC_RELAXED);
+            tmp_m.notifications.irqs =
+                __atomic_exchange_n(&CURRENT->pending_msis, 0,
+                                    __ATOMIC_RELAXED);
+            CURRENT->notifications &= ~pending;
+            spin_unlock(&CURRENT->lock);
+        } else if (src == IPC_ANY && notification_pop(CURRENT, &tmp_m)) {
+            // Received a signaled notification object.
+            spin_unlock(&CURRENT->lock);
+        } else if (src == IPC_ANY && CURRENT->async_num > 0) {
+            // Receive a message queued by ipc_async().
+            struct message *queued = &CURRENT->async_queue[CURRENT->async_head];
+            memcpy(&tmp_m, queued, msg_len(queued->type));
+            CURRENT->async_head =
+                (CURRENT->async_head + 1) % CONFIG_ASYNC_QUEUE_LEN;
+            CURRENT->async_num--;
+            spin_unlock(&CURRENT->lock);
         } else {
+            if ((flags & (IPC_SEND | IPC_NOBLOCK)) == IPC_NOBLOCK
+                && !has_sender(CURRENT, src)) {
+                // A non-blocking receive.
+                spin_unlock(&CURRENT->lock);
+                return ERR_WOULD_BLOCK;
+            }
+
             // Resume a sender task and sleep until a sender task resumes this
             // task...
-            resume_sender(CURRENT, src);
-            task_block(CURRENT);
-            task_switch();
+            error_t err = wait_for_message(src, timeout);
+            if (err != OK) {
+                return err;
+            }
 
             // Copy into `tmp_m` since memcpy_to_user may cause a page fault and
             // CURRENT->m will be overwritten by page fault mesages.
-            memcpy(&tmp_m, &CURRENT->m, sizeof(struct message));
+            memcpy(&tmp_m, &CURRENT->m, msg_len(CURRENT->m.type));
         }
 
         // Received a message. Copy it into the receiver buffer.
         if (flags & IPC_KERNEL) {
-            memcpy(m, &tmp_m, sizeof(struct message));
+            memcpy(m, &tmp_m, msg_len(tmp_m.type));
         } else {
-            memcpy_to_user((userptr_t) m, &tmp_m, sizeof(struct message));
+            memcpy_to_user((userptr_t) m, &tmp_m, msg_len(tmp_m.type));
         }
+
+        trace_event(TRACE_IPC_RECV, CURRENT->tid, tmp_m.src, tmp_m.type);
+        CURRENT->stats.ipc_received++;
     }
 
     return OK;
 }
 
+/// Sends and receives a message with IPC_TIMEOUT: the operation is aborted
+/// with ERR_TIMEOUT if it's blocked for too long.
+static error_t ipc_with_timeout(struct task *dst, task_t src, struct message *m,
+                                unsigned flags) {
+    // The timer is not armed: no need to lock.
+    CURRENT->ipc_timer_state = IPC_TIMER_RUNNING;
+    timer_arm(&CURRENT->ipc_timer, IPC_TIMEOUT_FROM_FLAGS(flags));
+    error_t err = ipc_slowpath(dst, src, m, flags);
+    timer_cancel(&CURRENT->ipc_timer);
+    return err;
+}
+
 /// The IPC fastpath: an IPC implementation optimized for the common case.
 ///
 /// Note that `m` is a user pointer if IPC_KERNEL is not set!
@@ -123,8 +494,13 @@ error_t ipc(struct task *dst, task_t src, struct message *m, unsigned flags) {
         return ERR_INVALID_ARG;
     }
 
+    if (IPC_TIMEOUT_FROM_FLAGS(flags)) {
+        return ipc_with_timeout(dst, src, m, flags);
+    }
+
 #ifdef CONFIG_IPC_FASTPATH
-    // Check if the message can be sent in the fastpath.
+    // Check if the message can be sent in the fastpath. Here we peek the
+    // fields without locks: they're checked again after acquiring locks.
     DEBUG_ASSERT((flags & IPC_SEND) == 0 || dst);
     int fastpath =
         // The fastpath implements only ipc_call() and ipc_replyrecv().
@@ -132,46 +508,212 @@ error_t ipc(struct task *dst, task_t src, struct message *m, unsigned flags) {
         // The receiver is already waiting for us.
         && dst->state == TASK_BLOCKED
         && (dst->src == IPC_ANY || dst->src == CURRENT->tid)
-        // The fastpath doesn't receive pending notifications.
-        && CURRENT->notifications == 0;
+        // The fastpath doesn't receive pending notifications, signaled
+        // objects, and async messages.
+        && CURRENT->notifications == 0 && !notification_pending(CURRENT)
+        && CURRENT->async_num == 0;
 
     if (!fastpath) {
         return ipc_slowpath(dst, src, m, flags);
     }
 
-    // THe send phase: copy the message and resume the receiver task. Note
-    // that this user copy may cause a page fault.
-    memcpy_from_user(&dst->m, (userptr_t) m, sizeof(struct message));
+    // Copy the message before acquiring locks: this user copy may cause a
+    // page fault.
+    struct message tmp_m;
+    copy_msg_from_user(&tmp_m, (userptr_t) m);
+    bool ool = has_ool(&tmp_m, flags);
+    if (ool) {
+        error_t err = prefault_ool(&tmp_m);
+        if (err != OK) {
+            return err;
+        }
+    }
+
+    task_lock_two(CURRENT, dst);
+    fastpath = dst->state == TASK_BLOCKED
+               && (dst->src == IPC_ANY || dst->src == CURRENT->tid)
+               && CURRENT->notifications == 0 && !notification_pending(CURRENT)
+               && CURRENT->async_num == 0
+               // The receiver runs on this CPU.
+               && task_cpu_allowed(dst, mp_self());
+    if (!fastpath) {
+        // The receiver is no longer ready (e.g. it has received a
+        // notification from another CPU).
+        task_unlock_two(CURRENT, dst);
+        return ipc_slowpath(dst, src, m, flags);
+    }
+
+    // Copy the ool payload into the receiver's buffer before changing any
+    // state: the IPC may fail here.
+    if (ool) {
+        error_t err = copy_ool(dst, &tmp_m);
+        if (err != OK) {
+            task_unlock_two(CURRENT, dst);
+            return err;
+        }
+    }
+
+    // Get ready for receiving a reply. This fails only if a sender's lock is
+    // being held by another CPU: the slowpath copies the payload again.
+    if (resume_sender(CURRENT, src) != OK) {
+        task_unlock_two(CURRENT, dst);
+        return ipc_slowpath(dst, src, m, flags);
+    }
+
+    if (ool) {
+        deliver_ool(dst, &tmp_m);
+    }
+
+    donate_sc(dst, src, flags);
+
+    // THe send phase: copy the message and mark the receiver task as
+    // runnable. We don't enqueue it into the runqueue: since the current task
+    // is going to block, we switch into the receiver directly below. Keep
+    // holding its lock until the switch completes so that no other CPU
+    // destroys it in the meantime.
+    memcpy(&dst->m, &tmp_m, msg_len(tmp_m.type));
     dst->m.src = CURRENT->tid;
-    task_resume(dst);
+    dst->state = TASK_RUNNABLE;
+    dst->stats.blocked_cycles += arch_read_cycles() - dst->blocked_at;
 
+    trace_event(TRACE_IPC_SEND, CURRENT->tid, dst->tid, dst->m.type);
+    CURRENT->stats.ipc_sent++;
 #ifdef CONFIG_TRACE_IPC
     TRACE("IPC: %s: %s -> %s (fastpath)",
           msgtype2str(dst->m.type), CURRENT->name, dst->name);
 #endif
 
-    // The receive phase: wait for a message, copy it into the user's
-    // buffer, and return to the user.
-    resume_sender(CURRENT, src);
+    // The receive phase: hand the CPU over to the receiver and wait for a
+    // message, copy it into the user's buffer, and return to the user.
     task_block(CURRENT);
-    task_switch();
+    task_switch_to(dst);
 
     // This user copy should not cause a page fault since we've filled the
     // page in the user copy above.
-    memcpy_to_user((userptr_t) m, &CURRENT->m, sizeof(struct message));
+    memcpy_to_user((userptr_t) m, &CURRENT->m, msg_len(CURRENT->m.type));
+    trace_event(TRACE_IPC_RECV, CURRENT->tid, CURRENT->m.src, CURRENT->m.type);
+    CURRENT->stats.ipc_received++;
     return OK;
 #else
     return ipc_slowpath(dst, src, m, flags);
 #endif // CONFIG_IPC_FASTPATH
 }
 
-// Notifies notifications to the task.
+/// Sends a message asynchronously: if the receiver is waiting for a message
+/// from any task, the message is delivered immediately. Otherwise, it's
+/// queued into the receiver's async queue. It never blocks: it returns
+/// ERR_WOULD_BLOCK if the queue is full. The caller must not hold any task
+/// locks. Note that `m` is a user pointer!
+error_t ipc_async(struct task *dst, struct message *m) {
+    if (dst == CURRENT) {
+        return ERR_INVALID_ARG;
+    }
+
+    struct message tmp_m;
+    copy_msg_from_user(&tmp_m, (userptr_t) m);
+    if (has_ool(&tmp_m, 0)) {
+        // The kernel has no buffer to hold ool payloads.
+        return ERR_NOT_ACCEPTABLE;
+    }
+
+    tmp_m.src = CURRENT->tid;
+    error_t err = OK;
+    spin_lock(&dst->lock);
+    if (dst->state == TASK_UNUSED) {
+        // The task has been destroyed.
+        err = ERR_ABORTED;
+    } else if (dst->state == TASK_BLOCKED && dst->src == IPC_ANY
+               && dst->async_num == 0) {
+        // The receiver is waiting for a message. Deliver it immediately.
+        memcpy(&dst->m, &tmp_m, msg_len(tmp_m.type));
+        task_resume(dst);
+    } else if (dst->async_num == CONFIG_ASYNC_QUEUE_LEN) {
+        err = ERR_WOULD_BLOCK;
+    } else {
+        unsigned index =
+            (dst->async_head + dst->async_num) % CONFIG_ASYNC_QUEUE_LEN;
+        memcpy(&dst->async_queue[index], &tmp_m, msg_len(tmp_m.type));
+        dst->async_num++;
+    }
+    spin_unlock(&dst->lock);
+
+    if (err == OK) {
+        trace_event(TRACE_IPC_SEND, CURRENT->tid, dst->tid, tmp_m.type);
+        CURRENT->stats.ipc_sent++;
+    }
+
+#ifdef CONFIG_TRACE_IPC
+    if (err == OK) {
+        TRACE("IPC: %s: %s -> %s (async)",
+              msgtype2str(tmp_m.type), CURRENT->name, dst->name);
+    }
+#endif
+
+    return err;
+}
+
+/// Aborts the IPC operation which the task is blocked in since its
+/// IPC_TIMEOUT has expired. If it's not blocked, the operation fails when it's
+/// about to block. It's called by the timer: the caller must not hold any task
+/// locks.
+void ipc_timeout(struct task *task) {
+    while (true) {
+        spin_lock(&task->lock);
+        if (task->state != TASK_BLOCKED
+            || task->ipc_timer_state != IPC_TIMER_BLOCKING) {
+            task->ipc_timer_state = IPC_TIMER_EXPIRED;
+            spin_unlock(&task->lock);
+            return;
+        }
+
+        struct task *receiver = task->receiver;
+        if (receiver) {
+            // Blocked in the send phase: leave the receiver's queue. Don't
+            // wait for the receiver's lock since it's acquired in an
+            // arbitrary order.
+            if (!spin_trylock(&receiver->lock)) {
+                spin_unlock(&task->lock);
+                arch_cpu_relax();
+                continue;
+            }
+
+            list_remove(&task->sender_next);
+            task->receiver = NULL;
+            task_update_prio(receiver);
+            spin_unlock(&receiver->lock);
+        } else if (task_abort_call(task) != OK) {
+            // Blocked in the receive phase of a call: take back the
+            // scheduling context lent to the callee.
+            spin_unlock(&task->lock);
+            arch_cpu_relax();
+            continue;
+        }
+
+        task->src = IPC_DENY;
+        task->ipc_timer_state = IPC_TIMER_ABORTED;
+        task_resume(task);
+        spin_unlock(&task->lock);
+        return;
+    }
+}
+
+// Notifies notifications to the task. The caller must not hold any task
+// locks.
 void notify(struct task *dst, notifications_t notifications) {
-    if (dst->state == TASK_BLOCKED && dst->src == IPC_ANY) {
+    trace_event(TRACE_NOTIFY, dst->tid, notifications, 0);
+    spin_lock(&dst->lock);
+    dst->stats.notifications++;
+    if (dst->state == TASK_UNUSED) {
+        // The task has been destroyed.
+    } else if (dst->state == TASK_BLOCKED && dst->src == IPC_ANY) {
         // Send a NOTIFICATIONS_MSG message immediately.
         dst->m.type = NOTIFICATIONS_MSG;
         dst->m.src = KERNEL_TASK;
         dst->m.notifications.data = dst->notifications | notifications;
+        dst->m.notifications.timers =
+            __atomic_exchange_n(&dst->expired_timers, 0, __ATOMIC_RELAXED);
+        dst->m.notifications.irqs =
+            __atomic_exchange_n(&dst->pending_msis, 0, __ATOMIC_RELAXED);
         dst->notifications = 0;
         task_resume(dst);
     } else {
@@ -179,4 +721,5 @@ void notify(struct task *dst, notifications_t notifications) {
         // pending notifications instead.
         dst->notifications |= notifications;
     }
+    spin_unlock(&dst->lock);
 }
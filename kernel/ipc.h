@@ -6,6 +6,19 @@
 struct task;
 struct message;
 __mustuse error_t ipc(struct task *dst, task_t src, struct message *m, unsigned flags);
+error_t ipc_async(struct task *dst, struct message *m);
 void notify(struct task *dst, notifications_t notifications);
+void ipc_timeout(struct task *task);
+
+/// States of `task->ipc_timer_state`.
+/// The timer is armed (or not used) and the task is not blocked.
+#define IPC_TIMER_RUNNING  0
+/// The task is blocked in IPC: the timer aborts the operation.
+#define IPC_TIMER_BLOCKING 1
+/// The timer has expired while the task was not blocked: the operation fails
+/// when it's about to block.
+#define IPC_TIMER_EXPIRED  2
+/// The timer has aborted the blocked operation.
+#define IPC_TIMER_ABORTED  3
 
 #endif
@@ -1,5 +1,6 @@
 #include <string.h>
 #include "kdebug.h"
+#include "profiler.h"
 #include "task.h"
 
 error_t kdebug_run(const char *cmdline) {
@@ -9,11 +10,27 @@ error_t kdebug_run(const char *cmdline) {
     } else if (strcmp(cmdline, "help") == 0) {
         DPRINTK("Kernel debugger commands:\n");
         DPRINTK("\n");
-        DPRINTK("  ps - List tasks.\n");
-        DPRINTK("  q  - Quit the emulator.\n");
+        DPRINTK("  ps    - List tasks.\n");
+        DPRINTK("  locks - Show lock contention statistics.\n");
+        DPRINTK("  top   - Show per-task performance counters.\n");
+#ifdef CONFIG_PROFILER
+        DPRINTK("  profile start - Start the sampling profiler.\n");
+        DPRINTK("  profile stop  - Stop the sampling profiler.\n");
+#endif
+        DPRINTK("  q     - Quit the emulator.\n");
         DPRINTK("\n");
     } else if (strcmp(cmdline, "ps") == 0) {
         task_dump();
+    } else if (strcmp(cmdline, "locks") == 0) {
+        task_dump_locks();
+    } else if (strcmp(cmdline, "top") == 0) {
+        task_dump_top();
+#ifdef CONFIG_PROFILER
+    } else if (strcmp(cmdline, "profile start") == 0) {
+        profiler_start();
+    } else if (strcmp(cmdline, "profile stop") == 0) {
+        profiler_stop();
+#endif
     } else if (strcmp(cmdline, "q") == 0) {
         arch_semihosting_halt();
         PANIC("halted by the kdebug");
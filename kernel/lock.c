@@ -0,0 +1,59 @@
+#include "lock.h"
+#include "printk.h"
+#include "task.h"
+
+/// Initializes a spinlock.
+void spin_lock_init(struct spinlock *lock) {
+    lock->lock = SPINLOCK_UNLOCKED;
+    lock->owner = NO_LOCK_OWNER;
+    lock->num_acquired = 0;
+    lock->num_contended = 0;
+}
+
+/// Tries to acquire the lock. Returns false if the lock is being held by
+/// another CPU.
+bool spin_trylock(struct spinlock *lock) {
+    DEBUG_ASSERT(lock->lock == SPINLOCK_LOCKED
+                 || lock->lock == SPINLOCK_UNLOCKED);
+
+    if (!__sync_bool_compare_and_swap(&lock->lock, SPINLOCK_UNLOCKED,
+                                      SPINLOCK_LOCKED)) {
+        return false;
+    }
+
+    lock->owner = mp_self();
+    lock->num_acquired++;
+    return true;
+}
+
+/// Acquires the lock. It spins until the lock gets available.
+void spin_lock(struct spinlock *lock) {
+    if (lock->owner == mp_self()) {
+        PANIC("recursive lock (#%d)", mp_self());
+    }
+
+    if (spin_trylock(lock)) {
+        return;
+    }
+
+    // The lock is being held by another CPU. Note that we increment the
+    // counter after acquiring the lock to avoid a data race.
+    while (!spin_trylock(lock)) {
+        arch_cpu_relax();
+    }
+
+    lock->num_contended++;
+}
+
+/// Releases the lock.
+void spin_unlock(struct spinlock *lock) {
+    DEBUG_ASSERT(lock->owner == mp_self());
+    lock->owner = NO_LOCK_OWNER;
+    __sync_bool_compare_and_swap(&lock->lock, SPINLOCK_LOCKED,
+                                 SPINLOCK_UNLOCKED);
+}
+
+/// Returns true if the current CPU holds the lock.
+bool spin_is_locked_by_me(struct spinlock *lock) {
+    return lock->lock == SPINLOCK_LOCKED && lock->owner == mp_self();
+}
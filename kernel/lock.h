@@ -0,0 +1,31 @@
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
+#include <types.h>
+
+#define SPINLOCK_LOCKED   0x12ab
+#define SPINLOCK_UNLOCKED 0xc0be
+#define NO_LOCK_OWNER     -1
+
+/// A spinlock. Note that interrupts are disabled in the kernel mode: we don't
+/// need to disable interrupts while holding a lock.
+struct spinlock {
+    /// SPINLOCK_LOCKED or SPINLOCK_UNLOCKED.
+    volatile int lock;
+    /// The CPU which holds the lock. It's NO_LOCK_OWNER if the lock is not
+    /// held.
+    volatile int owner;
+    /// The number of times the lock has been acquired.
+    uint64_t num_acquired;
+    /// The number of times a CPU had to spin because the lock was being held
+    /// by another CPU.
+    uint64_t num_contended;
+};
+
+void spin_lock_init(struct spinlock *lock);
+void spin_lock(struct spinlock *lock);
+__mustuse bool spin_trylock(struct spinlock *lock);
+void spin_unlock(struct spinlock *lock);
+bool spin_is_locked_by_me(struct spinlock *lock);
+
+#endif
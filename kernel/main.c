@@ -106,7 +106,6 @@ void map_bootelf(struct bootelf_header *header, struct vm *vm) {
 __noreturn void kmain(void) {
     printf("\nBooting Resea " VERSION "...\n");
     task_init();
-    mp_start();
 
     char name[CONFIG_TASK_NAME_LEN];
     struct bootelf_header *bootelf = locate_bootelf_header();
@@ -116,10 +115,13 @@ __noreturn void kmain(void) {
     // Create the first userland task.
     struct task *task = task_lookup_unchecked(INIT_TASK);
     ASSERT(task);
-    error_t err = task_create(task, name, bootelf->entry, NULL, 0);
+    error_t err = task_create(task, name, bootelf->entry, 0, NULL, 0);
     ASSERT_OK(err);
-    map_bootelf(bootelf, &task->vm);
+    map_bootelf(bootelf, task->vm);
 
+    // Start other CPUs after the first task gets ready to run: they may steal
+    // it from the runqueue.
+    mp_start();
     mpmain();
 }
 
@@ -128,7 +130,7 @@ __noreturn void mpmain(void) {
 
     // Initialize the idle task for this CPU.
     IDLE_TASK->tid = 0;
-    error_t err = task_create(IDLE_TASK, "(idle)", 0, 0, 0);
+    error_t err = task_create(IDLE_TASK, "(idle)", 0, 0, NULL, 0);
     ASSERT_OK(err);
     CURRENT = IDLE_TASK;
 
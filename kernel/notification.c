@@ -0,0 +1,209 @@
+#include <string.h>
+#include "notification.h"
+#include "printk.h"
+#include "task.h"
+
+/// All notification objects. The object ID is the index plus 1.
+static struct notification objects[CONFIG_NUM_NOTIFICATIONS];
+/// The lock for objects' `owner` and `senders`. It's acquired before task
+/// locks.
+static struct spinlock notification_lock;
+
+/// Returns the object for the ID if it's owned by `owner`. The caller must
+/// hold `notification_lock`.
+static struct notification *lookup_owned(struct task *owner, int id) {
+    if (id <= 0 || id > CONFIG_NUM_NOTIFICATIONS) {
+        return NULL;
+    }
+
+    struct notification *obj = &objects[id - 1];
+    return (obj->owner == owner) ? obj : NULL;
+}
+
+/// Allocates a notification object which `owner` waits on. It returns the
+/// object ID.
+int notification_create(struct task *owner) {
+    spin_lock(&notification_lock);
+    for (int i = 0; i < CONFIG_NUM_NOTIFICATIONS; i++) {
+        struct notification *obj = &objects[i];
+        if (!obj->owner) {
+            memset(obj->senders, 0, sizeof(obj->senders));
+            obj->word = 0;
+            obj->owner = owner;
+            spin_unlock(&notification_lock);
+            return i + 1;
+        }
+    }
+
+    spin_unlock(&notification_lock);
+    return ERR_NO_MEMORY;
+}
+
+/// Frees the object. Pending badges are discarded.
+error_t notification_destroy(struct task *owner, int id) {
+    spin_lock(&notification_lock);
+    struct notification *obj = lookup_owned(owner, id);
+    if (!obj) {
+        spin_unlock(&notification_lock);
+        return ERR_NOT_FOUND;
+    }
+
+    spin_lock(&owner->lock);
+    owner->pending_objects[(id - 1) / 64] &= ~(1ull << ((id - 1) % 64));
+    obj->word = 0;
+    obj->owner = NULL;
+    spin_unlock(&owner->lock);
+    spin_unlock(&notification_lock);
+    return OK;
+}
+
+/// Allows `task` to signal the object with `badge`, or disallows it if `badge`
+/// is 0. A task has at most one badge for each object: minting again replaces
+/// it.
+error_t notification_mint(struct task *owner, int id, task_t task,
+                          uint32_t badge) {
+    if (!task_lookup(task)) {
+        return ERR_INVALID_TASK;
+    }
+
+    spin_lock(&notification_lock);
+    struct notification *obj = lookup_owned(owner, id);
+    if (!obj) {
+        spin_unlock(&notification_lock);
+        return ERR_NOT_FOUND;
+    }
+
+    int free_slot = -1;
+    for (int i = 0; i < CONFIG_NOTIFICATION_SENDERS; i++) {
+        if (obj->senders[i].task == task) {
+            obj->senders[i].badge = badge;
+            if (!badge) {
+                obj->senders[i].task = 0;
+            }
+
+            spin_unlock(&notification_lock);
+            return OK;
+        }
+
+        if (free_slot < 0 && !obj->senders[i].task) {
+            free_slot = i;
+        }
+    }
+
+    error_t err = OK;
+    if (badge) {
+        if (free_slot < 0) {
+            err = ERR_NO_MEMORY;
+        } else {
+            obj->senders[free_slot].task = task;
+            obj->senders[free_slot].badge = badge;
+        }
+    }
+
+    spin_unlock(&notification_lock);
+    return err;
+}
+
+/// ORs the sender's badge into the object and wakes up the owner if it's
+/// waiting for a message from any task. It never blocks. The caller must not
+/// hold any task locks.
+error_t notification_signal(struct task *sender, int id) {
+    if (id <= 0 || id > CONFIG_NUM_NOTIFICATIONS) {
+        return ERR_NOT_FOUND;
+    }
+
+    spin_lock(&notification_lock);
+    struct notification *obj = &objects[id - 1];
+    struct task *owner = obj->owner;
+    uint32_t badge = 0;
+    for (int i = 0; owner && i < CONFIG_NOTIFICATION_SENDERS; i++) {
+        if (obj->senders[i].task == sender->tid) {
+            badge = obj->senders[i].badge;
+            break;
+        }
+    }
+
+    if (!badge) {
+        spin_unlock(&notification_lock);
+        return ERR_NOT_PERMITTED;
+    }
+
+    spin_lock(&owner->lock);
+    obj->word |= badge;
+    owner->pending_objects[(id - 1) / 64] |= 1ull << ((id - 1) % 64);
+    if (owner->state == TASK_BLOCKED && owner->src == IPC_ANY) {
+        // The owner is waiting for a message. Deliver it immediately.
+        notification_pop(owner, &owner->m);
+        task_resume(owner);
+    }
+    spin_unlock(&owner->lock);
+    spin_unlock(&notification_lock);
+    return OK;
+}
+
+/// Returns true if one of the task's objects is signaled. The caller must hold
+/// `task->lock` or re-check it with the lock held.
+bool notification_pending(struct task *task) {
+    for (int i = 0; i < NOTIFICATION_WORDS; i++) {
+        if (task->pending_objects[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Takes the first signaled object of the task as a SIGNALED_MSG message. It
+/// returns false if there's none. The caller must hold `task->lock`.
+bool notification_pop(struct task *task, struct message *m) {
+    int word = 0;
+    while (word < NOTIFICATION_WORDS && !task->pending_objects[word]) {
+        word++;
+    }
+
+    if (word == NOTIFICATION_WORDS) {
+        return false;
+    }
+
+    int index = word * 64 + __builtin_ctzll(task->pending_objects[word]);
+    struct notification *obj = &objects[index];
+    task->pending_objects[word] &= ~(1ull << (index % 64));
+    bzero(m, sizeof(*m));
+    m->type = SIGNALED_MSG;
+    m->src = KERNEL_TASK;
+    m->signaled.object = index + 1;
+    m->signaled.badges = obj->word;
+    obj->word = 0;
+    return true;
+}
+
+/// Frees objects owned by the task and revokes its badges for other objects.
+/// It's called when the task is destroyed.
+void notification_cleanup(struct task *task) {
+    spin_lock(&notification_lock);
+    for (int i = 0; i < CONFIG_NUM_NOTIFICATIONS; i++) {
+        struct notification *obj = &objects[i];
+        if (obj->owner == task) {
+            obj->word = 0;
+            obj->owner = NULL;
+            continue;
+        }
+
+        for (int j = 0; j < CONFIG_NOTIFICATION_SENDERS; j++) {
+            if (obj->senders[j].task == task->tid) {
+                obj->senders[j].task = 0;
+                obj->senders[j].badge = 0;
+            }
+        }
+    }
+
+    memset(task->pending_objects, 0, sizeof(task->pending_objects));
+    spin_unlock(&notification_lock);
+}
+
+void notification_init(void) {
+    spin_lock_init(&notification_lock);
+    for (int i = 0; i < CONFIG_NUM_NOTIFICATIONS; i++) {
+        objects[i].owner = NULL;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef __NOTIFICATION_H__
+#define __NOTIFICATION_H__
+
+#include <config.h>
+#include <types.h>
+
+struct task;
+struct message;
+
+/// The number of words in the bitmap of signaled objects (see
+/// `task->pending_objects`).
+#define NOTIFICATION_WORDS (ALIGN_UP(CONFIG_NUM_NOTIFICATIONS, 64) / 64)
+
+/// A notification object: a word of badges that its owner task waits on. A
+/// task allowed by the owner to signal the object ORs its badge into the word,
+/// and the owner receives the object ID and the word as a SIGNALED_MSG
+/// message. Unlike task notifications, the owner can tell which sources have
+/// fired from the object and badges.
+struct notification {
+    /// The task which waits on this object. It's NULL if it's not in use.
+    struct task *owner;
+    /// The pending badges. Protected by `owner->lock`.
+    uint32_t word;
+    /// The tasks allowed to signal this object and their badges.
+    struct {
+        task_t task;
+        uint32_t badge;
+    } senders[CONFIG_NOTIFICATION_SENDERS];
+};
+
+__mustuse int notification_create(struct task *owner);
+__mustuse error_t notification_destroy(struct task *owner, int id);
+__mustuse error_t notification_mint(struct task *owner, int id, task_t task,
+                                    uint32_t badge);
+__mustuse error_t notification_signal(struct task *sender, int id);
+bool notification_pending(struct task *task);
+bool notification_pop(struct task *task, struct message *m);
+void notification_cleanup(struct task *task);
+void notification_init(void);
+
+#endif
@@ -1,12 +1,18 @@
 #include "printk.h"
 #include "ipc.h"
+#include "lock.h"
 #include <string.h>
 #include <vprintf.h>
 
 static struct klog klog;
+static struct spinlock klog_lock = {
+    .lock = SPINLOCK_UNLOCKED,
+    .owner = NO_LOCK_OWNER,
+};
 
 /// Reads the kernel log buffer.
 size_t klog_read(char *buf, size_t buf_len) {
+    spin_lock(&klog_lock);
     size_t remaining = buf_len;
     if (klog.tail > klog.head) {
         int copy_len = MIN(remaining, CONFIG_KLOG_BUF_SIZE - klog.tail);
@@ -20,17 +26,20 @@ size_t klog_read(char *buf, size_t buf_len) {
     memcpy(buf, &klog.buf[klog.tail], copy_len);
     remaining -= copy_len;
     klog.tail = (klog.tail + copy_len) % CONFIG_KLOG_BUF_SIZE;
+    spin_unlock(&klog_lock);
     return buf_len - remaining;
 }
 
 /// Writes a character into the kernel log buffer.
 void klog_write(char ch) {
+    spin_lock(&klog_lock);
     klog.buf[klog.head] = ch;
     klog.head = (klog.head + 1) % CONFIG_KLOG_BUF_SIZE;
     if (klog.head == klog.tail) {
         // The buffer is full. Discard a character by moving the tail.
         klog.tail = (klog.tail + 1) % CONFIG_KLOG_BUF_SIZE;
     }
+    spin_unlock(&klog_lock);
 }
 
 static void printchar(__unused struct vprintf_context *ctx, char ch) {
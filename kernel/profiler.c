@@ -0,0 +1,122 @@
+#include <string.h>
+#include "lock.h"
+#include "printk.h"
+#include "profiler.h"
+#include "task.h"
+#include "timer.h"
+
+/// Samples taken on a CPU.
+struct profiler_buffer {
+    struct profile_sample samples[CONFIG_PROFILER_BUFFER_LEN];
+    /// The index of the oldest sample not read yet.
+    unsigned head;
+    /// The number of samples written into `samples`. Samples in
+    /// `samples[head..num)` are not read yet.
+    unsigned num;
+    /// The number of samples discarded since the buffer was full.
+    uint64_t dropped;
+    /// The lock. The CPU taking samples contends with readers only.
+    struct spinlock lock;
+};
+
+// The layout is a part of the ABI: tools/profile2folded.py decodes it.
+STATIC_ASSERT(sizeof(struct profile_sample) == 40);
+
+static struct profiler_buffer buffers[CPU_NUM_MAX];
+/// True if the profiler is taking samples.
+static bool enabled = false;
+
+/// Records the instruction pointers interrupted by the timer interrupt. It's
+/// called by the arch's timer interrupt handler on each CPU. `kernel_ip` is 0
+/// if the CPU was in the user space. Otherwise, `user_ip` is the one saved when
+/// the current task entered the kernel (0 for the idle task).
+void profiler_sample(vaddr_t user_ip, vaddr_t kernel_ip) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    struct profiler_buffer *buf = &buffers[mp_self()];
+    spin_lock(&buf->lock);
+    if (buf->num == CONFIG_PROFILER_BUFFER_LEN) {
+        buf->dropped++;
+        spin_unlock(&buf->lock);
+        return;
+    }
+
+    struct profile_sample *sample = &buf->samples[buf->num++];
+    sample->user_ip = user_ip;
+    sample->kernel_ip = kernel_ip;
+    sample->task = CURRENT->tid;
+    sample->cpu = mp_self();
+    strncpy(sample->name, CURRENT->name, sizeof(sample->name));
+    spin_unlock(&buf->lock);
+}
+
+/// Returns true if the profiler is taking samples.
+bool profiler_enabled(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+/// Starts taking samples.
+void profiler_start(void) {
+    __atomic_store_n(&enabled, true, __ATOMIC_RELAXED);
+#ifdef CONFIG_TICKLESS
+    // Samples are taken on timer interrupts: let CPUs reprogram their timer
+    // to fire every tick (see timer_reload()) instead of sleeping until the
+    // next event.
+    timer_reload(CURRENT);
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        if (cpu != mp_self()) {
+            mp_timer_reload(cpu);
+        }
+    }
+#endif
+}
+
+/// Stops taking samples. Samples not read yet are kept.
+void profiler_stop(void) {
+    __atomic_store_n(&enabled, false, __ATOMIC_RELAXED);
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        struct profiler_buffer *buf = &buffers[cpu];
+        spin_lock(&buf->lock);
+        if (buf->dropped) {
+            WARN("profiler: dropped %llu samples on CPU #%d (buffer is full)",
+                 (unsigned long long) buf->dropped, cpu);
+            buf->dropped = 0;
+        }
+        spin_unlock(&buf->lock);
+    }
+}
+
+/// Reads and consumes up to `max` samples from all CPUs' buffers. It returns
+/// the number of samples read. Samples are ordered by CPU and, within a CPU,
+/// from the oldest one.
+int profiler_read(struct profile_sample *buf, int max) {
+    int n = 0;
+    for (int cpu = 0; cpu < mp_num_cpus() && n < max; cpu++) {
+        struct profiler_buffer *pb = &buffers[cpu];
+        spin_lock(&pb->lock);
+        int num = MIN((int) (pb->num - pb->head), max - n);
+        memcpy(&buf[n], &pb->samples[pb->head], num * sizeof(*buf));
+        pb->head += num;
+        if (pb->head == pb->num) {
+            // All samples have been read: reuse the buffer from the start.
+            pb->head = 0;
+            pb->num = 0;
+        }
+
+        n += num;
+        spin_unlock(&pb->lock);
+    }
+
+    return n;
+}
+
+void profiler_init(void) {
+    for (int cpu = 0; cpu < CPU_NUM_MAX; cpu++) {
+        spin_lock_init(&buffers[cpu].lock);
+        buffers[cpu].head = 0;
+        buffers[cpu].num = 0;
+        buffers[cpu].dropped = 0;
+    }
+}
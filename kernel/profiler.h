@@ -0,0 +1,25 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <config.h>
+#include <types.h>
+#include <message.h>
+
+#ifdef CONFIG_PROFILER
+void profiler_sample(vaddr_t user_ip, vaddr_t kernel_ip);
+bool profiler_enabled(void);
+void profiler_start(void);
+void profiler_stop(void);
+__mustuse int profiler_read(struct profile_sample *buf, int max);
+void profiler_init(void);
+#else
+static inline void profiler_sample(__unused vaddr_t user_ip,
+                                   __unused vaddr_t kernel_ip) {
+}
+
+static inline bool profiler_enabled(void) {
+    return false;
+}
+#endif
+
+#endif
@@ -4,9 +4,12 @@
 #include <types.h>
 #include "ipc.h"
 #include "kdebug.h"
+#include "notification.h"
 #include "printk.h"
+#include "profiler.h"
 #include "syscall.h"
 #include "task.h"
+#include "trace.h"
 
 /// Copies bytes from the userspace. If the user's pointer is invalid, this
 /// function or the page fault handler kills the current task.
@@ -77,34 +80,138 @@ static error_t sys_exec(task_t tid, userptr_t name, vaddr_t ip, task_t pager,
         }
 
         char namebuf[CONFIG_TASK_NAME_LEN];
-        strncpy_from_user(namebuf, name, sizeof(namebuf) - 1);
-        return task_create(task, namebuf, ip, pager_task, flags);
+        vaddr_t sp = 0;
+        if (TASK_VM_FROM_FLAGS(flags)) {
+            // Create a thread. It's named after the task which owns the
+            // address space, and `name` is its initial stack pointer instead.
+            struct task *owner = task_lookup(TASK_VM_FROM_FLAGS(flags));
+            if (!owner) {
+                return ERR_INVALID_ARG;
+            }
+
+            if (!SYSCALL_AUTH(owner)) {
+                return ERR_NOT_PERMITTED;
+            }
+
+            strncpy(namebuf, owner->name, sizeof(namebuf));
+            sp = name;
+        } else {
+            strncpy_from_user(namebuf, name, sizeof(namebuf) - 1);
+        }
+
+        spin_lock(&task->lock);
+        error_t err = task_create(task, namebuf, ip, sp, pager_task, flags);
+        spin_unlock(&task->lock);
+        return err;
     } else {
         // Destroys a task.
         return task_destroy(task);
     }
 }
 
-/// Sets task's timer and updates an IRQ ownership. Note that `irq` is 1-based:
-/// irq=1 means "listening to IRQ 0", not IRQ 1.
-static task_t sys_listen(msec_t timeout, int irq) {
+/// Returns true if the current task is allowed to receive IRQs: only device
+/// drivers, i.e. tasks created with TASK_IO, are.
+static bool irq_allowed(void) {
+    if (!(CURRENT->flags & TASK_IO)) {
+        WARN_DBG("%s: tried to listen for an IRQ without TASK_IO",
+                 CURRENT->name);
+        return false;
+    }
+
+    return true;
+}
+
+/// Sets task's `timer`-th timer and updates an IRQ ownership. Note that `irq`
+/// is 1-based: irq=1 means "listening to IRQ 0", not IRQ 1. When listening,
+/// the IRQ is delivered to `cpu` (-1 to follow the task's CPU affinity). A
+/// task may call it again for an IRQ it owns to change the CPU. Listening
+/// requires TASK_IO.
+static task_t sys_listen(msec_t timeout, int irq, unsigned timer, int cpu) {
     if (timeout >= 0) {
-        CURRENT->timeout = timeout;
+        if (timer >= CONFIG_NUM_TIMERS_PER_TASK) {
+            return ERR_INVALID_ARG;
+        }
+
+        timer_arm(&CURRENT->timers[timer], timeout);
     }
 
     if (irq != 0) {
         if (irq > 0) {
-            return task_listen_irq(CURRENT, irq - 1);
+            if (!irq_allowed()) {
+                return ERR_NOT_PERMITTED;
+            }
+
+            return task_listen_irq(CURRENT, irq - 1, cpu);
         } else {
-            return task_unlisten_irq(irq - 1);
+            return task_unlisten_irq(CURRENT, -irq - 1);
         }
     }
 
     return OK;
 }
 
-/// Send/receive IPC messages and notifications.
-static error_t sys_ipc(task_t dst, task_t src, userptr_t m, unsigned flags) {
+/// Allocates (or reroutes) the current task's `index`-th MSI and writes the
+/// message to be programmed into the device into `msg`. If `msg` is zero, it
+/// frees the MSI instead. Allocating requires TASK_IO as in sys_listen().
+static error_t sys_msi(unsigned index, int cpu, userptr_t msg) {
+    if (!msg) {
+        return task_free_msi(CURRENT, index);
+    }
+
+    if (!irq_allowed()) {
+        return ERR_NOT_PERMITTED;
+    }
+
+    struct msi_message kmsg;
+    error_t err = task_alloc_msi(CURRENT, index, cpu, &kmsg.addr, &kmsg.data);
+    if (err != OK) {
+        return err;
+    }
+
+    memcpy_to_user(msg, &kmsg, sizeof(kmsg));
+    return OK;
+}
+
+/// Operates on notification objects. Only the owner (the task which has
+/// created the object) can destroy it and mint badges for it.
+static int sys_notification(unsigned op, int id, task_t task, uint32_t badge) {
+    switch (op) {
+        case NOTIFICATION_CREATE:
+            return notification_create(CURRENT);
+        case NOTIFICATION_DESTROY:
+            return notification_destroy(CURRENT, id);
+        case NOTIFICATION_MINT:
+            return notification_mint(CURRENT, id, task, badge);
+        case NOTIFICATION_SIGNAL:
+            return notification_signal(CURRENT, id);
+        default:
+            return ERR_INVALID_ARG;
+    }
+}
+
+/// Reads the performance counters of the task into `buf`
+/// (`struct task_stats`). If `tid` is 0, it reads the current task's ones.
+static error_t sys_task_stats(task_t tid, userptr_t buf) {
+    struct task *task = (tid == 0) ? CURRENT : task_lookup(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    struct task_stats stats;
+    error_t err = task_get_stats(task, &stats);
+    if (err != OK) {
+        return err;
+    }
+
+    memcpy_to_user(buf, &stats, sizeof(stats));
+    return OK;
+}
+
+/// Send/receive IPC messages and notifications. If `ool_buf` is not zero in
+/// the receive phase, it's registered as the buffer to receive an ool payload
+/// into (see `copy_ool()`).
+static error_t sys_ipc(task_t dst, task_t src, userptr_t m, unsigned flags,
+                       userptr_t ool_buf) {
     if (flags & IPC_KERNEL) {
         return ERR_INVALID_ARG;
     }
@@ -113,6 +220,16 @@ static error_t sys_ipc(task_t dst, task_t src, userptr_t m, unsigned flags) {
         return ERR_INVALID_ARG;
     }
 
+    if ((flags & IPC_RECV) && ool_buf) {
+        if (is_kernel_addr_range(ool_buf, CONFIG_OOL_BUFFER_LEN)) {
+            return ERR_INVALID_ARG;
+        }
+
+        spin_lock(&CURRENT->lock);
+        CURRENT->ool_buf = ool_buf;
+        spin_unlock(&CURRENT->lock);
+    }
+
     struct task *dst_task = NULL;
     if (flags & (IPC_SEND | IPC_NOTIFY)) {
         dst_task = task_lookup(dst);
@@ -124,11 +241,143 @@ static error_t sys_ipc(task_t dst, task_t src, userptr_t m, unsigned flags) {
             notify(dst_task, m);
             return OK;
         }
+
+        if (flags & IPC_ASYNC) {
+            if (flags != (IPC_SEND | IPC_ASYNC)) {
+                return ERR_INVALID_ARG;
+            }
+
+            return ipc_async(dst_task, (struct message *) m);
+        }
     }
 
     return ipc(dst_task, src, (struct message *) m, flags);
 }
 
+/// Sends messages and notifications in the batch submitted by the userland.
+/// Each entry is processed as `sys_ipc` with IPC_SEND | IPC_NOBLOCK or
+/// IPC_NOTIFY and the result is written back into the entry. It returns the
+/// number of processed entries.
+static int sys_ipc_batch(userptr_t entries, int num_entries) {
+    if (num_entries < 0 || num_entries > IPC_BATCH_MAX) {
+        return ERR_INVALID_ARG;
+    }
+
+    for (int i = 0; i < num_entries; i++) {
+        userptr_t entry = entries + i * sizeof(struct ipc_batch_entry);
+        task_t dst;
+        unsigned flags;
+        memcpy_from_user(&dst, entry + offsetof(struct ipc_batch_entry, dst),
+                         sizeof(dst));
+        memcpy_from_user(&flags,
+                         entry + offsetof(struct ipc_batch_entry, flags),
+                         sizeof(flags));
+
+        error_t err;
+        struct task *dst_task = task_lookup(dst);
+        if (!dst_task) {
+            err = ERR_INVALID_TASK;
+        } else if (flags == IPC_NOTIFY) {
+            notifications_t notifications;
+            memcpy_from_user(
+                &notifications,
+                entry + offsetof(struct ipc_batch_entry, notifications),
+                sizeof(notifications));
+            notify(dst_task, notifications);
+            err = OK;
+        } else if (flags == IPC_SEND) {
+            userptr_t m = entry + offsetof(struct ipc_batch_entry, m);
+            err = ipc(dst_task, 0, (struct message *) m,
+                      IPC_SEND | IPC_NOBLOCK);
+        } else {
+            err = ERR_INVALID_ARG;
+        }
+
+        memcpy_to_user(entry + offsetof(struct ipc_batch_entry, result), &err,
+                       sizeof(err));
+    }
+
+    return num_entries;
+}
+
+/// Updates a scheduling attribute of the task. Only its pager can do so,
+/// except that a task may lower its own priority, limit its own CPU time, and
+/// change its own CPU affinity.
+static error_t sys_sched(task_t tid, unsigned attr, unsigned value) {
+    struct task *task = task_lookup(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    switch (attr) {
+        case SCHED_PRIORITY: {
+            if (value > TASK_PRIO_MAX) {
+                return ERR_INVALID_ARG;
+            }
+
+            if (!SYSCALL_AUTH(task)
+                && (task != CURRENT || value > task->base_prio)) {
+                return ERR_NOT_PERMITTED;
+            }
+
+            spin_lock(&task->lock);
+            // Keep the priority inherited from a client if it's higher.
+            task->base_prio = value;
+            task_update_prio(task);
+            spin_unlock(&task->lock);
+            return OK;
+        }
+        case SCHED_BUDGET:
+        case SCHED_PERIOD: {
+            // Validate the new pair of the budget and the period as a whole
+            // under the lock: the budget must not exceed the period whichever
+            // is set first, even if they're updated concurrently.
+            unsigned ticks = msec_to_ticks(value);
+            if (value && !ticks) {
+                // Don't round a short budget down to unlimited.
+                ticks = 1;
+            }
+
+            spin_lock(&task->lock);
+            struct sched_context *sc = &task->own_sc;
+            if (!SYSCALL_AUTH(task) && (task != CURRENT || sc->budget)) {
+                // A task may limit its own CPU time, but only its pager can
+                // change or lift the limit.
+                spin_unlock(&task->lock);
+                return ERR_NOT_PERMITTED;
+            }
+
+            unsigned budget = (attr == SCHED_BUDGET) ? ticks : sc->budget;
+            unsigned period = (attr == SCHED_PERIOD) ? ticks : sc->period;
+            if (attr == SCHED_PERIOD && !period) {
+                spin_unlock(&task->lock);
+                return ERR_INVALID_ARG;
+            }
+
+            if (budget > period) {
+                spin_unlock(&task->lock);
+                return ERR_INVALID_ARG;
+            }
+
+            sc->budget = budget;
+            sc->period = period;
+            sc->remaining = budget;
+            sc->replenish_at = timer_now() + period;
+            spin_unlock(&task->lock);
+            return OK;
+        }
+        case SCHED_AFFINITY: {
+            if (!SYSCALL_AUTH(task) && task != CURRENT) {
+                return ERR_NOT_PERMITTED;
+            }
+
+            return task_set_affinity(task, value);
+        }
+        default:
+            return ERR_INVALID_ARG;
+    }
+}
+
 /// Writes log messages into the kernel log buffer.
 static int sys_print(userptr_t buf, size_t buf_len) {
     char kbuf[256];
@@ -145,6 +394,58 @@ static int sys_print(userptr_t buf, size_t buf_len) {
     return OK;
 }
 
+#ifdef CONFIG_TRACE_BUFFER
+/// Drains trace records into the user buffer. The first record is always
+/// TRACE_CLOCK. It returns the number of bytes written.
+static int read_trace(userptr_t buf, size_t buf_len) {
+    struct trace_record kbuf[8];
+    int max = buf_len / sizeof(*kbuf);
+    if (!max) {
+        return ERR_TOO_SMALL;
+    }
+
+    trace_clock(&kbuf[0]);
+    memcpy_to_user(buf, kbuf, sizeof(*kbuf));
+    int num = 1;
+    while (num < max) {
+        int max_num = MIN(max - num, (int) (sizeof(kbuf) / sizeof(*kbuf)));
+        int read_num = trace_read(kbuf, max_num);
+        if (!read_num) {
+            break;
+        }
+
+        memcpy_to_user(buf + num * sizeof(*kbuf), kbuf,
+                       read_num * sizeof(*kbuf));
+        num += read_num;
+    }
+
+    return num * sizeof(*kbuf);
+}
+#endif
+
+#ifdef CONFIG_PROFILER
+/// Drains profiler samples into the user buffer. It returns the number of
+/// bytes written.
+static int read_profile(userptr_t buf, size_t buf_len) {
+    struct profile_sample kbuf[4];
+    int max = buf_len / sizeof(*kbuf);
+    int num = 0;
+    while (num < max) {
+        int max_num = MIN(max - num, (int) (sizeof(kbuf) / sizeof(*kbuf)));
+        int read_num = profiler_read(kbuf, max_num);
+        if (!read_num) {
+            break;
+        }
+
+        memcpy_to_user(buf + num * sizeof(*kbuf), kbuf,
+                       read_num * sizeof(*kbuf));
+        num += read_num;
+    }
+
+    return num * sizeof(*kbuf);
+}
+#endif
+
 static int sys_kdebug(userptr_t cmd, size_t cmd_len, userptr_t buf, size_t buf_len) {
     char cmd_buf[128];
     if (cmd_len >= sizeof(cmd_buf) - 1) {
@@ -153,6 +454,20 @@ static int sys_kdebug(userptr_t cmd, size_t cmd_len, userptr_t buf, size_t buf_l
 
     strncpy_from_user(cmd_buf, cmd, cmd_len);
 
+#ifdef CONFIG_TRACE_BUFFER
+    if (!strcmp(cmd_buf, "trace")) {
+        // Drain the trace buffers instead of the kernel log.
+        return read_trace(buf, buf_len);
+    }
+#endif
+
+#ifdef CONFIG_PROFILER
+    if (!strcmp(cmd_buf, "profile")) {
+        // Drain the profiler samples instead of the kernel log.
+        return read_profile(buf, buf_len);
+    }
+#endif
+
     error_t err = kdebug_run(cmd_buf);
     if (err != OK) {
         return err;
@@ -182,7 +497,9 @@ static paddr_t resolve_paddr(vaddr_t vaddr) {
         }
         return vaddr;
     } else {
-        paddr_t paddr = vm_resolve(&CURRENT->vm, vaddr);
+        spin_lock(&CURRENT->vm_owner->vm_lock);
+        paddr_t paddr = vm_resolve(CURRENT->vm, vaddr, 0);
+        spin_unlock(&CURRENT->vm_owner->vm_lock);
         if (!paddr) {
             return 0;
         }
@@ -192,7 +509,7 @@ static paddr_t resolve_paddr(vaddr_t vaddr) {
 
 static error_t sys_map(task_t tid, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
                        unsigned flags) {
-    if (!IS_ALIGNED(vaddr, PAGE_SIZE) || !IS_ALIGNED(vaddr, PAGE_SIZE)
+    if (!IS_ALIGNED(vaddr, PAGE_SIZE) || !IS_ALIGNED(src, PAGE_SIZE)
         || !IS_ALIGNED(kpage, PAGE_SIZE)) {
         return ERR_INVALID_ARG;
     }
@@ -211,25 +528,34 @@ static error_t sys_map(task_t tid, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
         return ERR_NOT_PERMITTED;
     }
 
-    // Resolve paddrs.
-    paddr_t paddr = resolve_paddr(src);
-    paddr_t kpage_paddr = resolve_paddr(kpage);
-    if (!paddr || !kpage_paddr) {
-        return ERR_NOT_FOUND;
+    // Resolve paddrs. They're not used if we only unmap the page.
+    paddr_t paddr = 0;
+    paddr_t kpage_paddr = 0;
+    if (flags & MAP_UPDATE) {
+        paddr = resolve_paddr(src);
+        kpage_paddr = resolve_paddr(kpage);
+        if (!paddr || !kpage_paddr) {
+            return ERR_NOT_FOUND;
+        }
     }
 
+    // The page table is shared among the threads of the task: lock the
+    // owner's one instead of the task's.
+    error_t err = OK;
+    spin_lock(&task->vm_owner->vm_lock);
     if (flags & MAP_DELETE) {
-        vm_unlink(&task->vm, vaddr);
+        vm_unlink(task->vm, vaddr);
     }
 
     if (flags & MAP_UPDATE) {
-        error_t err = vm_link(&task->vm, vaddr, paddr, kpage_paddr, flags);
-        if (err != OK) {
-            return err;
-        }
+        err = vm_link(task->vm, vaddr, paddr, kpage_paddr, flags);
     }
+    spin_unlock(&task->vm_owner->vm_lock);
 
-    return OK;
+    // Threads of the task may be running on other CPUs.
+    vm_shootdown(task->vm);
+
+    return err;
 }
 
 /// The system call handler.
@@ -242,10 +568,25 @@ long handle_syscall(int n, long a1, long a2, long a3, long a4, long a5) {
             ret = sys_exec(a1, a2, a3, a4, a5);
             break;
         case SYS_IPC:
-            ret = sys_ipc(a1, a2, a3, a4);
+            ret = sys_ipc(a1, a2, a3, a4, a5);
+            break;
+        case SYS_IPC_BATCH:
+            ret = sys_ipc_batch(a1, a2);
+            break;
+        case SYS_SCHED:
+            ret = sys_sched(a1, a2, a3);
             break;
         case SYS_LISTEN:
-            ret = sys_listen(a1, a2);
+            ret = sys_listen(a1, a2, a3, a4);
+            break;
+        case SYS_MSI:
+            ret = sys_msi(a1, a2, a3);
+            break;
+        case SYS_NOTIFICATION:
+            ret = sys_notification(a1, a2, a3, a4);
+            break;
+        case SYS_TASK_STATS:
+            ret = sys_task_stats(a1, a2);
             break;
         case SYS_MAP:
             ret = sys_map(a1, a2, a3, a4, a5);
@@ -260,6 +601,10 @@ long handle_syscall(int n, long a1, long a2, long a3, long a4, long a5) {
             ret = ERR_INVALID_ARG;
     }
 
+    // The system call may have resumed a task with a higher priority on this
+    // CPU (e.g. a server waiting for our message).
+    task_preempt_if_needed();
+
     stack_check();
     return ret;
 }
@@ -3,18 +3,29 @@
 #include <config.h>
 #include <string.h>
 #include <message.h>
+#include <vprintf.h>
 #include "task.h"
 #include "ipc.h"
 #include "kdebug.h"
+#include "notification.h"
 #include "printk.h"
+#include "profiler.h"
 #include "syscall.h"
+#include "trace.h"
 
 /// All tasks.
 static struct task tasks[CONFIG_NUM_TASKS];
-/// A queue of runnable tasks excluding currently running tasks.
-static list_t runqueue;
 /// IRQ owners.
 static struct task *irq_owners[IRQ_MAX];
+/// The CPUs which IRQs are routed to. -1 means the default (see irq_cpu()).
+static int irq_cpus[IRQ_MAX];
+/// The indices given by owners to IRQs allocated for MSIs (see
+/// task_alloc_msi()), or -1.
+static int msi_indices[IRQ_MAX];
+/// The lock for `irq_owners`, `irq_cpus`, and `msi_indices`.
+static struct spinlock irq_lock;
+/// The bitmap of idle CPUs. Updated atomically.
+static uint32_t idle_cpus = 0;
 
 /// Returns the task struct for the task ID. It returns NULL if the ID is
 /// invalid.
@@ -37,9 +48,311 @@ struct task *task_lookup(task_t tid) {
     return task;
 }
 
-/// Initializes a task struct.
+/// Acquires locks of two tasks. Locks are always acquired in the same order
+/// to avoid deadlocks.
+void task_lock_two(struct task *a, struct task *b) {
+    DEBUG_ASSERT(a != b);
+    if (a < b) {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
+    } else {
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
+    }
+}
+
+/// Releases locks acquired by task_lock_two().
+void task_unlock_two(struct task *a, struct task *b) {
+    spin_unlock(&a->lock);
+    spin_unlock(&b->lock);
+}
+
+/// Returns the scheduling context which the task is running on: its own one or
+/// the one lent by the client waiting for a reply from it, and so on. Lenders
+/// are peeked without their locks: it only affects accounting.
+struct sched_context *task_sc(struct task *task) {
+    for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+        struct task *lender =
+            __atomic_load_n(&task->sc_lender, __ATOMIC_RELAXED);
+        if (!lender) {
+            break;
+        }
+
+        task = lender;
+    }
+
+    return &task->own_sc;
+}
+
+/// Called when the task no longer waits for a reply from the task it has
+/// called (`task->src`), e.g. the call has timed out or the task is being
+/// destroyed: takes back the scheduling context lent to the callee. The caller
+/// must hold `task->lock`.
+///
+/// Since the callee's lock is acquired while holding `task->lock`, it doesn't
+/// wait for it: it returns ERR_TRY_AGAIN if it's held by another CPU.
+error_t task_abort_call(struct task *task) {
+    struct task *callee = task_lookup_unchecked(task->src);
+    if (!callee || callee == task
+        || __atomic_load_n(&callee->sc_lender, __ATOMIC_RELAXED) != task) {
+        return OK;
+    }
+
+    if (!spin_trylock(&callee->lock)) {
+        return ERR_TRY_AGAIN;
+    }
+
+    if (callee->sc_lender == task) {
+        __atomic_store_n(&callee->sc_lender, NULL, __ATOMIC_RELAXED);
+        task_update_prio(callee);
+    }
+
+    spin_unlock(&callee->lock);
+    return OK;
+}
+
+/// Replenishes the budget of the scheduling context if its period has ended.
+static void sc_replenish(struct sched_context *sc, uint64_t now) {
+    if (sc->budget && now >= sc->replenish_at) {
+        sc->remaining = sc->budget;
+        sc->replenish_at = now + sc->period;
+    }
+}
+
+/// Charges `ticks` to the scheduling context which the task is running on.
+static void sc_charge(struct task *task, uint64_t ticks) {
+    struct sched_context *sc = task_sc(task);
+    sc->consumed += ticks;
+    if (sc->budget) {
+        sc_replenish(sc, timer_now());
+        sc->remaining = (ticks < sc->remaining) ? sc->remaining - ticks : 0;
+    }
+}
+
+/// Returns true if the scheduling context which the task is running on has
+/// run out of its budget in the current period.
+static bool is_throttled(struct task *task) {
+    struct sched_context *sc = task_sc(task);
+    if (!sc->budget) {
+        return false;
+    }
+
+    sc_replenish(sc, timer_now());
+    return !sc->remaining;
+}
+
+/// Appends a runnable task into the runqueue of `cpu`.
+static void runqueue_push(int cpu, struct task *task) {
+    struct cpuvar *cpuvar = get_cpuvar_of(cpu);
+    spin_lock(&cpuvar->runqueue_lock);
+    list_push_back(&cpuvar->runqueues[task->prio], &task->runqueue_next);
+    cpuvar->runqueue_bitmap |= 1u << task->prio;
+    cpuvar->num_runnable++;
+    task->cpu = cpu;
+    spin_unlock(&cpuvar->runqueue_lock);
+}
+
+/// Removes the first task with the highest priority from the runqueue of
+/// `cpu`. It returns NULL if the runqueue is empty. If `steal` is true, it
+/// skips tasks still running on the CPU.
+///
+/// Tasks whose scheduling context has run out of its budget are picked only
+/// if there are no other runnable tasks.
+static struct task *runqueue_pop(int cpu, bool steal) {
+    struct cpuvar *cpuvar = get_cpuvar_of(cpu);
+    struct task *task = NULL;
+    struct task *throttled = NULL;
+    spin_lock(&cpuvar->runqueue_lock);
+    uint32_t bitmap = cpuvar->runqueue_bitmap;
+    while (bitmap && !task) {
+        unsigned prio = 31 - __builtin_clz(bitmap);
+        bitmap &= ~(1u << prio);
+        list_t *queue = &cpuvar->runqueues[prio];
+        if (list_is_empty(queue)) {
+            cpuvar->runqueue_bitmap &= ~(1u << prio);
+            continue;
+        }
+
+        LIST_FOR_EACH (t, queue, struct task, runqueue_next) {
+            // A task in another CPU's runqueue may be still in the middle of
+            // a context switch (see scheduler()): its context is not yet
+            // saved.
+            if (steal && __atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+
+            if (!task_cpu_allowed(t, mp_self())) {
+                continue;
+            }
+
+            if (is_throttled(t)) {
+                if (!throttled) {
+                    throttled = t;
+                }
+                continue;
+            }
+
+            task = t;
+            break;
+        }
+    }
+
+    if (!task) {
+        task = throttled;
+    }
+
+    if (task) {
+        list_remove(&task->runqueue_next);
+        cpuvar->num_runnable--;
+    }
+    spin_unlock(&cpuvar->runqueue_lock);
+    return task;
+}
+
+/// Returns the highest priority of tasks in the runqueue of the current CPU,
+/// or -1 if it's empty.
+static int runqueue_highest_prio(void) {
+    struct cpuvar *cpuvar = get_cpuvar();
+    int highest = -1;
+    spin_lock(&cpuvar->runqueue_lock);
+    uint32_t bitmap = cpuvar->runqueue_bitmap;
+    while (bitmap) {
+        unsigned prio = 31 - __builtin_clz(bitmap);
+        if (!list_is_empty(&cpuvar->runqueues[prio])) {
+            highest = prio;
+            break;
+        }
+
+        bitmap &= ~(1u << prio);
+        cpuvar->runqueue_bitmap &= ~(1u << prio);
+    }
+    spin_unlock(&cpuvar->runqueue_lock);
+    return highest;
+}
+
+/// Removes the task from the runqueue if it's queued. Returns true if it was
+/// in the runqueue.
+static bool runqueue_remove(struct task *task) {
+    if (task->cpu < 0) {
+        // The task has never been enqueued.
+        return false;
+    }
+
+    struct cpuvar *cpuvar = get_cpuvar_of(task->cpu);
+    bool queued = false;
+    spin_lock(&cpuvar->runqueue_lock);
+    if (task->runqueue_next.next) {
+        list_remove(&task->runqueue_next);
+        cpuvar->num_runnable--;
+        queued = true;
+    }
+    spin_unlock(&cpuvar->runqueue_lock);
+    return queued;
+}
+
+/// Updates the priority of the task running on the current CPU (-1 if it's
+/// the idle task) published to other CPUs.
+static void update_running_prio(int prio) {
+    uint32_t self = 1u << mp_self();
+    if (prio < 0) {
+        __atomic_fetch_or(&idle_cpus, self, __ATOMIC_SEQ_CST);
+    } else if (__atomic_load_n(&idle_cpus, __ATOMIC_RELAXED) & self) {
+        __atomic_fetch_and(&idle_cpus, ~self, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_store_n(&get_cpuvar()->running_prio, prio, __ATOMIC_SEQ_CST);
+}
+
+/// Returns true if `cpu` should switch to a task with `prio` right away: it's
+/// idle or running a task with a lower priority.
+static bool should_preempt(int cpu, unsigned prio) {
+    int running =
+        __atomic_load_n(&get_cpuvar_of(cpu)->running_prio, __ATOMIC_SEQ_CST);
+    return running < (int) prio;
+}
+
+/// Returns the bitmap of online CPUs.
+static uint32_t online_cpus(void) {
+    return (uint32_t) ((1ull << mp_num_cpus()) - 1);
+}
+
+/// Returns true if the IRQ is reserved for MSIs.
+static bool is_msi_irq(unsigned irq) {
+    return irq >= IRQ_MSI_BASE && irq < IRQ_MSI_END;
+}
+
+/// Returns the CPU which the IRQ is delivered to: the one specified by its
+/// owner or, by default, the BSP unless the owner is not allowed to run on it.
+/// The caller must hold `irq_lock`.
+static int irq_cpu(unsigned irq) {
+    if (irq_cpus[irq] >= 0) {
+        return irq_cpus[irq];
+    }
+
+    struct task *owner = irq_owners[irq];
+    if (task_cpu_allowed(owner, 0)) {
+        return 0;
+    }
+
+    return __builtin_ctz(owner->affinity & online_cpus());
+}
+
+/// Returns an idle CPU other than the current one where the task is allowed
+/// to run, or -1 if there's none.
+static int find_idle_cpu(struct task *task) {
+    uint32_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_SEQ_CST);
+    idle &= task->affinity & ~(1u << mp_self());
+    return idle ? __builtin_ctz(idle) : -1;
+}
+
+/// Returns the CPU with the fewest runnable tasks among the ones where the
+/// task is allowed to run.
+static int least_loaded_cpu(struct task *task) {
+    int least = -1;
+    if (task_cpu_allowed(task, mp_self())) {
+        least = mp_self();
+    }
+
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        if (!task_cpu_allowed(task, cpu)) {
+            continue;
+        }
+
+        if (least < 0
+            || get_cpuvar_of(cpu)->num_runnable
+                   < get_cpuvar_of(least)->num_runnable) {
+            least = cpu;
+        }
+    }
+
+    // The affinity always contains an online CPU (see task_set_affinity()).
+    DEBUG_ASSERT(least >= 0);
+    return least;
+}
+
+/// Steals a runnable task from the most loaded CPU. It's called by an idle CPU
+/// which has no runnable tasks in its own runqueue.
+static struct task *steal_task(void) {
+    int victim = -1;
+    unsigned max_runnable = 0;
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        unsigned num_runnable = get_cpuvar_of(cpu)->num_runnable;
+        if (cpu != mp_self() && num_runnable > max_runnable) {
+            victim = cpu;
+            max_runnable = num_runnable;
+        }
+    }
+
+    return (victim >= 0) ? runqueue_pop(victim, true) : NULL;
+}
+
+/// Initializes a task struct. If TASK_VM(owner) is set in `flags`, the task
+/// is created as a thread in the address space of `owner`: it inherits the
+/// owner's priority and affinity unless TASK_PRIO or TASK_CPU is given. `sp` is
+/// the initial user stack pointer (the task sets it by itself if it's 0). The
+/// caller must hold `task->lock`.
 error_t task_create(struct task *task, const char *name, vaddr_t ip,
-                    struct task *pager, unsigned flags) {
+                    vaddr_t sp, struct task *pager, unsigned flags) {
     if (task->state != TASK_UNUSED) {
         return ERR_ALREADY_EXISTS;
     }
@@ -51,14 +364,52 @@ error_t task_create(struct task *task, const char *name, vaddr_t ip,
     }
 #endif
 
+    uint32_t affinity = ~0u;
+    int pinned = TASK_CPU_FROM_FLAGS(flags);
+    if (pinned >= 0) {
+        if (pinned >= mp_num_cpus()) {
+            return ERR_INVALID_ARG;
+        }
+
+        affinity = 1u << pinned;
+    }
+
+    unsigned prio = TASK_PRIO_FROM_FLAGS(flags);
+    struct task *vm_owner = task;
+    if (TASK_VM_FROM_FLAGS(flags)) {
+#ifdef CONFIG_NOMMU
+        WARN_DBG("threads are not supported");
+        return ERR_UNAVAILABLE;
+#endif
+        struct task *owner = task_lookup(TASK_VM_FROM_FLAGS(flags));
+        if (!owner || owner == task) {
+            return ERR_INVALID_ARG;
+        }
+
+        // A thread created in a thread runs on the same address space.
+        vm_owner = owner->vm_owner;
+
+        // Unless given explicitly, the thread inherits the current priority
+        // and CPU affinity of the owner. They're peeked without its lock.
+        if (pinned < 0) {
+            affinity = __atomic_load_n(&vm_owner->affinity, __ATOMIC_RELAXED);
+        }
+        if (!prio) {
+            prio = __atomic_load_n(&vm_owner->base_prio, __ATOMIC_RELAXED);
+        }
+    }
+
+    task->vm_owner = vm_owner;
+    task->vm = &vm_owner->own_vm;
+
     // Do arch-specific initialization.
     error_t err;
-    if ((err = arch_task_create(task, ip)) != OK) {
+    if ((err = arch_task_create(task, ip, sp)) != OK) {
         return err;
     }
 
     // Initialize the page table.
-    if ((err = vm_create(&task->vm)) != OK) {
+    if (vm_owner == task && (err = vm_create(task->vm)) != OK) {
         return err;
     }
 
@@ -70,16 +421,36 @@ error_t task_create(struct task *task, const char *name, vaddr_t ip,
     task->notifications = 0;
     task->pager = pager;
     task->src = IPC_DENY;
-    task->timeout = 0;
+    task->expired_timers = 0;
+    task->pending_msis = 0;
+    memset(task->pending_objects, 0, sizeof(task->pending_objects));
+    task->ool_buf = 0;
+    task->async_head = 0;
+    task->async_num = 0;
+    task->base_prio = prio;
+    task->prio = task->base_prio;
     task->quantum = 0;
+    memset(&task->own_sc, 0, sizeof(task->own_sc));
+    task->sc_lender = NULL;
+    task->affinity = affinity;
     task->ref_count = 0;
+    task->cpu = -1;
+    task->on_cpu = false;
+    task->receiver = NULL;
+    memset(&task->stats, 0, sizeof(task->stats));
+    task->run_start = 0;
+    task->blocked_at = arch_read_cycles();
     strncpy(task->name, name, sizeof(task->name));
     list_init(&task->senders);
     list_nullify(&task->runqueue_next);
     list_nullify(&task->sender_next);
 
     if (pager) {
-        pager->ref_count++;
+        __sync_fetch_and_add(&pager->ref_count, 1);
+    }
+
+    if (vm_owner != task) {
+        __sync_fetch_and_add(&vm_owner->ref_count, 1);
     }
 
     // Append the newly created task into the runqueue.
@@ -90,6 +461,47 @@ error_t task_create(struct task *task, const char *name, vaddr_t ip,
     return OK;
 }
 
+/// Removes the task from the task queues which it's waiting on and aborts
+/// IPC operations of its senders. The caller must hold `task->lock`.
+///
+/// Since the locks of other tasks are acquired in an arbitrary order here, it
+/// doesn't wait for them: it returns ERR_TRY_AGAIN if one of them is held by
+/// another CPU.
+static error_t task_detach(struct task *task) {
+    // Take back the scheduling context lent to the task which we're waiting
+    // for a reply from.
+    if (task_abort_call(task) != OK) {
+        return ERR_TRY_AGAIN;
+    }
+
+    struct task *receiver = task->receiver;
+    if (receiver) {
+        if (!spin_trylock(&receiver->lock)) {
+            return ERR_TRY_AGAIN;
+        }
+
+        list_remove(&task->sender_next);
+        task->receiver = NULL;
+        task_update_prio(receiver);
+        spin_unlock(&receiver->lock);
+    }
+
+    // Abort sender IPC operations.
+    LIST_FOR_EACH (sender, &task->senders, struct task, sender_next) {
+        if (!spin_trylock(&sender->lock)) {
+            return ERR_TRY_AGAIN;
+        }
+
+        list_remove(&sender->sender_next);
+        sender->receiver = NULL;
+        sender->notifications |= NOTIFY_ABORTED;
+        task_resume(sender);
+        spin_unlock(&sender->lock);
+    }
+
+    return OK;
+}
+
 /// Frees the task data structures and make it unused.
 error_t task_destroy(struct task *task) {
     ASSERT(task != CURRENT);
@@ -100,41 +512,68 @@ error_t task_destroy(struct task *task) {
         return ERR_INVALID_ARG;
     }
 
-    if (task->state == TASK_UNUSED) {
-        return ERR_INVALID_ARG;
+    // Disarm timers. This must be done without the task lock (see timer.c).
+    for (int i = 0; i < CONFIG_NUM_TIMERS_PER_TASK; i++) {
+        timer_cancel(&task->timers[i]);
     }
+    timer_cancel(&task->ipc_timer);
+
+    while (true) {
+        spin_lock(&task->lock);
+        if (task->state == TASK_UNUSED) {
+            spin_unlock(&task->lock);
+            return ERR_INVALID_ARG;
+        }
+
+        if (task->ref_count > 0) {
+            WARN_DBG("%s (#%d) are still referenced from %d tasks",
+                     task->name, task->tid, task->ref_count);
+            spin_unlock(&task->lock);
+            return ERR_IN_USE;
+        }
 
-    if (task->ref_count > 0) {
-        WARN_DBG("%s (#%d) are still referenced from %d tasks",
-                 task->name, task->tid, task->ref_count);
-        return ERR_IN_USE;
+        if (task_detach(task) == OK) {
+            break;
+        }
+
+        spin_unlock(&task->lock);
+        arch_cpu_relax();
     }
 
     TRACE("destroying %s...", task->name);
-    list_remove(&task->runqueue_next);
-    list_remove(&task->sender_next);
-    vm_destroy(&task->vm);
+    runqueue_remove(task);
+    if (task->vm_owner == task) {
+        vm_destroy(task->vm);
+    }
     arch_task_destroy(task);
     task->state = TASK_UNUSED;
 
     if (task->pager) {
-        task->pager->ref_count--;
+        __sync_fetch_and_sub(&task->pager->ref_count, 1);
     }
 
-    // Abort sender IPC operations.
-    LIST_FOR_EACH (sender, &task->senders, struct task, sender_next) {
-        notify(sender, NOTIFY_ABORTED);
-        list_remove(&sender->sender_next);
+    if (task->vm_owner != task) {
+        __sync_fetch_and_sub(&task->vm_owner->ref_count, 1);
     }
 
+    spin_unlock(&task->lock);
+
     // Release IRQ ownership.
+    spin_lock(&irq_lock);
     for (unsigned irq = 0; irq < IRQ_MAX; irq++) {
         if (irq_owners[irq] == task) {
-            arch_disable_irq(irq);
+            if (!is_msi_irq(irq)) {
+                arch_disable_irq(irq);
+            }
+
             irq_owners[irq] = NULL;
+            irq_cpus[irq] = -1;
+            msi_indices[irq] = -1;
         }
     }
+    spin_unlock(&irq_lock);
 
+    notification_cleanup(task);
     return OK;
 }
 
@@ -155,119 +594,525 @@ __noreturn void task_exit(enum exception_type exp) {
     OOPS_OK(err);
 
     // Wait until the pager task destroys this task...
+    spin_lock(&CURRENT->lock);
     CURRENT->state = TASK_BLOCKED;
     CURRENT->src = IPC_DENY;
     task_switch();
     UNREACHABLE();
 }
 
-/// Suspends a task. Don't forget to update `task->src` as well!
+/// Suspends a task. Don't forget to update `task->src` as well! The caller
+/// must hold `task->lock`.
 void task_block(struct task *task) {
     DEBUG_ASSERT(task->state == TASK_RUNNABLE);
     task->state = TASK_BLOCKED;
+    task->blocked_at = arch_read_cycles();
 }
 
-/// Resumes a task.
+/// Enqueues a runnable task into the runqueue of a CPU where it's allowed to
+/// run and kicks the CPU if needed.
+static void enqueue(struct task *task) {
+    // Enqueue the task into the CPU where it last ran to keep its cache warm
+    // unless the CPU is overloaded.
+    int cpu = task->cpu;
+    int least_loaded = least_loaded_cpu(task);
+    if (cpu < 0 || !task_cpu_allowed(task, cpu)
+        || get_cpuvar_of(cpu)->num_runnable
+               >= get_cpuvar_of(least_loaded)->num_runnable
+                      + RUNQUEUE_IMBALANCE) {
+        cpu = least_loaded;
+    }
+
+    // If the CPU won't run the task soon, hand it over to an idle CPU.
+    if (!should_preempt(cpu, task->prio)) {
+        int idle = find_idle_cpu(task);
+        if (idle >= 0) {
+            cpu = idle;
+        }
+    }
+
+    runqueue_push(cpu, task);
+
+    // Make sure that the task is visible in the runqueue before checking the
+    // CPU state: see scheduler() for the other side.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Kick the CPU if it should run the task now. The current CPU switches to
+    // it on return from the system call without an IPI.
+    if (should_preempt(cpu, task->prio)) {
+        if (cpu == mp_self()) {
+            get_cpuvar()->need_resched = true;
+        } else {
+            mp_reschedule(cpu);
+        }
+    }
+}
+
+/// Resumes a task. The caller must hold `task->lock` (or the receiver's lock
+/// if the task is in its `senders` queue).
 void task_resume(struct task *task) {
     DEBUG_ASSERT(task->state == TASK_BLOCKED);
     task->state = TASK_RUNNABLE;
-    list_push_back(&runqueue, &task->runqueue_next);
-    mp_reschedule();
+    task->stats.blocked_cycles += arch_read_cycles() - task->blocked_at;
+    enqueue(task);
 }
 
+/// Updates the CPU affinity of the task. If the task is queued in or running
+/// on a CPU which is no longer allowed, it's moved to an allowed one. IRQs
+/// listened by the task are routed to the new CPU as well.
+error_t task_set_affinity(struct task *task, uint32_t affinity) {
+    affinity &= online_cpus();
+    if (!affinity) {
+        return ERR_INVALID_ARG;
+    }
+
+    spin_lock(&task->lock);
+    task->affinity = affinity;
+    int cpu = task->cpu;
+    if (cpu >= 0 && !task_cpu_allowed(task, cpu)) {
+        if (task->state == TASK_RUNNABLE && runqueue_remove(task)) {
+            enqueue(task);
+        } else if (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE)
+                   && cpu != mp_self()) {
+            // The CPU moves the task in the next context switch (see
+            // task_switch_finish()).
+            mp_reschedule(cpu);
+        }
+    }
+    spin_unlock(&task->lock);
+
+    spin_lock(&irq_lock);
+    for (unsigned irq = 0; irq < IRQ_MAX; irq++) {
+        // MSIs are routed by the device: its driver needs to reallocate
+        // them to follow the new affinity.
+        if (irq_owners[irq] == task && !is_msi_irq(irq)) {
+            arch_enable_irq(irq, irq_cpu(irq));
+        }
+    }
+    spin_unlock(&irq_lock);
+    return OK;
+}
+
+/// Updates the effective priority of the task. If it's in a runqueue, it's
+/// moved into the queue of the new priority. The caller must hold
+/// `task->lock`.
+void task_set_prio(struct task *task, unsigned prio) {
+    DEBUG_ASSERT(prio <= TASK_PRIO_MAX);
+    int cpu = task->cpu;
+    if (cpu < 0 || task->prio == prio) {
+        task->prio = prio;
+        return;
+    }
+
+    if (task == CURRENT) {
+        update_running_prio(prio);
+    }
+
+    struct cpuvar *cpuvar = get_cpuvar_of(cpu);
+    spin_lock(&cpuvar->runqueue_lock);
+    task->prio = prio;
+    if (task->cpu == cpu && task->runqueue_next.next) {
+        list_remove(&task->runqueue_next);
+        list_push_back(&cpuvar->runqueues[prio], &task->runqueue_next);
+        cpuvar->runqueue_bitmap |= 1u << prio;
+    }
+    spin_unlock(&cpuvar->runqueue_lock);
+}
+
+/// Recomputes the effective priority of the task: the highest one among its
+/// base priority, the client waiting for a reply from it (`sc_lender`), and
+/// tasks blocked in sending a message to it. It's called whenever one of them
+/// leaves so that an inherited priority doesn't outlive the reason. Their
+/// priorities are peeked without their locks. The caller must hold
+/// `task->lock`.
+void task_update_prio(struct task *task) {
+    unsigned prio = task->base_prio;
+    struct task *client = task->sc_lender;
+    if (client) {
+        prio = MAX(prio, client->prio);
+    }
+
+    LIST_FOR_EACH (sender, &task->senders, struct task, sender_next) {
+        prio = MAX(prio, sender->prio);
+    }
+
+    task_set_prio(task, prio);
+}
+
+/// Switches to a task in the current CPU's runqueue if it has a higher
+/// priority than the current task. The caller must not hold any task locks.
+void task_preempt(void) {
+    int highest = runqueue_highest_prio();
+    if (highest >= 0
+        && (CURRENT == IDLE_TASK || highest > (int) CURRENT->prio)) {
+        spin_lock(&CURRENT->lock);
+        task_switch();
+    }
+}
+
+/// Calls task_preempt() if a task which should preempt the current one has
+/// been enqueued into the current CPU. The caller must not hold any task locks.
+void task_preempt_if_needed(void) {
+    struct cpuvar *cpuvar = get_cpuvar();
+    if (cpuvar->need_resched) {
+        cpuvar->need_resched = false;
+        task_preempt();
+    }
+}
+
+#ifdef CONFIG_TICKLESS
+/// Charges ticks elapsed since the last charge to the task running on the
+/// current CPU.
+static void charge_elapsed(struct task *task) {
+    struct cpuvar *cpuvar = get_cpuvar();
+    uint64_t now = arch_timer_now();
+    uint64_t elapsed = now - cpuvar->slice_start;
+    cpuvar->slice_start = now;
+    task->quantum = (elapsed < task->quantum) ? task->quantum - elapsed : 0;
+    if (task != IDLE_TASK) {
+        sc_charge(task, elapsed);
+    }
+}
+#endif
+
 /// Picks the next task to run.
 static struct task *scheduler(struct task *current) {
-    if (current != IDLE_TASK && current->state == TASK_RUNNABLE) {
-        // The current task is still runnable. Enqueue into the runqueue.
-        list_push_back(&runqueue, &current->runqueue_next);
+    if (current != IDLE_TASK && current->state == TASK_RUNNABLE
+        && task_cpu_allowed(current, mp_self())) {
+        // The current task is still runnable. Enqueue into the runqueue. If
+        // it's no longer allowed to run on this CPU, it's moved to another
+        // CPU in task_switch_finish().
+        runqueue_push(mp_self(), current);
     }
 
-    struct task *next = LIST_POP_FRONT(&runqueue, struct task, runqueue_next);
+    struct task *next = runqueue_pop(mp_self(), false);
+    if (!next) {
+        // The runqueue is empty. Try stealing a task from other CPUs.
+        next = steal_task();
+    }
+
+    if (!next) {
+        // We're going idle. Mark this CPU as idle first and check the
+        // runqueue again: a task enqueued in the meantime is picked here or
+        // the CPU which has enqueued it sees the mark and sends an IPI.
+        update_running_prio(-1);
+        next = runqueue_pop(mp_self(), false);
+    }
+
+    update_running_prio(next ? (int) next->prio : -1);
     return (next) ? next : IDLE_TASK;
 }
 
+/// Charges the CPU time to `prev` and counts the context switch.
+static void account_switch(struct task *prev, struct task *next) {
+    uint64_t now = arch_read_cycles();
+    prev->stats.cycles += now - prev->run_start;
+    if (prev->state == TASK_BLOCKED) {
+        prev->stats.voluntary_switches++;
+    } else {
+        prev->stats.involuntary_switches++;
+    }
+
+    next->run_start = now;
+}
+
 /// Do a context switch: save the current register state on the stack and
 /// restore the next thread's state.
+///
+/// The caller must hold `CURRENT->lock`. It's released once the context
+/// switch completes, i.e., this function returns without the lock.
 void task_switch(void) {
     stack_check();
 
     struct task *prev = CURRENT;
+    DEBUG_ASSERT(spin_is_locked_by_me(&prev->lock));
+#ifdef CONFIG_TICKLESS
+    charge_elapsed(prev);
+#endif
     struct task *next = scheduler(prev);
     next->quantum = TASK_TIME_SLICE;
+    next->cpu = mp_self();
+#ifdef CONFIG_TICKLESS
+    timer_reload(next);
+#endif
     if (next == prev) {
         // No runnable threads other than the current one. Continue executing
         // the current thread.
+        spin_unlock(&prev->lock);
         return;
     }
 
+    next->on_cpu = true;
+    get_cpuvar()->switched_from = prev;
     CURRENT = next;
+    account_switch(prev, next);
+    trace_event(TRACE_SWITCH, next->tid, prev->tid, 0);
     arch_task_switch(prev, next);
+    task_switch_finish();
 
     stack_check();
 }
 
-error_t task_listen_irq(struct task *task, unsigned irq) {
-    if (irq >= IRQ_MAX) {
+/// Hands the CPU over to `next` directly: the current task must be blocked
+/// and `next` must be runnable but not in any runqueue. Unlike task_switch(),
+/// it doesn't touch the runqueues at all and `next` runs on the rest of the
+/// current task's time slice (so-called direct process switch).
+///
+/// The caller must hold `CURRENT->lock` and `next->lock`: since `next` is in
+/// no runqueue, it must not be destroyed by other CPUs until it runs. Both
+/// locks are released once the context switch completes.
+void task_switch_to(struct task *next) {
+    stack_check();
+
+    struct task *prev = CURRENT;
+    DEBUG_ASSERT(spin_is_locked_by_me(&prev->lock));
+    DEBUG_ASSERT(spin_is_locked_by_me(&next->lock));
+    DEBUG_ASSERT(prev->state == TASK_BLOCKED);
+    DEBUG_ASSERT(next->state == TASK_RUNNABLE);
+    DEBUG_ASSERT(!next->runqueue_next.next);
+    DEBUG_ASSERT(prev != next && prev != IDLE_TASK);
+
+    // Donate the remaining time slice.
+#ifdef CONFIG_TICKLESS
+    charge_elapsed(prev);
+#endif
+    next->quantum = prev->quantum;
+    update_running_prio(next->prio);
+    next->cpu = mp_self();
+    next->on_cpu = true;
+    get_cpuvar()->switched_from = prev;
+    get_cpuvar()->switched_to_locked = true;
+    CURRENT = next;
+    account_switch(prev, next);
+    trace_event(TRACE_SWITCH, next->tid, prev->tid, 0);
+    arch_task_switch(prev, next);
+    task_switch_finish();
+
+    stack_check();
+}
+
+/// Completes a context switch in the next task's context: now we've saved the
+/// previous task's context and other CPUs are allowed to run it. Newly created
+/// tasks call this function in the arch's task entry point.
+void task_switch_finish(void) {
+    struct task *prev = get_cpuvar()->switched_from;
+    get_cpuvar()->switched_from = NULL;
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+
+    // The previous task has been left out of the runqueue since it's no
+    // longer allowed to run on this CPU (see scheduler()).
+    if (prev != IDLE_TASK && prev->state == TASK_RUNNABLE
+        && !task_cpu_allowed(prev, mp_self())) {
+        enqueue(prev);
+    }
+
+    spin_unlock(&prev->lock);
+    if (get_cpuvar()->switched_to_locked) {
+        get_cpuvar()->switched_to_locked = false;
+        spin_unlock(&CURRENT->lock);
+    }
+}
+
+/// Delivers the IRQ to the task as a notification. `cpu` is the CPU which
+/// handles the IRQ or -1 to follow the task's CPU affinity. If the task
+/// already listens for the IRQ, it only updates the routing.
+error_t task_listen_irq(struct task *task, unsigned irq, int cpu) {
+    if (irq >= IRQ_MAX || is_msi_irq(irq) || cpu < -1
+        || cpu >= mp_num_cpus()) {
         return ERR_INVALID_ARG;
     }
 
-    if (irq_owners[irq]) {
+    spin_lock(&irq_lock);
+    if (irq_owners[irq] && irq_owners[irq] != task) {
+        spin_unlock(&irq_lock);
         return ERR_ALREADY_EXISTS;
     }
 
     irq_owners[irq] = task;
-    arch_enable_irq(irq);
-    TRACE("enabled IRQ: task=%s, vector=%d", task->name, irq);
+    irq_cpus[irq] = cpu;
+    int routed_to = irq_cpu(irq);
+    arch_enable_irq(irq, routed_to);
+    spin_unlock(&irq_lock);
+    TRACE("enabled IRQ: task=%s, vector=%d, cpu=%d", task->name, irq,
+          routed_to);
     return OK;
 }
 
-error_t task_unlisten_irq(unsigned irq) {
-    if (irq >= IRQ_MAX) {
+/// Stops delivering the IRQ to the task. Only the task listening for the IRQ
+/// is allowed to do so.
+error_t task_unlisten_irq(struct task *task, unsigned irq) {
+    if (irq >= IRQ_MAX || is_msi_irq(irq)) {
         return ERR_INVALID_ARG;
     }
 
+    spin_lock(&irq_lock);
+    if (irq_owners[irq] != task) {
+        spin_unlock(&irq_lock);
+        return ERR_NOT_PERMITTED;
+    }
+
     arch_disable_irq(irq);
     irq_owners[irq] = NULL;
-    TRACE("disabled IRQ: vector=%d", irq);
+    irq_cpus[irq] = -1;
+    spin_unlock(&irq_lock);
+    TRACE("disabled IRQ: task=%s, vector=%d", task->name, irq);
+    return OK;
+}
+
+/// Looks for the IRQ allocated for the task's `index`-th MSI. The caller must
+/// hold `irq_lock`.
+static int lookup_msi(struct task *task, unsigned index) {
+    for (unsigned irq = IRQ_MSI_BASE; irq < IRQ_MSI_END; irq++) {
+        if (irq_owners[irq] == task && msi_indices[irq] == (int) index) {
+            return irq;
+        }
+    }
+
+    return -1;
+}
+
+/// Allocates an IRQ for a message-signaled interrupt (MSI) and returns the
+/// message to be written by the device in `addr` and `data`. When it fires,
+/// the task receives NOTIFY_IRQ and the `index`-th bit is set in
+/// `m.notifications.irqs`. `cpu` is the CPU which handles the IRQ or -1 to
+/// follow the task's CPU affinity. If the task already has one for `index`, it
+/// only returns the message for the new `cpu`.
+error_t task_alloc_msi(struct task *task, unsigned index, int cpu,
+                       uint64_t *addr, uint32_t *data) {
+    if (IRQ_MSI_BASE == IRQ_MSI_END) {
+        return ERR_UNAVAILABLE;
+    }
+
+    if (index >= 32 || cpu < -1 || cpu >= mp_num_cpus()) {
+        return ERR_INVALID_ARG;
+    }
+
+    spin_lock(&irq_lock);
+    int irq = lookup_msi(task, index);
+    for (unsigned i = IRQ_MSI_BASE; irq < 0 && i < IRQ_MSI_END; i++) {
+        if (!irq_owners[i]) {
+            irq = i;
+        }
+    }
+
+    if (irq < 0) {
+        spin_unlock(&irq_lock);
+        return ERR_NO_MEMORY;
+    }
+
+    irq_owners[irq] = task;
+    irq_cpus[irq] = cpu;
+    msi_indices[irq] = index;
+    error_t err = arch_msi_message(irq, irq_cpu(irq), addr, data);
+    if (err != OK) {
+        irq_owners[irq] = NULL;
+        irq_cpus[irq] = -1;
+        msi_indices[irq] = -1;
+        spin_unlock(&irq_lock);
+        return err;
+    }
+    spin_unlock(&irq_lock);
+
+    TRACE("allocated MSI: task=%s, index=%d, irq=%d", task->name, index, irq);
+    return OK;
+}
+
+/// Frees the IRQ allocated for the task's `index`-th MSI. The caller should
+/// disable the interrupt in the device first. Only MSIs allocated by the task
+/// are looked for.
+error_t task_free_msi(struct task *task, unsigned index) {
+    if (index >= 32) {
+        return ERR_INVALID_ARG;
+    }
+
+    spin_lock(&irq_lock);
+    int irq = lookup_msi(task, index);
+    if (irq < 0) {
+        spin_unlock(&irq_lock);
+        return ERR_NOT_FOUND;
+    }
+
+    irq_owners[irq] = NULL;
+    irq_cpus[irq] = -1;
+    msi_indices[irq] = -1;
+    spin_unlock(&irq_lock);
     return OK;
 }
 
+#ifdef CONFIG_TICKLESS
+/// Handles timer interrupts. The timer is programmed in one-shot mode for the
+/// next event by timer_reload(): it may fire after several ticks.
+void handle_timer_irq(void) {
+    if (mp_is_bsp()) {
+        timer_advance(arch_timer_now());
+    }
+
+    // Charge the elapsed ticks to the current task.
+    charge_elapsed(CURRENT);
+
+    // Switch task if the current task has spend its time slice or its
+    // scheduling context has run out of the budget.
+    if (!CURRENT->quantum || CURRENT == IDLE_TASK || is_throttled(CURRENT)) {
+        spin_lock(&CURRENT->lock);
+        task_switch();
+    } else {
+        timer_reload(CURRENT);
+        // A timer may have resumed a higher-priority task.
+        task_preempt();
+    }
+}
+#else
 /// Handles timer interrupts. The timer fires this IRQ every 1/TICK_HZ
 /// seconds.
 void handle_timer_irq(void) {
     if (mp_is_bsp()) {
-        // Handle task timeouts.
-        for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
-            struct task *task = &tasks[i];
-            if (task->state == TASK_UNUSED || !task->timeout) {
-                continue;
-            }
-
-            task->timeout--;
-            if (!task->timeout) {
-                notify(task, NOTIFY_TIMER);
-            }
-        }
+        timer_tick();
     }
 
-    // Switch task if the current task has spend its time slice.
+    // Charge the tick to the current task.
     DEBUG_ASSERT(CURRENT == IDLE_TASK || CURRENT->quantum > 0);
     CURRENT->quantum--;
-    if (!CURRENT->quantum || CURRENT == IDLE_TASK) {
+    if (CURRENT != IDLE_TASK) {
+        sc_charge(CURRENT, 1);
+    }
+
+    // Switch task if the current task has spend its time slice or its
+    // scheduling context has run out of the budget.
+    if (!CURRENT->quantum || CURRENT == IDLE_TASK || is_throttled(CURRENT)) {
+        spin_lock(&CURRENT->lock);
         task_switch();
+    } else {
+        // A timer may have resumed a higher-priority task.
+        task_preempt();
     }
 }
+#endif
 
 void handle_irq(unsigned irq) {
+    trace_event(TRACE_IRQ, CURRENT->tid, irq, 0);
+    spin_lock(&irq_lock);
     struct task *owner = irq_owners[irq];
+    int msi_index = msi_indices[irq];
+    spin_unlock(&irq_lock);
+
     if (owner) {
+        if (msi_index >= 0) {
+            __atomic_fetch_or(&owner->pending_msis, 1u << msi_index,
+                              __ATOMIC_RELAXED);
+        }
+
         notify(owner, NOTIFY_IRQ);
+        // Run the IRQ owner right away if it has a higher priority than the
+        // interrupted task.
+        task_preempt();
     }
 }
 
 /// The page fault handler. It calls a pager and updates the page table.
 void handle_page_fault(vaddr_t addr, vaddr_t ip, unsigned fault) {
     ASSERT(CURRENT->pager != NULL);
+    trace_event(TRACE_PAGE_FAULT, CURRENT->tid, addr, ip);
+    CURRENT->stats.page_faults++;
 
     struct message m;
     m.type = PAGE_FAULT_MSG;
@@ -294,8 +1139,23 @@ void task_dump(void) {
             continue;
         }
 
-        DPRINTK("#%d %s: state=%s, src=%d\n", task->tid, task->name,
-                states[task->state], task->src);
+        DPRINTK("#%d %s: state=%s, src=%d, cpu=%d, prio=%d/%d, "
+                "consumed=%llu ticks\n",
+                task->tid, task->name, states[task->state], task->src,
+                task->cpu, task->prio, task->base_prio,
+                (unsigned long long) task->own_sc.consumed);
+        if (task->own_sc.budget) {
+            DPRINTK("  budget: %d/%d ticks (remaining=%d)\n",
+                    task->own_sc.budget, task->own_sc.period,
+                    task->own_sc.remaining);
+        }
+        if ((task->affinity & online_cpus()) != online_cpus()) {
+            DPRINTK("  affinity: 0x%x\n", task->affinity & online_cpus());
+        }
+        if (task->sc_lender) {
+            DPRINTK("  running on a scheduling context lent by #%d %s\n",
+                    task->sc_lender->tid, task->sc_lender->name);
+        }
         if (!list_is_empty(&task->senders)) {
             DPRINTK("  senders:\n");
             LIST_FOR_EACH (sender, &task->senders, struct task, sender_next) {
@@ -303,17 +1163,160 @@ void task_dump(void) {
             }
         }
     }
+
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        DPRINTK("CPU #%d: %d runnable tasks\n",
+                cpu, get_cpuvar_of(cpu)->num_runnable);
+    }
+}
+
+static void dump_lock(const char *name, struct spinlock *lock) {
+    if (!lock->num_acquired) {
+        return;
+    }
+
+    DPRINTK("%s: acquired=%llu, contended=%llu\n", name,
+            (unsigned long long) lock->num_acquired,
+            (unsigned long long) lock->num_contended);
+}
+
+/// Prints lock contention statistics.
+void task_dump_locks(void) {
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        char name[32];
+        snprintf(name, sizeof(name), "CPU #%d runqueue", cpu);
+        dump_lock(name, &get_cpuvar_of(cpu)->runqueue_lock);
+    }
+
+    dump_lock("IRQ owners", &irq_lock);
+
+    for (unsigned i = 0; i < CONFIG_NUM_TASKS; i++) {
+        struct task *task = &tasks[i];
+        if (task->state != TASK_UNUSED) {
+            dump_lock(task->name, &task->lock);
+        }
+    }
+}
+
+/// Copies the performance counters of the task. The CPU time and the blocked
+/// time include the ongoing ones.
+error_t task_get_stats(struct task *task, struct task_stats *stats) {
+    spin_lock(&task->lock);
+    if (task->state == TASK_UNUSED) {
+        spin_unlock(&task->lock);
+        return ERR_INVALID_TASK;
+    }
+
+    memcpy(stats, &task->stats, sizeof(*stats));
+    stats->prio = task->prio;
+    stats->cpu = task->cpu;
+    uint64_t now = arch_read_cycles();
+    if (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE)
+        && now > task->run_start) {
+        stats->cycles += now - task->run_start;
+    }
+
+    if (task->state == TASK_BLOCKED && task != IDLE_TASK) {
+        stats->blocked_cycles += now - task->blocked_at;
+    }
+
+    spin_unlock(&task->lock);
+    return OK;
+}
+
+/// Prints per-task performance counters and the share of CPU time since the
+/// boot.
+void task_dump_top(void) {
+    struct task_stats stats;
+    uint64_t total = 0;
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        if (task_get_stats(&get_cpuvar_of(cpu)->idle_task, &stats) == OK) {
+            total += stats.cycles;
+        }
+    }
+
+    for (unsigned i = 0; i < CONFIG_NUM_TASKS; i++) {
+        if (task_get_stats(&tasks[i], &stats) == OK) {
+            total += stats.cycles;
+        }
+    }
+
+    if (!total) {
+        // The cycle counter is not available.
+        total = 1;
+    }
+
+    for (int cpu = 0; cpu < mp_num_cpus(); cpu++) {
+        if (task_get_stats(&get_cpuvar_of(cpu)->idle_task, &stats) == OK) {
+            DPRINTK("CPU #%d idle: cpu=%d%%\n", cpu,
+                    (int) ((stats.cycles * 100) / total));
+        }
+    }
+
+    for (unsigned i = 0; i < CONFIG_NUM_TASKS; i++) {
+        struct task *task = &tasks[i];
+        if (task_get_stats(task, &stats) != OK) {
+            continue;
+        }
+
+        DPRINTK("#%d %s: cpu=%d%%, cycles=%llu, blocked=%llu\n", task->tid,
+                task->name, (int) ((stats.cycles * 100) / total),
+                (unsigned long long) stats.cycles,
+                (unsigned long long) stats.blocked_cycles);
+        DPRINTK("  switches=%llu/%llu, sent=%llu, received=%llu, "
+                "page_faults=%llu, notifications=%llu\n",
+                (unsigned long long) stats.voluntary_switches,
+                (unsigned long long) stats.involuntary_switches,
+                (unsigned long long) stats.ipc_sent,
+                (unsigned long long) stats.ipc_received,
+                (unsigned long long) stats.page_faults,
+                (unsigned long long) stats.notifications);
+    }
 }
 
 /// Initializes the task subsystem.
 void task_init(void) {
-    list_init(&runqueue);
+    for (int cpu = 0; cpu < CPU_NUM_MAX; cpu++) {
+        struct cpuvar *cpuvar = get_cpuvar_of(cpu);
+        for (int prio = 0; prio <= TASK_PRIO_MAX; prio++) {
+            list_init(&cpuvar->runqueues[prio]);
+        }
+        cpuvar->runqueue_bitmap = 0;
+        cpuvar->num_runnable = 0;
+        cpuvar->switched_from = NULL;
+        cpuvar->switched_to_locked = false;
+        cpuvar->running_prio = -1;
+        cpuvar->need_resched = false;
+        spin_lock_init(&cpuvar->runqueue_lock);
+        spin_lock_init(&cpuvar->idle_task.lock);
+        spin_lock_init(&cpuvar->idle_task.vm_lock);
+    }
+
     for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
         tasks[i].state = TASK_UNUSED;
         tasks[i].tid = i + 1;
+        spin_lock_init(&tasks[i].lock);
+        spin_lock_init(&tasks[i].vm_lock);
+        for (int j = 0; j < CONFIG_NUM_TIMERS_PER_TASK; j++) {
+            timer_init_struct(&tasks[i].timers[j], &tasks[i], j);
+        }
+        timer_init_struct(&tasks[i].ipc_timer, &tasks[i], IPC_TIMER_INDEX);
     }
 
+    timer_init();
+    notification_init();
+#ifdef CONFIG_TRACE_BUFFER
+    trace_init();
+#endif
+#ifdef CONFIG_PROFILER
+    profiler_init();
+#endif
+
+    spin_lock_init(&irq_lock);
+
     for (int i = 0; i < IRQ_MAX; i++) {
         irq_owners[i] = NULL;
+        irq_cpus[i] = -1;
+        msi_indices[i] = -1;
     }
 }
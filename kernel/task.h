@@ -6,10 +6,21 @@
 #include <arch.h>
 #include <message.h>
 #include <list.h>
+#include "lock.h"
+#include "notification.h"
+#include "timer.h"
 
 /// The context switching time slice (# of ticks).
 #define TASK_TIME_SLICE ((CONFIG_TASK_TIME_SLICE_MS * TICK_HZ) / 1000)
 STATIC_ASSERT(TASK_TIME_SLICE > 0);
+STATIC_ASSERT(CONFIG_NUM_TIMERS_PER_TASK <= 32);
+STATIC_ASSERT(TASK_PRIO_MAX < 32);
+STATIC_ASSERT(CPU_NUM_MAX <= 32);
+
+/// A CPU is considered to be overloaded if its runqueue has this number of
+/// tasks more than the least loaded CPU. A resumed task is enqueued into the
+/// CPU where it last ran (for cache affinity) unless the CPU is overloaded.
+#define RUNQUEUE_IMBALANCE 2
 
 //
 // Task states.
@@ -30,12 +41,42 @@ STATIC_ASSERT(TASK_TIME_SLICE > 0);
 /// The idle task of the current CPU (`struct task *`).
 #define IDLE_TASK (&get_cpuvar()->idle_task)
 
+/// A scheduling context: the CPU time budget of a task. It's donated along
+/// with ipc_call: a server handling a call runs on (and is charged to) the
+/// client's scheduling context until it replies (see ipc.c).
+///
+/// Fields are updated by the CPU running a task on the context without locks:
+/// only one task in a call chain runs at a time.
+/// A scheduling context. It's updated by sys_sched() with the owner's lock
+/// held, and charged by the CPU running on it without locks.
+struct sched_context {
+    /// The budget in ticks per `period`. 0 means unlimited. It never exceeds
+    /// `period`.
+    unsigned budget;
+    /// The replenishment period in ticks.
+    unsigned period;
+    /// The remaining budget in the current period.
+    unsigned remaining;
+    /// The tick when `remaining` is replenished.
+    uint64_t replenish_at;
+    /// The total number of ticks charged to this context.
+    uint64_t consumed;
+};
+
 /// The task struct (so-called Task Control Block).
+///
+/// Fields modified by other tasks (`state`, `src`, `m`, `notifications`,
+/// `senders`, and `receiver`) are protected by `lock`. When a task
+/// blocks itself, it calls task_switch() with the lock held: the lock is
+/// released after its context is saved so that other CPUs never resume the
+/// task in the middle of the context switch.
 struct task {
     /// The arch-specific fields.
     struct arch_task arch;
     /// The task ID. Starts with 1.
     task_t tid;
+    /// The lock.
+    struct spinlock lock;
     /// The state.
     int state;
     /// The name of task terminated by NUL.
@@ -44,12 +85,45 @@ struct task {
     unsigned flags;
     /// Number of references to this task.
     unsigned ref_count;
-    /// The page table.
-    struct vm vm;
+    /// The CPU where the task last ran or is queued in. It's -1 if the task
+    /// has never been scheduled.
+    int cpu;
+    /// True if a CPU is running the task (or is in the middle of switching
+    /// from the task). Such a task must not be stolen by other CPUs.
+    bool on_cpu;
+    /// The bitmap of CPUs where the task is allowed to run. Protected by
+    /// `lock`.
+    uint32_t affinity;
+    /// The page table of the task. It's not used if the task is a thread.
+    struct vm own_vm;
+    /// Serializes updates and lookups of `own_vm` from all threads sharing
+    /// it: use `vm_owner->vm_lock`. It may be acquired while holding task
+    /// locks; no other locks are acquired while holding it.
+    struct spinlock vm_lock;
+    /// The page table which the task runs on: `own_vm` or the one of
+    /// `vm_owner` shared among its threads.
+    struct vm *vm;
+    /// The task which owns `vm`: the task itself or, if it's a thread, the
+    /// task which the thread has been created in. The owner holds a reference
+    /// from each thread: it can't be destroyed before its threads.
+    struct task *vm_owner;
     /// The pager task. When a page fault or an exception (e.g. divide by zero)
     /// occurred, the kernel sends a message to the pager to allow it to
     /// resolve the faults (or kill the task).
     struct task *pager;
+    /// The priority given by sys_exec or sys_sched.
+    unsigned base_prio;
+    /// The effective priority: `base_prio` or a higher priority inherited
+    /// from a client waiting for a reply from this task (see ipc.c). Updated
+    /// through task_set_prio().
+    unsigned prio;
+    /// The task's own scheduling context.
+    struct sched_context own_sc;
+    /// The client which has lent its scheduling context and its priority to
+    /// the task and is waiting for a reply from it, or NULL. The task runs on
+    /// the lender's context (see task_sc()) until it replies or the lender
+    /// stops waiting.
+    struct task *sc_lender;
     /// The remaining time slice in ticks. If this value reaches 0, the kernel
     /// switches into the next task (so-called preemptive context switching).
     unsigned quantum;
@@ -61,13 +135,50 @@ struct task {
     /// The pending notifications. It's cleared when the task received them as
     /// an message (NOTIFICATIONS_MSG).
     notifications_t notifications;
-    /// The IPC timeout in milliseconds. When it become 0, the kernel notify the
-    /// task with `NOTIFY_TIMER`.
-    msec_t timeout;
+    /// Timers. When a timer expires, the kernel sets the corresponding bit in
+    /// `expired_timers` and notifies the task with `NOTIFY_TIMER`. They're
+    /// protected by the timer lock, not `lock` (see timer.c).
+    struct timer timers[CONFIG_NUM_TIMERS_PER_TASK];
+    /// The timer which limits the time blocked in an IPC operation with
+    /// IPC_TIMEOUT. Protected by the timer lock.
+    struct timer ipc_timer;
+    /// The state of `ipc_timer` in the current IPC operation (IPC_TIMER_*).
+    /// Protected by `lock`.
+    int ipc_timer_state;
+    /// The bitmap of expired timers. Delivered and cleared with a
+    /// NOTIFICATIONS_MSG message. Updated atomically.
+    uint32_t expired_timers;
+    /// The bitmap of MSIs (by their indices given to task_alloc_msi()) raised
+    /// since the last NOTIFICATIONS_MSG. Updated atomically.
+    uint32_t pending_msis;
+    /// The bitmap of signaled notification objects owned by the task (by
+    /// their indices, see notification.c).
+    uint64_t pending_objects[NOTIFICATION_WORDS];
+    /// The user buffer (CONFIG_OOL_BUFFER_LEN bytes) to receive an ool payload
+    /// into. It's 0 if the task has no buffer. The buffer is consumed when a
+    /// ool payload is copied into it.
+    vaddr_t ool_buf;
+    /// The bounded queue of messages sent asynchronously (IPC_ASYNC). It's a
+    /// ring buffer: `async_num` messages from `async_head`. Keep it short: it
+    /// takes CONFIG_ASYNC_QUEUE_LEN full messages in every task.
+    struct message async_queue[CONFIG_ASYNC_QUEUE_LEN];
+    unsigned async_head;
+    unsigned async_num;
     /// The queue of tasks that are waiting for this task to get ready for
     /// receiving a message. If this task gets ready, it resumes all threads in
     /// this queue.
     list_t senders;
+    /// The receiver task which this task is waiting for in its `senders`
+    /// queue. It's NULL if the task is not blocked in the send phase.
+    struct task *receiver;
+    /// The performance counters. Updated by the CPU running the task, or with
+    /// `lock` held for ones updated by other tasks (`blocked_cycles` and
+    /// `notifications`).
+    struct task_stats stats;
+    /// The cycle counter when the task started running on the CPU.
+    uint64_t run_start;
+    /// The cycle counter when the task has been blocked.
+    uint64_t blocked_at;
     /// A (intrusive) list element in the runqueue.
     list_elem_t runqueue_next;
     /// A (intrusive) list element in a sender queue.
@@ -79,44 +190,104 @@ struct cpuvar {
     struct arch_cpuvar arch;
     struct task *current_task;
     struct task idle_task;
+    /// Queues of runnable tasks excluding the currently running task, one for
+    /// each priority. Other CPUs may steal tasks from these queues when
+    /// they're idle.
+    list_t runqueues[TASK_PRIO_MAX + 1];
+    /// The bitmap of priorities whose queue may be non-empty. A bit is set
+    /// when a task is enqueued and is cleared lazily when the queue is found
+    /// empty.
+    uint32_t runqueue_bitmap;
+    /// The number of tasks in `runqueues`.
+    unsigned num_runnable;
+    /// The lock for `runqueues`, `runqueue_bitmap`, and `num_runnable`.
+    struct spinlock runqueue_lock;
+    /// The task which this CPU has just switched from. Its lock is released
+    /// in task_switch_finish().
+    struct task *switched_from;
+    /// True if the task which this CPU has just switched to has been locked
+    /// across the context switch (see task_switch_to()). Its lock is released
+    /// in task_switch_finish().
+    bool switched_to_locked;
+    /// The priority of the task running on this CPU, or -1 if the CPU is idle.
+    /// Other CPUs read it without locks to decide whether to send a
+    /// reschedule IPI.
+    int running_prio;
+    /// Set when a task with a higher priority than the running one has been
+    /// enqueued into this CPU's runqueue. The CPU switches to it on return
+    /// from the system call (see task_preempt_if_needed()).
+    bool need_resched;
+#ifdef CONFIG_TICKLESS
+    /// The tick when the time slice of the current task was last charged.
+    uint64_t slice_start;
+#endif
 };
 
+/// Returns true if the task is allowed to run on `cpu`.
+static inline bool task_cpu_allowed(struct task *task, int cpu) {
+    return (task->affinity & (1u << cpu)) != 0;
+}
+
 __mustuse error_t task_create(struct task *task, const char *name, vaddr_t ip,
-                            struct task *pager, unsigned flags);
+                            vaddr_t sp, struct task *pager, unsigned flags);
 __mustuse error_t task_destroy(struct task *task);
 __noreturn void task_exit(enum exception_type exp);
 void task_block(struct task *task);
 void task_resume(struct task *task);
+void task_set_prio(struct task *task, unsigned prio);
+void task_update_prio(struct task *task);
+__mustuse error_t task_set_affinity(struct task *task, uint32_t affinity);
+void task_preempt(void);
+void task_preempt_if_needed(void);
 void task_notify(struct task *task, notifications_t notifications);
 struct task *task_lookup(task_t tid);
 struct task *task_lookup_unchecked(task_t tid);
+struct sched_context *task_sc(struct task *task);
+__mustuse error_t task_abort_call(struct task *task);
 void task_switch(void);
-__mustuse error_t task_listen_irq(struct task *task, unsigned irq);
-__mustuse error_t task_unlisten_irq(unsigned irq);
+void task_switch_to(struct task *next);
+void task_switch_finish(void);
+void task_lock_two(struct task *a, struct task *b);
+void task_unlock_two(struct task *a, struct task *b);
+__mustuse error_t task_listen_irq(struct task *task, unsigned irq, int cpu);
+__mustuse error_t task_unlisten_irq(struct task *task, unsigned irq);
+__mustuse error_t task_alloc_msi(struct task *task, unsigned index, int cpu,
+                                 uint64_t *addr, uint32_t *data);
+__mustuse error_t task_free_msi(struct task *task, unsigned index);
 void handle_timer_irq(void);
 void handle_irq(unsigned irq);
 void handle_page_fault(vaddr_t addr, vaddr_t ip, unsigned fault);
 void task_dump(void);
+void task_dump_locks(void);
+void task_dump_top(void);
+__mustuse error_t task_get_stats(struct task *task, struct task_stats *stats);
 void task_init(void);
 
 // Implemented in arch.
-void lock(void);
 void panic_lock(void);
-void unlock(void);
 int mp_self(void);
 int mp_num_cpus(void);
-void mp_reschedule(void);
-__mustuse error_t arch_task_create(struct task *task, vaddr_t ip);
+void mp_reschedule(int cpu);
+void mp_timer_reload(int cpu);
+__mustuse error_t arch_task_create(struct task *task, vaddr_t ip, vaddr_t sp);
 void arch_task_destroy(struct task *task);
 void arch_task_switch(struct task *prev, struct task *next);
-void arch_enable_irq(unsigned irq);
+void arch_enable_irq(unsigned irq, int cpu);
 void arch_disable_irq(unsigned irq);
+uint64_t arch_read_cycles(void);
+__mustuse error_t arch_msi_message(unsigned irq, int cpu, uint64_t *addr,
+                                   uint32_t *data);
+#ifdef CONFIG_TICKLESS
+uint64_t arch_timer_now(void);
+void arch_timer_set_deadline(uint64_t deadline);
+#endif
 struct vm;
 __mustuse error_t vm_create(struct vm *vm);
 void vm_destroy(struct vm *vm);
 __mustuse error_t vm_link(struct vm *vm, vaddr_t vaddr, paddr_t paddr,
                         paddr_t kpage, unsigned flags);
 void vm_unlink(struct vm *vm, vaddr_t vaddr);
-paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr);
+void vm_shootdown(struct vm *vm);
+paddr_t vm_resolve(struct vm *vm, vaddr_t vaddr, unsigned flags);
 
 #endif
@@ -0,0 +1,287 @@
+#include <list.h>
+#include "ipc.h"
+#include "printk.h"
+#include "profiler.h"
+#include "task.h"
+#include "timer.h"
+#include "trace.h"
+
+// The hierarchical timer wheel: a timer which expires in less than
+// WHEEL_SIZE^(n+1) ticks is put into the level-n wheel. Every time a wheel
+// wraps around, timers in the corresponding slot of the upper-level wheel are
+// moved (cascaded) into lower levels. Thus a tick only processes expired
+// timers and occasionally cascaded ones, not all timers.
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+/// Timers expiring after this number of ticks are put into the last slot of
+/// the top-level wheel and are re-inserted when they come around.
+#define WHEEL_RANGE  (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+static list_t wheel[WHEEL_LEVELS][WHEEL_SIZE];
+/// The next tick to be processed.
+static uint64_t current_tick = 1;
+/// The lock for the wheel and timers. It's acquired before task locks: tick()
+/// acquires task locks (in notify() and ipc_timeout()) while holding it. Thus
+/// timer_arm() and timer_cancel() must be called without holding task locks.
+static struct spinlock timer_lock;
+/// The number of armed timers.
+static unsigned num_armed = 0;
+#ifdef CONFIG_TICKLESS
+/// The next tick when the wheel needs to be processed or 0 if no timers are
+/// armed. It's read without `timer_lock` when programming the timer.
+static uint64_t next_deadline = 0;
+#endif
+
+/// Inserts the timer into the wheel. The caller must hold `timer_lock`.
+static void enqueue(struct timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < current_tick) {
+        // Already expired. Process it in the next tick.
+        expires = current_tick;
+    }
+
+    uint64_t delta = expires - current_tick;
+    if (delta >= WHEEL_RANGE) {
+        expires = current_tick + WHEEL_RANGE - 1;
+        delta = WHEEL_RANGE - 1;
+    }
+
+    int level = 0;
+    while (delta >= (1ULL << ((level + 1) * WHEEL_BITS))) {
+        level++;
+    }
+
+    unsigned index = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    list_push_back(&wheel[level][index], &timer->next);
+}
+
+#ifdef CONFIG_TICKLESS
+/// Updates `next_deadline`: the earliest non-empty slot in the level-0 wheel
+/// or the next cascade, whichever comes first. We don't look into upper
+/// levels: the BSP wakes up on every cascade while timers are armed, i.e. at
+/// most once every WHEEL_SIZE ticks. The caller must hold `timer_lock`.
+static void update_next_deadline(void) {
+    uint64_t deadline = 0;
+    if (num_armed > 0) {
+        for (uint64_t tick = current_tick;; tick++) {
+            if ((tick & WHEEL_MASK) == 0
+                || !list_is_empty(&wheel[0][tick & WHEEL_MASK])) {
+                deadline = tick;
+                break;
+            }
+        }
+    }
+
+    __atomic_store_n(&next_deadline, deadline, __ATOMIC_RELAXED);
+}
+#endif
+
+/// Moves timers in a slot of the upper-level wheel into lower levels.
+static void cascade(int level, unsigned index) {
+    list_t *slot = &wheel[level][index];
+    while (true) {
+        struct timer *timer = LIST_POP_FRONT(slot, struct timer, next);
+        if (!timer) {
+            break;
+        }
+
+        enqueue(timer);
+    }
+}
+
+/// Initializes a timer of the task.
+void timer_init_struct(struct timer *timer, struct task *task,
+                       unsigned index) {
+    list_nullify(&timer->next);
+    timer->expires = 0;
+    timer->task = task;
+    timer->index = index;
+}
+
+/// Converts milliseconds into ticks (rounded down).
+uint64_t msec_to_ticks(msec_t msec) {
+    // Avoid an overflow in `msec * TICK_HZ`.
+    return (uint64_t) (msec / 1000) * TICK_HZ + ((msec % 1000) * TICK_HZ) / 1000;
+}
+
+/// Returns the current tick. It's read without `timer_lock`.
+uint64_t timer_now(void) {
+#ifdef CONFIG_TICKLESS
+    return arch_timer_now();
+#else
+    return *((volatile uint64_t *) &current_tick);
+#endif
+}
+
+/// Arms the timer: it expires after `timeout` milliseconds. If it's already
+/// armed, the timeout is updated. A zero timeout disarms the timer.
+void timer_arm(struct timer *timer, msec_t timeout) {
+    spin_lock(&timer_lock);
+    if (timer->expires) {
+        list_remove(&timer->next);
+        timer->expires = 0;
+        num_armed--;
+    }
+
+    if (timeout > 0) {
+        uint64_t ticks = MAX(msec_to_ticks(timeout), 1);
+#ifdef CONFIG_TICKLESS
+        // The wheel is not processed while no timers are armed. Skip the
+        // ticks elapsed since then.
+        uint64_t now = arch_timer_now();
+        if (!num_armed && current_tick <= now) {
+            current_tick = now + 1;
+        }
+
+        timer->expires = now + ticks;
+#else
+        timer->expires = current_tick + ticks - 1;
+#endif
+        enqueue(timer);
+        num_armed++;
+    }
+
+#ifdef CONFIG_TICKLESS
+    uint64_t prev_deadline = next_deadline;
+    update_next_deadline();
+    bool earlier = next_deadline && (!prev_deadline
+                                     || next_deadline < prev_deadline);
+#endif
+    spin_unlock(&timer_lock);
+
+#ifdef CONFIG_TICKLESS
+    // The BSP might be sleeping until a later deadline: let it reprogram the
+    // timer. It doesn't need to reschedule.
+    if (earlier) {
+        if (mp_is_bsp()) {
+            timer_reload(CURRENT);
+        } else {
+            // The BSP is CPU #0.
+            mp_timer_reload(0);
+        }
+    }
+#endif
+}
+
+/// Disarms the timer.
+void timer_cancel(struct timer *timer) {
+    timer_arm(timer, 0);
+}
+
+/// Processes the current tick: fires expired timers. The caller must hold
+/// `timer_lock`.
+static void tick(void) {
+    // Cascade timers from upper levels if lower-level wheels have wrapped
+    // around.
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        uint64_t lower_mask = (1ULL << (level * WHEEL_BITS)) - 1;
+        if ((current_tick & lower_mask) != 0) {
+            break;
+        }
+
+        cascade(level, (current_tick >> (level * WHEEL_BITS)) & WHEEL_MASK);
+    }
+
+    list_t *slot = &wheel[0][current_tick & WHEEL_MASK];
+    while (true) {
+        struct timer *timer = LIST_POP_FRONT(slot, struct timer, next);
+        if (!timer) {
+            break;
+        }
+
+        DEBUG_ASSERT(timer->expires <= current_tick);
+        timer->expires = 0;
+        num_armed--;
+        trace_event(TRACE_TIMER, timer->task->tid, timer->index, 0);
+        if (timer->index == IPC_TIMER_INDEX) {
+            ipc_timeout(timer->task);
+            continue;
+        }
+
+        __atomic_fetch_or(&timer->task->expired_timers, 1u << timer->index,
+                          __ATOMIC_RELAXED);
+        notify(timer->task, NOTIFY_TIMER);
+    }
+
+    current_tick++;
+}
+
+/// Processes the current tick. It's called by the BSP every 1/TICK_HZ
+/// seconds.
+void timer_tick(void) {
+    spin_lock(&timer_lock);
+    tick();
+    spin_unlock(&timer_lock);
+}
+
+#ifdef CONFIG_TICKLESS
+/// Processes ticks up to `now`. It's called by the BSP on timer interrupts.
+void timer_advance(uint64_t now) {
+    spin_lock(&timer_lock);
+    if (!num_armed && current_tick <= now) {
+        // Nothing to be processed.
+        current_tick = now + 1;
+    }
+
+    while (current_tick <= now) {
+        tick();
+    }
+
+    update_next_deadline();
+    spin_unlock(&timer_lock);
+}
+
+/// Returns the tick when the wheel needs to be processed next (see
+/// update_next_deadline()), or 0 if no timers are armed.
+uint64_t timer_next_deadline(void) {
+    return __atomic_load_n(&next_deadline, __ATOMIC_RELAXED);
+}
+
+/// Programs the timer of the current CPU for the next event: the end of the
+/// time slice (or the budget) of `task`, which is running (or about to run) on the CPU, and
+/// the next deadline of the wheel if we're the BSP. If there are no events,
+/// the timer is stopped.
+void timer_reload(struct task *task) {
+    uint64_t deadline = 0;
+    if (task != IDLE_TASK) {
+        // Stop at the end of the time slice or when the scheduling context
+        // runs out of its budget, whichever comes first.
+        uint64_t ticks = task->quantum;
+        struct sched_context *sc = task_sc(task);
+        if (sc->budget && sc->remaining) {
+            ticks = MIN(ticks, (uint64_t) sc->remaining);
+        }
+
+        deadline = get_cpuvar()->slice_start + ticks;
+    }
+
+    if (mp_is_bsp()) {
+        uint64_t next = timer_next_deadline();
+        if (next && (!deadline || next < deadline)) {
+            deadline = next;
+        }
+    }
+
+    // The profiler samples on timer interrupts: keep ticking while it's
+    // started, even on idle CPUs.
+    if (profiler_enabled()) {
+        uint64_t next = timer_now() + 1;
+        if (!deadline || next < deadline) {
+            deadline = next;
+        }
+    }
+
+    arch_timer_set_deadline(deadline);
+}
+#endif
+
+void timer_init(void) {
+    spin_lock_init(&timer_lock);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            list_init(&wheel[level][i]);
+        }
+    }
+}
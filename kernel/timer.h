@@ -0,0 +1,39 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <types.h>
+#include <list.h>
+
+struct task;
+
+/// A one-shot timer. When it expires, the kernel notifies NOTIFY_TIMER to the
+/// task.
+struct timer {
+    /// A (intrusive) list element in the timer wheel.
+    list_elem_t next;
+    /// The tick when the timer expires. It's 0 if the timer is not armed.
+    uint64_t expires;
+    /// The task to be notified.
+    struct task *task;
+    /// The index in `task->timers`, or IPC_TIMER_INDEX for `task->ipc_timer`.
+    unsigned index;
+};
+
+/// The index of the timer which limits the time blocked in IPC (see
+/// ipc_timeout()).
+#define IPC_TIMER_INDEX 0xffffffff
+
+void timer_init_struct(struct timer *timer, struct task *task, unsigned index);
+void timer_arm(struct timer *timer, msec_t timeout);
+void timer_cancel(struct timer *timer);
+void timer_tick(void);
+uint64_t timer_now(void);
+uint64_t msec_to_ticks(msec_t msec);
+#ifdef CONFIG_TICKLESS
+void timer_advance(uint64_t now);
+uint64_t timer_next_deadline(void);
+void timer_reload(struct task *task);
+#endif
+void timer_init(void);
+
+#endif
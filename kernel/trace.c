@@ -0,0 +1,113 @@
+#include <string.h>
+#include "lock.h"
+#include "task.h"
+#include "trace.h"
+
+/// A per-CPU ring buffer of trace records.
+///
+/// Only the CPU owning the buffer writes records into it. Since interrupts are
+/// disabled in the kernel mode, it never records events concurrently: the
+/// writer needs no locks. When the buffer is full, the oldest records are
+/// overwritten: the reader detects it from `head` and reports the number of
+/// lost records instead.
+struct trace_buffer {
+    /// The records. A record with the sequence number `n` is stored in
+    /// `records[n % CONFIG_TRACE_BUFFER_LEN]`.
+    struct trace_record records[CONFIG_TRACE_BUFFER_LEN];
+    /// The sequence number of the next record. Updated only by the owner CPU.
+    uint64_t head;
+    /// The sequence number of the next record to be read. Protected by
+    /// `trace_lock`.
+    uint64_t tail;
+};
+
+// The layout is a part of the ABI: tools/trace2json.py decodes it.
+STATIC_ASSERT(sizeof(struct trace_record) == 32);
+
+static struct trace_buffer buffers[CPU_NUM_MAX];
+/// The lock for readers. Writers don't use it.
+static struct spinlock trace_lock;
+
+/// Returns the sequence number of the oldest record which is guaranteed not
+/// to be overwritten yet. The owner CPU may be writing the record `head`, that
+/// is, overwriting the record `head - CONFIG_TRACE_BUFFER_LEN`.
+static uint64_t oldest_record(uint64_t head) {
+    return (head >= CONFIG_TRACE_BUFFER_LEN)
+               ? head - CONFIG_TRACE_BUFFER_LEN + 1
+               : 0;
+}
+
+/// Records an event into the current CPU's trace buffer. See TRACE_* in
+/// message.h for the meaning of `task` and arguments.
+void trace_event(unsigned type, task_t task, uint64_t arg0, uint64_t arg1) {
+    struct trace_buffer *buf = &buffers[mp_self()];
+    uint64_t head = buf->head;
+    // Make the previous update of `head` visible to readers before starting
+    // to overwrite the oldest record.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct trace_record *record = &buf->records[head % CONFIG_TRACE_BUFFER_LEN];
+    record->cycles = arch_read_cycles();
+    record->type = type;
+    record->cpu = mp_self();
+    record->task = task;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+    __atomic_store_n(&buf->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/// Fills a record which is generated by the reader, not by a writer.
+static void fill_record(struct trace_record *record, unsigned type, int cpu,
+                        uint64_t arg0) {
+    record->cycles = arch_read_cycles();
+    record->type = type;
+    record->cpu = cpu;
+    record->task = 0;
+    record->arg0 = arg0;
+    record->arg1 = 0;
+}
+
+/// Fills a TRACE_CLOCK record: the decoder needs it to convert cycles into
+/// time.
+void trace_clock(struct trace_record *record) {
+    fill_record(record, TRACE_CLOCK, mp_self(), arch_cycles_per_ms());
+}
+
+/// Reads and consumes up to `max` records from all CPUs' buffers. Records are
+/// ordered by CPU, not by time. It returns the number of records read.
+int trace_read(struct trace_record *buf, int max) {
+    int n = 0;
+    spin_lock(&trace_lock);
+    for (int cpu = 0; cpu < mp_num_cpus() && n < max; cpu++) {
+        struct trace_buffer *tb = &buffers[cpu];
+        uint64_t head = __atomic_load_n(&tb->head, __ATOMIC_ACQUIRE);
+        while (tb->tail < head && n < max) {
+            uint64_t oldest = oldest_record(head);
+            if (tb->tail < oldest) {
+                // The writer has overwritten records we've not read yet.
+                fill_record(&buf[n++], TRACE_LOST, cpu, oldest - tb->tail);
+                tb->tail = oldest;
+                continue;
+            }
+
+            memcpy(&buf[n], &tb->records[tb->tail % CONFIG_TRACE_BUFFER_LEN],
+                   sizeof(*buf));
+
+            // Check if the writer has started overwriting the record while
+            // we're copying it. If so, discard it: it'll be reported as lost.
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            head = __atomic_load_n(&tb->head, __ATOMIC_RELAXED);
+            if (tb->tail >= oldest_record(head)) {
+                n++;
+                tb->tail++;
+            }
+        }
+    }
+
+    spin_unlock(&trace_lock);
+    return n;
+}
+
+void trace_init(void) {
+    spin_lock_init(&trace_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <config.h>
+#include <types.h>
+#include <message.h>
+
+#ifdef CONFIG_TRACE_BUFFER
+void trace_event(unsigned type, task_t task, uint64_t arg0, uint64_t arg1);
+void trace_clock(struct trace_record *record);
+__mustuse int trace_read(struct trace_record *buf, int max);
+void trace_init(void);
+#else
+static inline void trace_event(__unused unsigned type, __unused task_t task,
+                               __unused uint64_t arg0,
+                               __unused uint64_t arg1) {
+}
+#endif
+
+// Implemented in arch.
+uint64_t arch_cycles_per_ms(void);
+
+#endif
@@ -1,3 +1,3 @@
 name := common
-obj-y += string.o vprintf.o ubsan.o
+obj-y += string.o vprintf.o ubsan.o message.o
 subdir-y += arch/$(ARCH)
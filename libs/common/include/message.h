@@ -44,4 +44,119 @@ struct message {
 STATIC_ASSERT(sizeof(struct message) == MESSAGE_SIZE);
 IDL_STATIC_ASSERTS /* some assertions defined in idl.h */
 
+/// The size of the message header (`type` and `src`).
+#define MESSAGE_HEADER_LEN offsetof(struct message, raw)
+/// The maximum size of the message payload.
+#define MESSAGE_PAYLOAD_MAX (MESSAGE_SIZE - MESSAGE_HEADER_LEN)
+
+size_t msg_payload_len(int type);
+
+/// Returns the number of bytes to be copied to transfer a message of the
+/// type: the header and the payload.
+static inline size_t msg_len(int type) {
+    return MESSAGE_HEADER_LEN + msg_payload_len(type);
+}
+
+/// The maximum number of entries in a batched IPC submission.
+#define IPC_BATCH_MAX 32
+
+/// An entry of the batched IPC submission (see `ipc_reply_deferred()`). The
+/// kernel processes entries in order.
+struct ipc_batch_entry {
+    /// The destination task.
+    task_t dst;
+    /// The operation: IPC_SEND or IPC_NOTIFY. Sends never block: they fail
+    /// with ERR_WOULD_BLOCK if the destination is not ready.
+    unsigned flags;
+    /// The notifications to be sent. Used if IPC_NOTIFY is set.
+    notifications_t notifications;
+    /// The result of the operation. Filled by the kernel.
+    error_t result;
+    /// The message to be sent. Used if IPC_SEND is set.
+    struct message m;
+};
+
+/// A message-signaled interrupt (MSI) allocated by `sys_msi()`. A device
+/// raises the interrupt by writing `data` into `addr`: program them into its
+/// MSI capability or MSI-X table entry.
+struct msi_message {
+    uint64_t addr;
+    uint32_t data;
+};
+
+/// Per-task performance counters (see `sys_task_stats()`). They're counted
+/// since the task has been created. CPU time is in the cycles of the CPU's
+/// cycle counter (e.g. TSC).
+struct task_stats {
+    /// The CPU time consumed by the task.
+    uint64_t cycles;
+    /// The time spent blocked (waiting for a message or a receiver).
+    uint64_t blocked_cycles;
+    /// The number of context switches from the task because it blocked.
+    uint64_t voluntary_switches;
+    /// The number of context switches from the task while it's runnable
+    /// (e.g. preempted by a higher-priority task or at the end of the time
+    /// slice).
+    uint64_t involuntary_switches;
+    /// The number of messages sent (including async messages).
+    uint64_t ipc_sent;
+    /// The number of messages received (including notifications).
+    uint64_t ipc_received;
+    /// The number of page faults.
+    uint64_t page_faults;
+    /// The number of notifications sent to the task.
+    uint64_t notifications;
+    /// The current priority, including the one inherited from its clients.
+    uint32_t prio;
+    /// The CPU which the task is running on or has run last, or -1 if it has
+    /// never run.
+    int32_t cpu;
+};
+
+/// A sample taken by the profiler (see `sys_kdebug("profile")`).
+struct profile_sample {
+    /// The interrupted instruction pointer in the user space. If the CPU was in
+    /// the kernel, the one where the task entered the kernel (e.g. a system
+    /// call), or 0 if the task has no user space (the idle task).
+    uint64_t user_ip;
+    /// The interrupted instruction pointer in the kernel, or 0 if the CPU was
+    /// in the user space.
+    uint64_t kernel_ip;
+    task_t task;
+    uint32_t cpu;
+    /// The task name. Not terminated by NUL if it's 16 characters long.
+    char name[16];
+};
+
+// Trace event types (see `sys_kdebug("trace")`).
+/// `task` sent a message of type `arg1` to the task `arg0`.
+#define TRACE_IPC_SEND   1
+/// `task` received a message of type `arg1` from the task `arg0`.
+#define TRACE_IPC_RECV   2
+/// The CPU switched from the task `arg0` to `task`.
+#define TRACE_SWITCH     3
+/// The IRQ `arg0` interrupted `task`.
+#define TRACE_IRQ        4
+/// `task` caused a page fault at `arg0` (the instruction pointer is `arg1`).
+#define TRACE_PAGE_FAULT 5
+/// Notifications `arg0` were sent to `task`.
+#define TRACE_NOTIFY     6
+/// The timer `arg0` of `task` expired.
+#define TRACE_TIMER      7
+/// `arg0` records of the CPU have been overwritten before they're read.
+#define TRACE_LOST       8
+/// The cycle counter runs at `arg0` cycles per millisecond.
+#define TRACE_CLOCK      9
+
+/// A kernel event recorded in a trace buffer.
+struct trace_record {
+    /// The cycle counter (e.g. TSC) when the event occurred.
+    uint64_t cycles;
+    uint16_t type;
+    uint16_t cpu;
+    task_t task;
+    uint64_t arg0;
+    uint64_t arg1;
+};
+
 #endif
@@ -80,7 +80,8 @@ typedef int error_t;
 #define DONT_REPLY         (-14)
 #define ERR_IN_USE         (-15)
 #define ERR_TRY_AGAIN      (-16)
-#define ERR_END            (-17)
+#define ERR_TIMEOUT        (-17)
+#define ERR_END            (-18)
 
 // System call numbers.
 #define SYS_EXEC    1
@@ -89,10 +90,46 @@ typedef int error_t;
 #define SYS_MAP     4
 #define SYS_PRINT   6
 #define SYS_KDEBUG  7
+#define SYS_IPC_BATCH 8
+#define SYS_SCHED   9
+#define SYS_MSI     10
+#define SYS_NOTIFICATION 11
+#define SYS_TASK_STATS 12
 
 // Task flags.
 #define TASK_IO      (1 << 0)
 #define TASK_ABI_EMU (1 << 1)
+/// Pins the task to the CPU `cpu` (see also SCHED_AFFINITY). By default, a
+/// task may run on any CPU.
+#define TASK_CPU(cpu)               ((((cpu) + 1) & 0x3f) << 2)
+#define TASK_CPU_FROM_FLAGS(flags)  ((int) (((flags) >> 2) & 0x3f) - 1)
+/// The scheduling priority (0 to TASK_PRIO_MAX) in task flags. Runnable tasks
+/// with a larger value run first. The default is 0.
+#define TASK_PRIO(prio)             (((prio) & TASK_PRIO_MAX) << 8)
+#define TASK_PRIO_FROM_FLAGS(flags) (((flags) >> 8) & TASK_PRIO_MAX)
+#define TASK_PRIO_MAX               31
+/// Creates a thread: a task which shares the address space (and the pager)
+/// with the task `tid` (see sys_exec).
+#define TASK_VM(tid)                ((unsigned) (tid) << 16)
+#define TASK_VM_FROM_FLAGS(flags)   ((task_t) ((flags) >> 16))
+
+// Scheduling attributes (sys_sched).
+#define SCHED_PRIORITY 1
+/// The CPU time budget (in milliseconds) per period of the task's scheduling
+/// context. 0 means unlimited (the default). It must not exceed the period:
+/// set the period first.
+#define SCHED_BUDGET   2
+/// The replenishment period (in milliseconds) of the scheduling context.
+#define SCHED_PERIOD   3
+/// The bitmap of CPUs where the task is allowed to run. IRQs listened by the
+/// task are delivered to the first CPU in it.
+#define SCHED_AFFINITY 4
+
+// Notification object operations (sys_notification).
+#define NOTIFICATION_CREATE  1
+#define NOTIFICATION_DESTROY 2
+#define NOTIFICATION_MINT    3
+#define NOTIFICATION_SIGNAL  4
 
 // Map flags.
 #define MAP_UPDATE (1 << 0)
@@ -107,9 +144,16 @@ typedef int error_t;
 #define IPC_SEND    (1 << 0)
 #define IPC_RECV    (1 << 1)
 #define IPC_CALL    (IPC_SEND | IPC_RECV)
+/// Don't block in the send phase. In a receive-only operation, don't block if
+/// no senders are waiting.
 #define IPC_NOBLOCK (1 << 2)
 #define IPC_NOTIFY  (1 << 3)
 #define IPC_KERNEL  (1 << 4) /* Internally used by kernel. */
+#define IPC_ASYNC   (1 << 5)
+/// Aborts the IPC operation with ERR_TIMEOUT if it's blocked for `ms`
+/// milliseconds (1 to 65535) in total. 0 means no timeout.
+#define IPC_TIMEOUT(ms)               (((unsigned) (ms) & 0xffff) << 16)
+#define IPC_TIMEOUT_FROM_FLAGS(flags) ((flags) >> 16)
 
 // Flags in the message type (m->type).
 #define MSG_STR  (1 << 30)
@@ -0,0 +1,20 @@
+#include <message.h>
+
+/// The payload size of each message type defined in the IDL.
+static const size_t payload_lens[IDL_MSGID_MAX + 1] = IDL_MSGID2LEN;
+
+/// Returns the number of bytes in `raw` used by the message. Error messages
+/// (negative `type`) have no payload. Messages not defined in the IDL are
+/// assumed to use the whole payload.
+size_t msg_payload_len(int type) {
+    if (type < 0) {
+        return 0;
+    }
+
+    int id = MSG_ID(type);
+    if (id == 0 || id > IDL_MSGID_MAX) {
+        return MESSAGE_PAYLOAD_MAX;
+    }
+
+    return payload_lens[id];
+}
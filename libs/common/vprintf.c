@@ -266,6 +266,7 @@ static const char *error_names[] = {
     [-ERR_NOT_ACCEPTABLE] = "Not Acceptable",
     [-ERR_IN_USE] = "In Use",
     [-ERR_TRY_AGAIN] = "Try Again",
+    [-ERR_TIMEOUT] = "Timed Out",
 };
 
 const char *err2str(error_t err) {
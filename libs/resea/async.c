@@ -1,6 +1,7 @@
 #include <resea/async.h>
 #include <resea/malloc.h>
 #include <resea/ipc.h>
+#include <resea/syscall.h>
 #include <string.h>
 
 #define NUM_BUCKETS 32
@@ -20,8 +21,38 @@ static list_t *get_queue(task_t dst) {
     return q;
 }
 
+/// Returns true if there're messages for `dst` in our queue.
+static bool has_queued_messages(list_t *q, task_t dst) {
+    LIST_FOR_EACH (am, q, struct async_message, next) {
+        if (am->dst == dst) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Sends a message asynchronously. The message is queued in the kernel and
+/// delivered to `dst` as an ordinary message. If the message has an ool
+/// payload or the kernel's queue is full, it's queued in our queue instead and
+/// `dst` pulls it by `async_recv()` when it receives NOTIFY_ASYNC.
+///
+/// Messages to the same `dst` are received in order: once a message is in our
+/// queue, later ones follow it through our queue until `dst` pulls them all,
+/// and the kernel delivers NOTIFY_ASYNC only after the messages queued in the
+/// kernel.
 error_t async_send(task_t dst, struct message *m) {
     list_t *q = get_queue(dst);
+
+    // Don't use the kernel's queue if older messages remain in our queue:
+    // they would be overtaken.
+    if ((m->type & MSG_OOL) == 0 && !has_queued_messages(q, dst)) {
+        error_t err = sys_ipc(dst, 0, m, IPC_SEND | IPC_ASYNC, NULL);
+        if (err != ERR_WOULD_BLOCK) {
+            return err;
+        }
+    }
+
     struct async_message *am = malloc(sizeof(*am));
     am->dst = dst;
     memcpy(&am->m, m, sizeof(am->m));
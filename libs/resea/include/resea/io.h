@@ -4,8 +4,21 @@
 #include <arch/io.h>
 #include <types.h>
 
+/// Flags for `io_grant_pages()`.
+/// Unmaps the pages from the caller and transfers the ownership.
+#define GRANT_MOVE     (1 << 0)
+/// The receiver task can only read the pages.
+#define GRANT_READONLY (1 << 1)
+
 error_t irq_acquire(unsigned irq);
+error_t irq_set_cpu(unsigned irq, int cpu);
 error_t irq_release(unsigned irq);
+struct msi_message;
+error_t msi_alloc(unsigned index, int cpu, struct msi_message *msg);
+error_t msi_free(unsigned index);
 void *io_alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr);
+error_t io_grant_pages(task_t dst, void *buf, size_t num_pages, unsigned flags,
+                       vaddr_t *granted);
+error_t io_release_pages(void *buf, size_t num_pages);
 
 #endif
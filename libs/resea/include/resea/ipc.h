@@ -10,10 +10,20 @@ void ipc_reply(task_t dst, struct message *m);
 void ipc_reply_err(task_t dst, error_t error);
 error_t ipc_notify(task_t dst, notifications_t notifications);
 error_t ipc_recv(task_t src, struct message *m);
+error_t ipc_recv_noblock(task_t src, struct message *m);
+error_t ipc_recv_timeout(task_t src, struct message *m, msec_t timeout);
 error_t ipc_call(task_t dst, struct message *m);
+error_t ipc_call_timeout(task_t dst, struct message *m, msec_t timeout);
 error_t ipc_send_err(task_t dst, error_t error);
 error_t ipc_replyrecv(task_t dst, struct message *m);
+void ipc_reply_deferred(task_t dst, struct message *m);
+void ipc_notify_deferred(task_t dst, notifications_t notifications);
+error_t ipc_flush(void);
 error_t ipc_serve(const char *name);
 task_t ipc_lookup(const char *name);
+int notification_create(void);
+error_t notification_destroy(int object);
+error_t notification_mint(int object, task_t task, uint32_t badge);
+error_t notification_signal(int object);
 
 #endif
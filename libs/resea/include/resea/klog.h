@@ -2,8 +2,11 @@
 #define __RESEA_KLOG_H__
 
 #include <types.h>
+#include <message.h>
 
 int klog_read(char *buf, size_t len);
+int klog_read_trace(struct trace_record *buf, size_t len);
+int klog_read_profile(struct profile_sample *buf, size_t len);
 error_t klog_write(const char *buf, size_t len);
 
 #endif
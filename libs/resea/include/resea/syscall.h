@@ -9,14 +9,38 @@ static inline task_t sys_exec(task_t tid, const char *name, vaddr_t ip,
     return syscall(SYS_EXEC, tid, (uintptr_t) name, ip, pager, flags);
 }
 
-static inline task_t sys_listen(msec_t timeout, int irq) {
-    return syscall(SYS_LISTEN, timeout, irq, 0, 0, 0);
+static inline task_t sys_listen(msec_t timeout, int irq, unsigned timer,
+                                int cpu) {
+    return syscall(SYS_LISTEN, timeout, irq, timer, cpu, 0);
+}
+
+struct msi_message;
+static inline error_t sys_msi(unsigned index, int cpu,
+                              struct msi_message *msg) {
+    return syscall(SYS_MSI, index, cpu, (uintptr_t) msg, 0, 0);
+}
+
+static inline int sys_notification(unsigned op, int object, task_t task,
+                                   uint32_t badge) {
+    return syscall(SYS_NOTIFICATION, op, object, task, badge, 0);
+}
+
+struct task_stats;
+static inline error_t sys_task_stats(task_t tid, struct task_stats *stats) {
+    return syscall(SYS_TASK_STATS, tid, (uintptr_t) stats, 0, 0, 0);
 }
 
 struct message;
 static inline error_t sys_ipc(task_t dst, task_t src, struct message *m,
-                              unsigned flags) {
-    return syscall(SYS_IPC, dst, src, (uintptr_t) m, flags, 0);
+                              unsigned flags, void *ool_buf) {
+    return syscall(SYS_IPC, dst, src, (uintptr_t) m, flags,
+                   (uintptr_t) ool_buf);
+}
+
+struct ipc_batch_entry;
+static inline int sys_ipc_batch(struct ipc_batch_entry *entries,
+                                int num_entries) {
+    return syscall(SYS_IPC_BATCH, (uintptr_t) entries, num_entries, 0, 0, 0);
 }
 
 static inline error_t sys_map(task_t task, vaddr_t vaddr, vaddr_t src,
@@ -24,6 +48,10 @@ static inline error_t sys_map(task_t task, vaddr_t vaddr, vaddr_t src,
     return syscall(SYS_MAP, task, vaddr, src, kpage, flags);
 }
 
+static inline error_t sys_sched(task_t task, unsigned attr, unsigned value) {
+    return syscall(SYS_SCHED, task, attr, value, 0, 0);
+}
+
 static inline error_t sys_print(const char *buf, size_t len) {
     return syscall(SYS_PRINT, (uintptr_t) buf, len, 0, 0, 0);
 }
@@ -2,13 +2,32 @@
 #define __IPC_TASK_H__
 
 #include <types.h>
+#include <message.h>
+
+/// Per-thread states of the user library.
+struct thread_state {
+    /// The internal buffer to receive ool payloads.
+    void *ool_ptr;
+    /// Deferred replies and notifications to be submitted by `ipc_flush()`.
+    struct ipc_batch_entry batch[IPC_BATCH_MAX];
+    int batch_len;
+};
 
 error_t task_create(task_t tid, const char *name, vaddr_t ip, task_t pager,
                    unsigned flags);
+error_t task_create_thread(task_t tid, task_t owner, vaddr_t ip, vaddr_t sp,
+                           task_t pager, unsigned flags);
 error_t task_destroy(task_t task);
 void task_exit(void);
 task_t task_self(void);
 error_t task_map(task_t task, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
                  unsigned flags);
+error_t task_set_priority(task_t task, unsigned prio);
+error_t task_set_budget(task_t task, msec_t budget, msec_t period);
+error_t task_set_affinity(task_t task, uint32_t cpus);
+error_t task_get_stats(task_t task, struct task_stats *stats);
+task_t thread_create(void (*entry)(void *arg), void *arg);
+void thread_exit(void);
+struct thread_state *thread_state(void);
 
 #endif
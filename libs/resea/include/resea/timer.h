@@ -4,5 +4,6 @@
 #include <types.h>
 
 error_t timer_set(msec_t timeout);
+error_t timer_set_id(unsigned id, msec_t timeout);
 
 #endif
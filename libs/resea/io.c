@@ -5,11 +5,30 @@
 #include <resea/syscall.h>
 
 error_t irq_acquire(unsigned irq) {
-    return sys_listen(-1 /* do nothing */, irq + 1);
+    return sys_listen(-1 /* do nothing */, irq + 1, 0, -1);
+}
+
+/// Routes the acquired IRQ to `cpu`. If `cpu` is -1, it's delivered to a CPU
+/// where the current task is allowed to run (see task_set_affinity()).
+error_t irq_set_cpu(unsigned irq, int cpu) {
+    return sys_listen(-1 /* do nothing */, irq + 1, 0, cpu);
 }
 
 error_t irq_release(unsigned irq) {
-    return sys_listen(-1 /* do nothing */, -(irq + 1));
+    return sys_listen(-1 /* do nothing */, -(irq + 1), 0, -1);
+}
+
+/// Allocates a message-signaled interrupt. When the device writes `msg->data`
+/// into `msg->addr`, the current task receives NOTIFY_IRQ and the `index`-th
+/// bit (0 to 31) is set in `m.notifications.irqs`. `cpu` is the CPU which
+/// handles the interrupt or -1 to follow the task's CPU affinity. Calling it
+/// again for the same `index` returns the message for the new CPU.
+error_t msi_alloc(unsigned index, int cpu, struct msi_message *msg) {
+    return sys_msi(index, cpu, msg);
+}
+
+error_t msi_free(unsigned index) {
+    return sys_msi(index, -1, NULL);
 }
 
 void *io_alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr) {
@@ -27,3 +46,39 @@ void *io_alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr) {
     *paddr = m.alloc_pages_reply.paddr;
     return (void *) m.alloc_pages_reply.vaddr;
 }
+
+/// Maps page-aligned `buf` into `dst`'s address space without copying it.
+/// The address in `dst` is returned in `granted`: send it to `dst` in a
+/// message.
+error_t io_grant_pages(task_t dst, void *buf, size_t num_pages, unsigned flags,
+                       vaddr_t *granted) {
+    struct message m;
+    m.type = GRANT_PAGES_MSG;
+    m.grant_pages.dst = dst;
+    m.grant_pages.vaddr = (vaddr_t) buf;
+    m.grant_pages.num_pages = num_pages;
+    m.grant_pages.flags = flags;
+    error_t err = ipc_call(INIT_TASK, &m);
+    if (err != OK) {
+        return err;
+    }
+
+    ASSERT(m.type == GRANT_PAGES_REPLY_MSG);
+    *granted = m.grant_pages_reply.vaddr;
+    return OK;
+}
+
+/// Unmaps pages granted by `io_grant_pages()`.
+error_t io_release_pages(void *buf, size_t num_pages) {
+    struct message m;
+    m.type = RELEASE_PAGES_MSG;
+    m.release_pages.vaddr = (vaddr_t) buf;
+    m.release_pages.num_pages = num_pages;
+    error_t err = ipc_call(INIT_TASK, &m);
+    if (err != OK) {
+        return err;
+    }
+
+    ASSERT(m.type == RELEASE_PAGES_REPLY_MSG);
+    return OK;
+}
@@ -2,11 +2,10 @@
 #include <resea/syscall.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
+#include <resea/task.h>
 #include <string.h>
 
-/// The internal buffer to receive ool payloads.
 #ifndef CONFIG_NOMMU
-static void *ool_ptr = NULL;
 static const size_t ool_len = CONFIG_OOL_BUFFER_LEN;
 #endif
 
@@ -30,85 +29,58 @@ static error_t call_pager(struct message *m) {
 #endif
 }
 
-static void ool_recv(vaddr_t ptr, size_t len) {
-    struct message m;
-    m.type = OOL_RECV_MSG;
-    m.ool_recv.addr = ptr;
-    m.ool_recv.len = len;
-    error_t err = call_pager(&m);
-    ASSERT_OK(err);
-    ASSERT(m.type == OOL_RECV_REPLY_MSG);
-}
-
-static vaddr_t ool_send(task_t dst, vaddr_t ptr, size_t len) {
-    struct message m;
-    m.type = OOL_SEND_MSG;
-    m.ool_send.dst = dst;
-    m.ool_send.addr = ptr;
-    m.ool_send.len = len;
-    error_t err = call_pager(&m);
-    ASSERT_OK(err);
-    ASSERT(m.type == OOL_SEND_REPLY_MSG);
-    return m.ool_send_reply.id;
-}
-
-static vaddr_t ool_verify(task_t src, vaddr_t ptr, size_t len) {
-    struct message m;
-    m.type = OOL_VERIFY_MSG;
-    m.ool_verify.src = src;
-    m.ool_verify.id = ptr;
-    m.ool_verify.len = len;
-    error_t err = call_pager(&m);
-    if (err != OK) {
-        return 0;
-    }
-
-    ASSERT(m.type == OOL_VERIFY_REPLY_MSG);
-    return m.ool_verify_reply.received_at;
-}
-
 static void pre_send(task_t dst, struct message *m) {
 #ifndef CONFIG_NOMMU
     if (!IS_ERROR(m->type) && m->type & MSG_OOL) {
         if (m->type & MSG_STR) {
             m->ool_len = strlen(m->ool_ptr) + 1;
         }
-
-        m->ool_ptr = (void *) ool_send(dst, (vaddr_t) m->ool_ptr, m->ool_len);
     }
 #endif
 }
 
-static void pre_recv(void) {
+/// Returns the buffer to receive an ool payload. The kernel copies a payload
+/// into it directly: it does not handle page faults on it.
+static void *pre_recv(void) {
 #ifndef CONFIG_NOMMU
-    if (!ool_ptr) {
-        ool_ptr = malloc(ool_len);
-        ool_recv((vaddr_t) ool_ptr, ool_len);
+    struct thread_state *state = thread_state();
+    if (!state->ool_ptr) {
+        state->ool_ptr = malloc(ool_len);
+
+        // Fill all pages of the buffer in advance.
+        volatile uint8_t *p = state->ool_ptr;
+        for (size_t off = 0; off < ool_len; off += PAGE_SIZE) {
+            p[off] = 0;
+        }
+        p[ool_len - 1] = 0;
     }
+
+    return state->ool_ptr;
+#else
+    return NULL;
 #endif
 }
 
  static error_t post_recv(error_t err, struct message *m) {
 #ifndef CONFIG_NOMMU
-    if (!IS_ERROR(m->type) && m->type & MSG_OOL) {
-        // Received a ool payload.
-        m->ool_ptr = (void *) ool_verify(m->src, (vaddr_t) m->ool_ptr,
-                                               m->ool_len);
-        if (!m->ool_ptr) {
-            WARN_DBG("received an invalid oolcopy payload from #%d: %s",
-                     m->src, err2str(err));
-            m->type = INVALID_MSG;
-            return OK;
-        }
-
-        // We've consumed `ool_ptr` so set NULL to it
-        // and reallocate the receiver buffer later.
-        ool_ptr = NULL;
+    if (IS_OK(err) && !IS_ERROR(m->type) && m->type & MSG_OOL) {
+        // The kernel has copied a ool payload into `ool_ptr`. We've consumed
+        // it so set NULL to it and reallocate the receiver buffer later.
+        struct thread_state *state = thread_state();
+        DEBUG_ASSERT(m->ool_ptr == state->ool_ptr);
+        state->ool_ptr = NULL;
 
         // A mitigation for a non-terminated (malicious) string payload.
         if (m->type & MSG_STR) {
+            if (!m->ool_len) {
+                WARN_DBG("received an empty string payload from #%d", m->src);
+                free(m->ool_ptr);
+                m->type = INVALID_MSG;
+                return OK;
+            }
+
             char *str = m->ool_ptr;
-            str[m->ool_len] = '\0';
+            str[m->ool_len - 1] = '\0';
         }
     }
 #endif
@@ -119,19 +91,13 @@ static void pre_recv(void) {
  }
 
 error_t ipc_send(task_t dst, struct message *m) {
-    void *saved_ool_ptr = m->ool_ptr;
     pre_send(dst, m);
-    error_t err = sys_ipc(dst, 0, m, IPC_SEND);
-    m->ool_ptr = saved_ool_ptr;
-    return err;
+    return sys_ipc(dst, 0, m, IPC_SEND, NULL);
 }
 
 error_t ipc_send_noblock(task_t dst, struct message *m) {
-    void *saved_ool_ptr = m->ool_ptr;
     pre_send(dst, m);
-    error_t err = sys_ipc(dst, 0, m, IPC_SEND | IPC_NOBLOCK);
-    m->ool_ptr = saved_ool_ptr;
-    return err;
+    return sys_ipc(dst, 0, m, IPC_SEND | IPC_NOBLOCK, NULL);
 }
 
 error_t ipc_send_err(task_t dst, error_t error) {
@@ -152,27 +118,120 @@ void ipc_reply_err(task_t dst, error_t error) {
 }
 
 error_t ipc_notify(task_t dst, notifications_t notifications) {
-    return sys_ipc(dst, 0, (void *) (uintptr_t) notifications, IPC_NOTIFY);
+    return sys_ipc(dst, 0, (void *) (uintptr_t) notifications, IPC_NOTIFY,
+                   NULL);
 }
 
-error_t ipc_recv(task_t src, struct message *m) {
-    pre_recv();
-    error_t err = sys_ipc(0, src, m, IPC_RECV);
+/// Queues a reply. Replies are sent by `ipc_flush()` in order, which is
+/// called when the queue becomes full or before the current task waits for a
+/// message (ipc_recv, ipc_call, and ipc_replyrecv). Note that the ool payload
+/// must be kept valid until the reply is flushed.
+void ipc_reply_deferred(task_t dst, struct message *m) {
+    struct thread_state *state = thread_state();
+    if (state->batch_len == IPC_BATCH_MAX) {
+        OOPS_OK(ipc_flush());
+    }
+
+    pre_send(dst, m);
+    struct ipc_batch_entry *entry = &state->batch[state->batch_len++];
+    entry->dst = dst;
+    entry->flags = IPC_SEND;
+    memcpy(&entry->m, m, msg_len(m->type));
+}
+
+/// Queues a notification. See `ipc_reply_deferred()`.
+void ipc_notify_deferred(task_t dst, notifications_t notifications) {
+    struct thread_state *state = thread_state();
+    if (state->batch_len == IPC_BATCH_MAX) {
+        OOPS_OK(ipc_flush());
+    }
+
+    struct ipc_batch_entry *entry = &state->batch[state->batch_len++];
+    entry->dst = dst;
+    entry->flags = IPC_NOTIFY;
+    entry->notifications = notifications;
+}
+
+/// Sends deferred replies and notifications in a single system call. A failed
+/// entry doesn't stop the rest: it returns the error of the first failed one,
+/// or OK if all of them have been sent. When it's called implicitly (e.g. in
+/// ipc_recv), errors are only reported as warnings.
+error_t ipc_flush(void) {
+    struct thread_state *state = thread_state();
+    if (!state->batch_len) {
+        return OK;
+    }
+
+    int num_entries = state->batch_len;
+    state->batch_len = 0;
+    int ret = sys_ipc_batch(state->batch, num_entries);
+    if (IS_ERROR(ret)) {
+        return ret;
+    }
+
+    for (int i = 0; i < num_entries; i++) {
+        if (state->batch[i].result != OK) {
+            return state->batch[i].result;
+        }
+    }
+
+    return OK;
+}
+
+static error_t recv(task_t src, struct message *m, unsigned flags) {
+    OOPS_OK(ipc_flush());
+    void *ool_buf = pre_recv();
+    error_t err = sys_ipc(0, src, m, IPC_RECV | flags, ool_buf);
     return post_recv(err, m);
 }
 
-error_t ipc_call(task_t dst, struct message *m) {
-    pre_recv();
+static error_t call(task_t dst, struct message *m, unsigned flags) {
+    OOPS_OK(ipc_flush());
+    void *ool_buf = pre_recv();
     pre_send(dst, m);
-    error_t err = sys_ipc(dst, dst, m, IPC_CALL);
+    error_t err = sys_ipc(dst, dst, m, IPC_CALL | flags, ool_buf);
     return post_recv(err, m);
 }
 
+/// Returns IPC_TIMEOUT flags for `timeout` in milliseconds. Timeouts are
+/// capped to 65535 ms.
+static unsigned timeout_flags(msec_t timeout) {
+    return IPC_TIMEOUT(MIN(MAX(timeout, 1), 0xffff));
+}
+
+error_t ipc_recv(task_t src, struct message *m) {
+    return recv(src, m, 0);
+}
+
+/// Receives a message only if it's already available: it returns
+/// ERR_WOULD_BLOCK if no senders are waiting.
+error_t ipc_recv_noblock(task_t src, struct message *m) {
+    return recv(src, m, IPC_NOBLOCK);
+}
+
+/// Receives a message. It returns ERR_TIMEOUT if no messages arrive in
+/// `timeout` milliseconds.
+error_t ipc_recv_timeout(task_t src, struct message *m, msec_t timeout) {
+    return recv(src, m, timeout_flags(timeout));
+}
+
+error_t ipc_call(task_t dst, struct message *m) {
+    return call(dst, m, 0);
+}
+
+/// Calls `dst` and waits for the reply. It returns ERR_TIMEOUT if the call
+/// has been blocked for `timeout` milliseconds in total. A reply sent after
+/// the timeout is not delivered.
+error_t ipc_call_timeout(task_t dst, struct message *m, msec_t timeout) {
+    return call(dst, m, timeout_flags(timeout));
+}
+
 error_t ipc_replyrecv(task_t dst, struct message *m) {
-    pre_recv();
+    OOPS_OK(ipc_flush());
+    void *ool_buf = pre_recv();
     pre_send(dst, m);
     unsigned flags = (dst < 0) ? IPC_RECV : (IPC_SEND | IPC_RECV | IPC_NOBLOCK);
-    error_t err = sys_ipc(dst, IPC_ANY, m, flags);
+    error_t err = sys_ipc(dst, IPC_ANY, m, flags, ool_buf);
     return post_recv(err, m);
 }
 
@@ -183,6 +242,29 @@ error_t ipc_serve(const char *name) {
     return call_pager(&m);
 }
 
+/// Creates a notification object which the current task waits on. It returns
+/// the object ID. When a task signals it, the current task receives a
+/// SIGNALED_MSG message with the object ID and the badges ORed since the last
+/// one.
+int notification_create(void) {
+    return sys_notification(NOTIFICATION_CREATE, 0, 0, 0);
+}
+
+error_t notification_destroy(int object) {
+    return sys_notification(NOTIFICATION_DESTROY, object, 0, 0);
+}
+
+/// Allows `task` to signal the object: `badge` is ORed into the object's word
+/// when it does so. A zero badge revokes it. Only the owner can mint badges.
+error_t notification_mint(int object, task_t task, uint32_t badge) {
+    return sys_notification(NOTIFICATION_MINT, object, task, badge);
+}
+
+/// Signals the object. It never blocks.
+error_t notification_signal(int object) {
+    return sys_notification(NOTIFICATION_SIGNAL, object, 0, 0);
+}
+
 task_t ipc_lookup(const char *name) {
     struct message m;
     m.type = LOOKUP_MSG;
@@ -9,3 +9,16 @@ error_t klog_write(const char *buf, size_t len) {
 int klog_read(char *buf, size_t len) {
     return sys_kdebug("", strlen(buf), buf, len);
 }
+
+/// Drains the kernel trace buffers (CONFIG_TRACE_BUFFER) into `buf`. It
+/// returns the number of bytes written. The first record is always
+/// TRACE_CLOCK.
+int klog_read_trace(struct trace_record *buf, size_t len) {
+    return sys_kdebug("trace", 5, (char *) buf, len);
+}
+
+/// Drains the profiler samples (CONFIG_PROFILER) into `buf`. It returns the
+/// number of bytes written.
+int klog_read_profile(struct profile_sample *buf, size_t len) {
+    return sys_kdebug("profile", 7, (char *) buf, len);
+}
@@ -1,10 +1,43 @@
+#include <resea/ipc.h>
+#include <resea/malloc.h>
+#include <resea/printf.h>
 #include <resea/syscall.h>
+#include <resea/task.h>
+#include <string.h>
+
+/// The stack size of a thread created by thread_create().
+#define THREAD_STACK_SIZE (16 * 1024)
+/// The maximum number of threads created by thread_create() alive at once.
+#define THREADS_MAX 32
+
+/// A thread created by thread_create().
+struct thread {
+    /// True if the entry is in use. Set after other fields are filled.
+    bool in_use;
+    task_t tid;
+    /// The memory block which contains the stack and `state`.
+    void *stack;
+    struct thread_state *state;
+};
+
+static struct thread_state main_thread_state;
+#ifndef CONFIG_NOMMU
+static struct thread threads[THREADS_MAX];
+static int num_threads = 0;
+#endif
 
 error_t task_create(task_t tid, const char *name, vaddr_t ip, task_t pager,
                     unsigned flags) {
     return sys_exec(tid, name, ip, pager, flags);
 }
 
+/// Creates a thread in the address space of `owner`: it starts from `ip` with
+/// the stack pointer `sp`. Only the pager of `owner` is allowed to do so.
+error_t task_create_thread(task_t tid, task_t owner, vaddr_t ip, vaddr_t sp,
+                           task_t pager, unsigned flags) {
+    return sys_exec(tid, (const char *) sp, ip, pager, flags | TASK_VM(owner));
+}
+
 error_t task_destroy(task_t task) {
     return sys_exec(task, NULL, 0, -1, 0);
 }
@@ -21,3 +54,174 @@ error_t task_map(task_t task, vaddr_t vaddr, vaddr_t src, vaddr_t kpage,
                  unsigned flags) {
     return sys_map(task, vaddr, src, kpage, flags);
 }
+
+/// Sets the scheduling priority of the task (0 to TASK_PRIO_MAX). Only its
+/// pager is allowed to do so, except that a task may lower its own priority.
+error_t task_set_priority(task_t task, unsigned prio) {
+    return sys_sched(task, SCHED_PRIORITY, prio);
+}
+
+/// Limits the CPU time of the task to `budget` milliseconds per `period`
+/// milliseconds. The time spent by servers handling its calls is also
+/// charged to the task. A zero budget removes the limit. Only its pager is
+/// allowed to do so, except that an unlimited task may limit itself.
+error_t task_set_budget(task_t task, msec_t budget, msec_t period) {
+    error_t err;
+    if ((err = sys_sched(task, SCHED_BUDGET, 0)) != OK) {
+        return err;
+    }
+
+    if (!budget) {
+        return OK;
+    }
+
+    if ((err = sys_sched(task, SCHED_PERIOD, period)) != OK) {
+        return err;
+    }
+
+    return sys_sched(task, SCHED_BUDGET, budget);
+}
+
+/// Restricts the task to run only on CPUs in the bitmap `cpus`. IRQs listened
+/// by the task are delivered to one of them. Only its pager and the task
+/// itself are allowed to do so.
+error_t task_set_affinity(task_t task, uint32_t cpus) {
+    return sys_sched(task, SCHED_AFFINITY, cpus);
+}
+
+/// Reads the performance counters of the task (0 for the current task). A
+/// monitor samples them periodically to see which task is the bottleneck.
+error_t task_get_stats(task_t task, struct task_stats *stats) {
+    return sys_task_stats(task, stats);
+}
+
+#ifndef CONFIG_NOMMU
+/// Looks for the thread running on the stack which contains `sp`.
+static struct thread *lookup_thread(uintptr_t sp) {
+    for (int i = 0; i < num_threads; i++) {
+        struct thread *thread = &threads[i];
+        if (!__atomic_load_n(&thread->in_use, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        uintptr_t stack = (uintptr_t) thread->stack;
+        if (stack <= sp && sp < stack + THREAD_STACK_SIZE) {
+            return thread;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+/// Returns the user library states of the current thread. The thread is
+/// identified by its stack pointer so that it doesn't need a system call.
+struct thread_state *thread_state(void) {
+#ifndef CONFIG_NOMMU
+    if (__atomic_load_n(&num_threads, __ATOMIC_ACQUIRE) > 0) {
+        struct thread *thread =
+            lookup_thread((uintptr_t) __builtin_frame_address(0));
+        if (thread) {
+            return thread->state;
+        }
+    }
+#endif
+
+    return &main_thread_state;
+}
+
+#ifndef CONFIG_NOMMU
+/// The entry point of threads (defined in start.S). It pops the function and
+/// its argument pushed by thread_create() from the stack and calls it.
+void __thread_start(void);
+
+/// Frees the stacks of destroyed threads. A thread may still be using its
+/// stack until the kernel destroys it: the vm server keeps a destroyed thread
+/// (and its task ID) until we reap it, whether it has exited or has been
+/// killed.
+static void reclaim_threads(void) {
+    for (int i = 0; i < num_threads; i++) {
+        struct thread *thread = &threads[i];
+        if (!thread->in_use || !thread->tid) {
+            continue;
+        }
+
+        struct message m;
+        m.type = REAP_THREAD_MSG;
+        m.reap_thread.task = thread->tid;
+        if (ipc_call(INIT_TASK, &m) == OK) {
+            __atomic_store_n(&thread->in_use, false, __ATOMIC_RELEASE);
+            free(thread->stack);
+        }
+    }
+}
+
+/// Creates a thread which runs `entry(arg)` in the current task's address
+/// space and returns its task ID. The thread exits when `entry` returns or
+/// it calls thread_exit(). Stacks of exited threads are freed in the next
+/// call.
+///
+/// Note that the user library is not yet thread-safe: threads must not
+/// allocate memory nor create threads concurrently.
+task_t thread_create(void (*entry)(void *arg), void *arg) {
+    reclaim_threads();
+
+    struct thread *thread = NULL;
+    for (int i = 0; i < THREADS_MAX; i++) {
+        if (!threads[i].in_use) {
+            thread = &threads[i];
+            break;
+        }
+    }
+
+    if (!thread) {
+        return ERR_NO_MEMORY;
+    }
+
+    void *stack = malloc(THREAD_STACK_SIZE + sizeof(struct thread_state));
+    struct thread_state *state =
+        (struct thread_state *) ((uintptr_t) stack + THREAD_STACK_SIZE);
+    memset(state, 0, sizeof(*state));
+    uintptr_t *sp = (uintptr_t *) state;
+    *--sp = (uintptr_t) arg;
+    *--sp = (uintptr_t) entry;
+
+    thread->tid = 0;
+    thread->stack = stack;
+    thread->state = state;
+    __atomic_store_n(&thread->in_use, true, __ATOMIC_RELEASE);
+    int index = thread - threads;
+    if (index >= num_threads) {
+        __atomic_store_n(&num_threads, index + 1, __ATOMIC_RELEASE);
+    }
+
+    struct message m;
+    m.type = SPAWN_THREAD_MSG;
+    m.spawn_thread.ip = (vaddr_t) __thread_start;
+    m.spawn_thread.sp = (vaddr_t) sp;
+    error_t err = ipc_call(INIT_TASK, &m);
+    if (err != OK) {
+        __atomic_store_n(&thread->in_use, false, __ATOMIC_RELEASE);
+        free(stack);
+        return err;
+    }
+
+    ASSERT(m.type == SPAWN_THREAD_REPLY_MSG);
+    thread->tid = m.spawn_thread_reply.task;
+    return thread->tid;
+}
+
+/// Exits the current thread created by thread_create(). Deferred replies are
+/// flushed before exiting.
+void thread_exit(void) {
+    OOPS_OK(ipc_flush());
+
+    struct thread *thread =
+        lookup_thread((uintptr_t) __builtin_frame_address(0));
+    if (thread) {
+        free(thread->state->ool_ptr);
+    }
+
+    task_exit();
+}
+#endif
@@ -1,8 +1,14 @@
 #include <resea/timer.h>
 #include <resea/syscall.h>
 
-// TODO: Support multiple timers.
-
+/// Sets the default timer (the timer #0). See `timer_set_id()`.
 error_t timer_set(msec_t timeout) {
-    return sys_listen(timeout, 0 /* do nothing */);
+    return timer_set_id(0, timeout);
+}
+
+/// Sets the `id`-th timer (less than CONFIG_NUM_TIMERS_PER_TASK). When it
+/// expires, the task receives NOTIFY_TIMER and the `id`-th bit is set in
+/// `m.notifications.timers`. A zero timeout cancels the timer.
+error_t timer_set_id(unsigned id, msec_t timeout) {
+    return sys_listen(timeout, 0 /* do nothing */, id, -1);
 }
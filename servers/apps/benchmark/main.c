@@ -1,6 +1,7 @@
 #include <resea/ipc.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
+#include <resea/timer.h>
 #define NUM_ITERS 128
 
 #ifdef __x86_64__
@@ -85,4 +86,20 @@ void main(void) {
     }
     print_stats("IPC round-trip (with PAGE_SIZE-sized ool)", iters, NUM_ITERS);
 
+    //
+    //  Timer wakeup latency benchmark
+    //
+    for (int i = 0; i < NUM_ITERS; i++) {
+        // It includes the 1 ms timeout itself: the difference between min and
+        // max shows the jitter of wakeups (up to a tick with the periodic
+        // timer).
+        cycles_t start = cycle_counter();
+        ASSERT_OK(timer_set(1 /* in milliseconds */));
+        struct message m;
+        ASSERT_OK(ipc_recv(IPC_ANY, &m));
+        iters[i] = cycle_counter() - start;
+        ASSERT(m.type == NOTIFICATIONS_MSG);
+        ASSERT((m.notifications.data & NOTIFY_TIMER) != 0);
+    }
+    print_stats("timer wakeup (1 ms)", iters, NUM_ITERS);
 }
@@ -3,6 +3,7 @@
 #include <resea/printf.h>
 #include <resea/klog.h>
 #include <resea/async.h>
+#include <resea/syscall.h>
 #include <string.h>
 
 static task_t boot_task_server = 1;
@@ -140,6 +141,8 @@ static void help_command(__unused int argc, __unused char **argv) {
     logputstr("echo   -  Print strings.\n");
     logputstr("clear  -  Clear the screen.\n");
     logputstr("log    -  Read the kernel log.\n");
+    logputstr("trace  -  Dump kernel trace records into the serial port.\n");
+    logputstr("profile - Start/stop the profiler or dump samples.\n");
 }
 
 static void log_command(__unused int argc, __unused char **argv) {
@@ -156,6 +159,85 @@ static void log_command(__unused int argc, __unused char **argv) {
     }
 }
 
+/// Prints a binary record in hex into the kernel log as a line "`prefix`:
+/// <hex>". Host tools pick such lines from the serial output.
+static void print_hex(const char *prefix, const void *data, size_t len) {
+    static const char *digits = "0123456789abcdef";
+    char hex[128 + 1];
+    const uint8_t *p = data;
+    len = MIN(len, (sizeof(hex) - 1) / 2);
+    for (size_t i = 0; i < len; i++) {
+        hex[i * 2] = digits[p[i] >> 4];
+        hex[i * 2 + 1] = digits[p[i] & 0xf];
+    }
+
+    hex[len * 2] = '\0';
+    printf("%s: %s\n", prefix, hex);
+}
+
+/// Prints trace records in hex into the kernel log. Feed the log into
+/// tools/trace2json.py to visualize them.
+static void trace_command(__unused int argc, __unused char **argv) {
+    while (true) {
+        struct trace_record records[16];
+        int len = klog_read_trace(records, sizeof(records));
+        if (len < 0) {
+            logputstr("trace: ");
+            logputstr(err2str(len));
+            logputc('\n');
+            return;
+        }
+
+        for (size_t i = 0; i < (size_t) len / sizeof(*records); i++) {
+            print_hex("trace", &records[i], sizeof(*records));
+        }
+
+        if (len <= (int) sizeof(*records)) {
+            // Only a TRACE_CLOCK record: no more records.
+            break;
+        }
+    }
+}
+
+/// Controls the sampling profiler. `profile dump` prints samples in hex into
+/// the kernel log. Feed the log into tools/profile2folded.py to symbolize
+/// them.
+static void profile_command(int argc, char **argv) {
+    if (argc < 2) {
+        logputstr("usage: profile start|stop|dump\n");
+        return;
+    }
+
+    if (!strcmp(argv[1], "start") || !strcmp(argv[1], "stop")) {
+        char cmd[16];
+        snprintf(cmd, sizeof(cmd), "profile %s", argv[1]);
+        error_t err = sys_kdebug(cmd, strlen(cmd), NULL, 0);
+        if (err < 0) {
+            logputstr("profile: ");
+            logputstr(err2str(err));
+            logputc('\n');
+        }
+        return;
+    }
+
+    if (strcmp(argv[1], "dump") != 0) {
+        logputstr("usage: profile start|stop|dump\n");
+        return;
+    }
+
+    while (true) {
+        struct profile_sample samples[16];
+        int len = klog_read_profile(samples, sizeof(samples));
+        if (len <= 0) {
+            break;
+        }
+
+        for (size_t i = 0; i < (size_t) len / sizeof(*samples); i++) {
+            print_hex("profile", &samples[i], sizeof(*samples));
+        }
+    }
+}
+
 struct command {
     const char *name;
     void (*run)(int argc, char **argv);
@@ -165,6 +247,8 @@ static struct command commands[] = {
     { .name = "echo", .run = echo_command },
     { .name = "clear", .run = clear_command },
     { .name = "log", .run = log_command },
+    { .name = "trace", .run = trace_command },
+    { .name = "profile", .run = profile_command },
     { .name = "help", .run = help_command },
     { .name = NULL, .run = NULL },
 };
@@ -326,6 +410,10 @@ void main(void) {
                     }
                 }
                 break;
+            case KBD_ON_KEY_UP_MSG:
+                // Sent by async_send() and queued in the kernel.
+                input(m.kbd_on_key_up.keycode);
+                break;
             default:
                 WARN("unknown message type (type=%d)", m.type);
         }
@@ -1,8 +1,82 @@
 #include <resea/printf.h>
+#include <resea/io.h>
 #include <resea/ipc.h>
+#include <resea/syscall.h>
+#include <resea/task.h>
 #include <string.h>
 #include "test.h"
 
+static int thread_value = 0;
+
+static void thread_main(void *arg) {
+    // Threads share the address space.
+    thread_value = 123;
+
+    struct message m;
+    m.type = NOP_MSG;
+    m.nop.value = thread_value;
+    ipc_send((task_t) (uintptr_t) arg, &m);
+}
+
+/// A server which runs at a lower priority than its client.
+static void prio_server_main(void *arg) {
+    task_t client = (task_t) (uintptr_t) arg;
+    struct message m;
+
+    // Threads inherit the priority of the owner.
+    task_set_priority(task_self(), 0);
+
+    // Reply the priority seen while handling the call.
+    struct task_stats stats;
+    ipc_recv(client, &m);
+    task_get_stats(0, &stats);
+    m.type = NOP_REPLY_MSG;
+    m.nop_reply.value = stats.prio;
+    ipc_reply(client, &m);
+
+    // Hold calls without replying until the client sends -1.
+    do {
+        ipc_recv(client, &m);
+    } while (m.type != NOP_MSG || m.nop.value != -1);
+}
+
+static int batch_reply_value = 0;
+
+/// Calls the server and sends back the reply.
+static void batch_client_main(void *arg) {
+    task_t server = (task_t) (uintptr_t) arg;
+    struct message m;
+    m.type = NOP_MSG;
+    m.nop.value = 5;
+    if (ipc_call(server, &m) == OK && m.type == NOP_REPLY_MSG) {
+        batch_reply_value = m.nop_reply.value;
+    }
+
+    m.type = NOP_MSG;
+    m.nop.value = 0;
+    ipc_send(server, &m);
+}
+
+static volatile bool spin_stop = false;
+static volatile uint64_t spin_counts[2];
+static error_t budget_errs[3];
+
+/// Spins on CPU #0 until `spin_stop` is set. The spinner #0 limits its own CPU
+/// time.
+static void spinner_main(void *arg) {
+    int index = (int) (uintptr_t) arg;
+    task_set_affinity(task_self(), 1 << 0);
+    if (index == 0) {
+        budget_errs[0] = task_set_budget(task_self(), 20, 10);
+        budget_errs[1] = task_set_budget(task_self(), 10, 1000);
+        budget_errs[2] = sys_sched(task_self(), SCHED_BUDGET, 0);
+    }
+
+    while (!spin_stop) {
+        spin_counts[index]++;
+    }
+}
+
 void ipc_test(void) {
     struct message m;
     int err;
@@ -43,4 +117,229 @@ void ipc_test(void) {
     err = ipc_call(INIT_TASK, &m);
     TEST_ASSERT(err == OK);
     TEST_ASSERT(m.type == NOP_WITH_OOL_REPLY_MSG);
+
+    // A non-blocking receive and a receive with a timeout.
+    err = ipc_recv_noblock(INIT_TASK, &m);
+    TEST_ASSERT(err == ERR_WOULD_BLOCK);
+    err = ipc_recv_timeout(INIT_TASK, &m, 10);
+    TEST_ASSERT(err == ERR_TIMEOUT);
+
+    // A page grant (shared with myself).
+    static char grant_buf[PAGE_SIZE] __aligned(PAGE_SIZE) = {'a', 'b', 'c'};
+    vaddr_t granted;
+    err = io_grant_pages(task_self(), grant_buf, 1, GRANT_READONLY, &granted);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(!memcmp((void *) granted, "abc", 3));
+    grant_buf[0] = 'x';
+    TEST_ASSERT(*((char *) granted) == 'x');
+
+    // A read-only page can't be granted again as writable, neither shared nor
+    // moved, but can be as read-only.
+    vaddr_t regranted;
+    err = io_grant_pages(task_self(), (void *) granted, 1, 0, &regranted);
+    TEST_ASSERT(err == ERR_NOT_PERMITTED);
+    err = io_grant_pages(task_self(), (void *) granted, 1, GRANT_MOVE,
+                         &regranted);
+    TEST_ASSERT(err == ERR_NOT_PERMITTED);
+    err = io_grant_pages(task_self(), (void *) granted, 1, GRANT_READONLY,
+                         &regranted);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(*((char *) regranted) == 'x');
+    err = io_release_pages((void *) regranted, 1);
+    TEST_ASSERT(err == OK);
+    err = io_release_pages((void *) granted, 1);
+    TEST_ASSERT(err == OK);
+
+    // A shared page is freed only after both sides have released it: the
+    // granted page must survive the release of the original one, whose
+    // address is refilled with the initial data by the next page fault.
+    err = io_grant_pages(task_self(), grant_buf, 1, 0, &granted);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(*((char *) granted) == 'x');
+    err = io_release_pages(grant_buf, 1);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(grant_buf[0] == 'a');
+    TEST_ASSERT(*((char *) granted) == 'x');
+    err = io_release_pages((void *) granted, 1);
+    TEST_ASSERT(err == OK);
+
+    // A moved page is unmapped from the sender.
+    static char move_buf[PAGE_SIZE] __aligned(PAGE_SIZE) = {'d', 'e', 'f'};
+    move_buf[0] = 'y';
+    err = io_grant_pages(task_self(), move_buf, 1, GRANT_MOVE, &granted);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(*((char *) granted) == 'y');
+    TEST_ASSERT(move_buf[0] == 'd');
+    *((char *) granted) = 'z';
+    TEST_ASSERT(move_buf[0] == 'd');
+    err = io_release_pages((void *) granted, 1);
+    TEST_ASSERT(err == OK);
+
+    // Too many pages.
+    err = io_grant_pages(task_self(), grant_buf, 0x100000, 0, &granted);
+    TEST_ASSERT(err == ERR_INVALID_ARG);
+
+    // IRQs and MSIs not owned by the task.
+    TEST_ASSERT(irq_release(1) == ERR_NOT_PERMITTED);
+    TEST_ASSERT(msi_free(0) == ERR_NOT_FOUND);
+
+    // A thread.
+    task_t thread = thread_create(thread_main, (void *) (uintptr_t) task_self());
+    TEST_ASSERT(thread > 0);
+    err = ipc_recv(thread, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == NOP_MSG);
+    TEST_ASSERT(m.nop.value == 123);
+    TEST_ASSERT(thread_value == 123);
+
+    // Only the owner's threads can be reaped.
+    m.type = REAP_THREAD_MSG;
+    m.reap_thread.task = task_self();
+    TEST_ASSERT(ipc_call(INIT_TASK, &m) == ERR_INVALID_TASK);
+
+    // Priority inheritance: a server runs at the priority of its client until
+    // it replies or the client times out.
+    struct task_stats stats;
+    err = task_get_stats(0, &stats);
+    TEST_ASSERT(err == OK);
+    unsigned prio = stats.prio;
+    TEST_ASSERT(prio > 0);
+    task_t server =
+        thread_create(prio_server_main, (void *) (uintptr_t) task_self());
+    TEST_ASSERT(server > 0);
+    // A living thread can't be reaped.
+    m.type = REAP_THREAD_MSG;
+    m.reap_thread.task = server;
+    TEST_ASSERT(ipc_call(INIT_TASK, &m) == ERR_IN_USE);
+    m.type = NOP_MSG;
+    m.nop.value = 0;
+    err = ipc_call(server, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == NOP_REPLY_MSG);
+    TEST_ASSERT(m.nop_reply.value == (int) prio);
+    err = task_get_stats(server, &stats);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(stats.prio == 0);
+    m.type = NOP_MSG;
+    m.nop.value = 0;
+    err = ipc_call_timeout(server, &m, 50);
+    TEST_ASSERT(err == ERR_TIMEOUT);
+    err = task_get_stats(server, &stats);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(stats.prio == 0);
+    m.type = NOP_MSG;
+    m.nop.value = -1;
+    err = ipc_send(server, &m);
+    TEST_ASSERT(err == OK);
+
+    // Scheduling contexts: a task which has run out of its budget yields the
+    // CPU to others until the next period.
+    task_t limited = thread_create(spinner_main, (void *) 0);
+    TEST_ASSERT(limited > 0);
+    task_t unlimited = thread_create(spinner_main, (void *) 1);
+    TEST_ASSERT(unlimited > 0);
+    err = task_get_stats(unlimited, &stats);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(stats.prio == prio);
+    err = task_set_budget(limited, 10, 100);
+    TEST_ASSERT(err == ERR_NOT_PERMITTED);
+    err = ipc_recv_timeout(INIT_TASK, &m, 300);
+    TEST_ASSERT(err == ERR_TIMEOUT);
+    TEST_ASSERT(budget_errs[0] == ERR_INVALID_ARG);
+    TEST_ASSERT(budget_errs[1] == OK);
+    TEST_ASSERT(budget_errs[2] == ERR_NOT_PERMITTED);
+    TEST_ASSERT(spin_counts[0] > 0);
+    TEST_ASSERT(spin_counts[1] > spin_counts[0] * 4);
+    spin_stop = true;
+
+    // CPU affinity: a pinned task runs only on the given CPU. CPU #1 may not
+    // be available.
+    TEST_ASSERT(task_set_affinity(task_self(), 0) == ERR_INVALID_ARG);
+    TEST_ASSERT(task_set_affinity(INIT_TASK, 1 << 0) == ERR_NOT_PERMITTED);
+    for (int cpu = 0; cpu < 2; cpu++) {
+        err = task_set_affinity(task_self(), 1 << cpu);
+        if (cpu > 0 && err == ERR_INVALID_ARG) {
+            break;
+        }
+
+        TEST_ASSERT(err == OK);
+        // Move to the CPU in the next context switch.
+        err = ipc_recv_timeout(INIT_TASK, &m, 10);
+        TEST_ASSERT(err == ERR_TIMEOUT);
+        err = task_get_stats(0, &stats);
+        TEST_ASSERT(err == OK);
+        TEST_ASSERT(stats.cpu == cpu);
+    }
+    err = task_set_affinity(task_self(), 0xffffffff);
+    TEST_ASSERT(err == OK);
+
+    // Batched IPC: deferred replies and notifications are sent in a single
+    // system call by ipc_flush().
+    task_t client =
+        thread_create(batch_client_main, (void *) (uintptr_t) task_self());
+    TEST_ASSERT(client > 0);
+    err = ipc_recv(client, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == NOP_MSG);
+    struct message r;
+    r.type = NOP_REPLY_MSG;
+    r.nop_reply.value = m.nop.value * 7;
+    ipc_reply_deferred(client, &r);
+    ipc_notify_deferred(task_self(), NOTIFY_ASYNC);
+    TEST_ASSERT(ipc_flush() == OK);
+    err = ipc_recv(IPC_ANY, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == NOTIFICATIONS_MSG);
+    TEST_ASSERT(m.notifications.data & NOTIFY_ASYNC);
+    err = ipc_recv(client, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(batch_reply_value == 35);
+
+    // Each entry in a batch has its own result.
+    struct ipc_batch_entry entries[2];
+    entries[0].dst = task_self();
+    entries[0].flags = IPC_NOTIFY;
+    entries[0].notifications = NOTIFY_ASYNC;
+    entries[1].dst = task_self();
+    entries[1].flags = IPC_RECV;
+    TEST_ASSERT(sys_ipc_batch(entries, 2) == 2);
+    TEST_ASSERT(entries[0].result == OK);
+    TEST_ASSERT(entries[1].result == ERR_INVALID_ARG);
+    TEST_ASSERT(sys_ipc_batch(entries, IPC_BATCH_MAX + 1) == ERR_INVALID_ARG);
+    err = ipc_recv(IPC_ANY, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == NOTIFICATIONS_MSG);
+
+    // ipc_flush() reports a failed entry and still sends the following ones.
+    ipc_notify_deferred(-1, NOTIFY_ASYNC);
+    ipc_notify_deferred(task_self(), NOTIFY_ASYNC);
+    TEST_ASSERT(ipc_flush() == ERR_INVALID_TASK);
+    TEST_ASSERT(ipc_flush() == OK);
+    err = ipc_recv(IPC_ANY, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == NOTIFICATIONS_MSG);
+    TEST_ASSERT(m.notifications.data & NOTIFY_ASYNC);
+
+    // A notification object.
+    int object = notification_create();
+    TEST_ASSERT(object > 0);
+    TEST_ASSERT(notification_signal(object) == ERR_NOT_PERMITTED);
+    err = notification_mint(object, task_self(), 0x5);
+    TEST_ASSERT(err == OK);
+    err = notification_signal(object);
+    TEST_ASSERT(err == OK);
+    err = ipc_recv(IPC_ANY, &m);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(m.type == SIGNALED_MSG);
+    TEST_ASSERT(m.signaled.object == object);
+    TEST_ASSERT(m.signaled.badges == 0x5);
+    err = notification_destroy(object);
+    TEST_ASSERT(err == OK);
+
+    // Performance counters.
+    err = task_get_stats(0, &stats);
+    TEST_ASSERT(err == OK);
+    TEST_ASSERT(stats.ipc_sent > 0);
+    TEST_ASSERT(stats.ipc_received > 0);
+    TEST_ASSERT(task_get_stats(-1, &stats) == ERR_INVALID_TASK);
 }
@@ -107,6 +107,47 @@ malformed:
     ipc_call(tcpip_server, &m);
 }
 
+/// Handles an event sent from the tcpip server by `async_send()`.
+static void handle_tcpip_event(struct message *m) {
+    switch (m->type) {
+        case TCPIP_RECEIVED_MSG: {
+            struct client *c =
+                map_get(clients, (void *) m->tcpip_received.handle);
+            ASSERT(c);
+
+            m->type = TCPIP_READ_MSG;
+            m->tcpip_read.handle = c->handle;
+            m->tcpip_read.len = 4096;
+            ASSERT_OK(ipc_call(tcpip_server, m));
+            uint8_t *buf = (uint8_t *) m->tcpip_read_reply.data;
+            size_t len = m->tcpip_read_reply.data_len;
+            if (buf) {
+                process(c, buf, len);
+                free(buf);
+            }
+            break;
+        }
+        case TCPIP_NEW_CLIENT_MSG: {
+            m->type = TCPIP_ACCEPT_MSG;
+            m->tcpip_accept.handle = m->tcpip_new_client.handle;
+            ASSERT_OK(ipc_call(tcpip_server, m));
+            handle_t new_handle = m->tcpip_accept_reply.new_handle;
+
+            struct client *client = malloc(sizeof(*client));
+            client->handle = new_handle;
+            client->request = NULL;
+            client->request_len = 0;
+            client->done = false;
+            map_set(clients, (void *) new_handle, client);
+            break;
+        }
+        case TCPIP_CLOSED_MSG: {
+            map_remove(clients, (void *) m->tcpip_closed.handle);
+            break;
+        }
+    }
+}
+
 void main(void) {
     TRACE("starting...");
     tcpip_server = ipc_lookup("tcpip");
@@ -123,49 +164,17 @@ void main(void) {
         ASSERT_OK(err);
 
         switch (m.type) {
-            case NOTIFICATIONS_MSG: {
+            case NOTIFICATIONS_MSG:
                 if (m.notifications.data & NOTIFY_ASYNC) {
                     ASSERT_OK(async_recv(tcpip_server, &m));
-                    switch (m.type) {
-                        case TCPIP_RECEIVED_MSG: {
-                            struct client *c =
-                                map_get(clients, (void *) m.tcpip_received.handle);
-                            ASSERT(c);
-
-                            m.type = TCPIP_READ_MSG;
-                            m.tcpip_read.handle = c->handle;
-                            m.tcpip_read.len = 4096;
-                            ASSERT_OK(ipc_call(tcpip_server, &m));
-                            uint8_t *buf = (uint8_t *) m.tcpip_read_reply.data;
-                            size_t len = m.tcpip_read_reply.data_len;
-                            if (buf) {
-                                process(c, buf, len);
-                                free(buf);
-                            }
-                            break;
-                        }
-                        case TCPIP_NEW_CLIENT_MSG: {
-                            m.type = TCPIP_ACCEPT_MSG;
-                            m.tcpip_accept.handle = m.tcpip_new_client.handle;
-                            ASSERT_OK(ipc_call(tcpip_server, &m));
-                            handle_t new_handle = m.tcpip_accept_reply.new_handle;
-
-                            struct client *client = malloc(sizeof(*client));
-                            client->handle = new_handle;
-                            client->request = NULL;
-                            client->request_len = 0;
-                            client->done = false;
-                            map_set(clients, (void *) new_handle, client);
-                            break;
-                        }
-                        case TCPIP_CLOSED_MSG: {
-                            map_remove(clients, (void *) m.tcpip_closed.handle);
-                            break;
-                        }
-                    }
+                    handle_tcpip_event(&m);
                 }
                 break;
-            };
+            case TCPIP_RECEIVED_MSG:
+            case TCPIP_NEW_CLIENT_MSG:
+            case TCPIP_CLOSED_MSG:
+                handle_tcpip_event(&m);
+                break;
             default:
                 WARN("unknown message type (type=%d)", m.type);
         }
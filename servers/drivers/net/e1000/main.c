@@ -39,9 +39,15 @@ void main(void) {
     INFO("found a e1000 device (bus=%d, slot=%d, bar0=%x, irq=%d)", pcidev.bus,
          pcidev.slot, pcidev.bar0, pcidev.irq);
 
-    // Initialize the device and listen for IRQ messages.
-    err = irq_acquire(pcidev.irq);
-    ASSERT_OK(err);
+    // Initialize the device and listen for IRQ messages. Prefer MSI to the
+    // legacy interrupt routed through the IOAPIC.
+    err = pci_enable_msi(&pcidev, 0, -1);
+    if (err == OK) {
+        INFO("using MSI");
+    } else {
+        err = irq_acquire(pcidev.irq);
+        ASSERT_OK(err);
+    }
     pci_enable_bus_master(&pcidev);
     e1000_init(&pcidev);
 
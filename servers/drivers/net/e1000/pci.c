@@ -1,4 +1,5 @@
 #include <resea/io.h>
+#include <resea/ipc.h>
 #include <resea/printf.h>
 #include "pci.h"
 
@@ -27,11 +28,134 @@ static void write32(uint8_t bus, uint8_t slot, uint16_t offset,
     io_out32(PCI_IOPORT_DATA, value);
 }
 
+static void write16(uint8_t bus, uint8_t slot, uint16_t offset,
+                    uint16_t value) {
+    unsigned shift = (offset & 0x03) * 8;
+    uint32_t value32 = read32(bus, slot, offset & 0xfffc);
+    value32 = (value32 & ~(0xffff << shift)) | (value << shift);
+    write32(bus, slot, offset & 0xfffc, value32);
+}
+
 void pci_enable_bus_master(struct pci_device *dev) {
-    uint32_t value = read32(dev->bus, dev->slot, PCI_CONFIG_COMMAND) | (1 << 2);
+    uint32_t value = read32(dev->bus, dev->slot, PCI_CONFIG_COMMAND)
+                     | PCI_COMMAND_BUS_MASTER;
     write32(dev->bus, dev->slot, PCI_CONFIG_COMMAND, value);
 }
 
+/// Disables the legacy (INTx) interrupt: the device signals interrupts only
+/// through MSI/MSI-X.
+static void disable_intx(struct pci_device *dev) {
+    uint16_t value = read16(dev->bus, dev->slot, PCI_CONFIG_COMMAND)
+                     | PCI_COMMAND_INTX_DISABLE;
+    write16(dev->bus, dev->slot, PCI_CONFIG_COMMAND, value);
+}
+
+/// Returns the offset of the capability in the configuration space, or 0 if
+/// the device doesn't have it.
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id) {
+    if (!(read16(dev->bus, dev->slot, PCI_CONFIG_STATUS)
+          & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+
+    uint8_t offset = read8(dev->bus, dev->slot, PCI_CONFIG_CAP_PTR) & 0xfc;
+    // Follow the list with a limit in case it's broken.
+    for (int i = 0; offset && i < 48; i++) {
+        if (read8(dev->bus, dev->slot, offset) == id) {
+            return offset;
+        }
+
+        offset = read8(dev->bus, dev->slot, offset + 1) & 0xfc;
+    }
+
+    return 0;
+}
+
+/// Enables MSI with a single message. When the device raises an interrupt,
+/// the current task receives NOTIFY_IRQ and the `index`-th bit is set in
+/// `m.notifications.irqs` (see msi_alloc()). It returns ERR_UNAVAILABLE if
+/// the device doesn't support MSI.
+error_t pci_enable_msi(struct pci_device *dev, unsigned index, int cpu) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSI);
+    if (!cap) {
+        return ERR_UNAVAILABLE;
+    }
+
+    struct msi_message msg;
+    error_t err = msi_alloc(index, cpu, &msg);
+    if (err != OK) {
+        return err;
+    }
+
+    uint16_t control = read16(dev->bus, dev->slot, cap + PCI_MSI_CONTROL);
+    write32(dev->bus, dev->slot, cap + PCI_MSI_ADDR_LO, msg.addr & 0xffffffff);
+    if (control & PCI_MSI_CONTROL_64BIT) {
+        write32(dev->bus, dev->slot, cap + PCI_MSI_ADDR_HI, msg.addr >> 32);
+        write16(dev->bus, dev->slot, cap + PCI_MSI_DATA_64, msg.data);
+    } else {
+        write16(dev->bus, dev->slot, cap + PCI_MSI_DATA_32, msg.data);
+    }
+
+    // Use a single message (Multiple Message Enable = 0).
+    control = (control & ~(0x7 << 4)) | PCI_MSI_CONTROL_ENABLE;
+    write16(dev->bus, dev->slot, cap + PCI_MSI_CONTROL, control);
+    disable_intx(dev);
+    return OK;
+}
+
+/// Locates the MSI-X table: it's at `offset` in the memory space of the
+/// `bar`-th BAR. The driver maps it and passes it to pci_enable_msix(). It
+/// returns ERR_UNAVAILABLE if the device doesn't support MSI-X.
+error_t pci_msix_table(struct pci_device *dev, unsigned *bar, uint32_t *offset,
+                       unsigned *num_entries) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSIX);
+    if (!cap) {
+        return ERR_UNAVAILABLE;
+    }
+
+    uint16_t control = read16(dev->bus, dev->slot, cap + PCI_MSIX_CONTROL);
+    uint32_t table = read32(dev->bus, dev->slot, cap + PCI_MSIX_TABLE);
+    *bar = PCI_MSIX_TABLE_BIR(table);
+    *offset = PCI_MSIX_TABLE_OFFSET(table);
+    *num_entries = PCI_MSIX_CONTROL_SIZE(control);
+    return OK;
+}
+
+/// Enables MSI-X and programs the `entry`-th entry of the (mapped) MSI-X
+/// `table`. Each entry is delivered as a separate notification bit `index`
+/// (see msi_alloc()): e.g., one per queue of a multiqueue NIC.
+error_t pci_enable_msix(struct pci_device *dev, volatile void *table,
+                        unsigned entry, unsigned index, int cpu) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSIX);
+    if (!cap) {
+        return ERR_UNAVAILABLE;
+    }
+
+    uint16_t control = read16(dev->bus, dev->slot, cap + PCI_MSIX_CONTROL);
+    if (entry >= PCI_MSIX_CONTROL_SIZE(control)) {
+        return ERR_INVALID_ARG;
+    }
+
+    struct msi_message msg;
+    error_t err = msi_alloc(index, cpu, &msg);
+    if (err != OK) {
+        return err;
+    }
+
+    volatile uint32_t *e = (volatile uint32_t *)
+        ((uintptr_t) table + entry * PCI_MSIX_ENTRY_SIZE);
+    e[PCI_MSIX_ENTRY_CONTROL / 4] |= PCI_MSIX_ENTRY_MASKED;
+    e[PCI_MSIX_ENTRY_ADDR_LO / 4] = msg.addr & 0xffffffff;
+    e[PCI_MSIX_ENTRY_ADDR_HI / 4] = msg.addr >> 32;
+    e[PCI_MSIX_ENTRY_DATA / 4] = msg.data;
+    e[PCI_MSIX_ENTRY_CONTROL / 4] &= ~PCI_MSIX_ENTRY_MASKED;
+
+    write16(dev->bus, dev->slot, cap + PCI_MSIX_CONTROL,
+            control | PCI_MSIX_CONTROL_ENABLE);
+    disable_intx(dev);
+    return OK;
+}
+
 bool pci_find_device(struct pci_device *dev, uint16_t vendor, uint16_t device) {
     for (int bus = 0; bus <= 255; bus++) {
         for (int slot = 0; slot < 32; slot++) {
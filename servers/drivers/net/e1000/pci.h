@@ -10,9 +10,42 @@
 #define PCI_CONFIG_VENDOR_ID 0x00
 #define PCI_CONFIG_DEVICE_ID 0x02
 #define PCI_CONFIG_COMMAND   0x04
+#define PCI_CONFIG_STATUS    0x06
 #define PCI_CONFIG_BAR0      0x10
+#define PCI_CONFIG_CAP_PTR   0x34
 #define PCI_CONFIG_INTR_LINE 0x3c
 
+#define PCI_COMMAND_BUS_MASTER    (1 << 2)
+#define PCI_COMMAND_INTX_DISABLE  (1 << 10)
+#define PCI_STATUS_CAP_LIST       (1 << 4)
+
+// Capability IDs.
+#define PCI_CAP_MSI  0x05
+#define PCI_CAP_MSIX 0x11
+
+// The MSI capability.
+#define PCI_MSI_CONTROL         0x02
+#define PCI_MSI_ADDR_LO         0x04
+#define PCI_MSI_ADDR_HI         0x08
+#define PCI_MSI_DATA_32         0x08
+#define PCI_MSI_DATA_64         0x0c
+#define PCI_MSI_CONTROL_ENABLE  (1 << 0)
+#define PCI_MSI_CONTROL_64BIT   (1 << 7)
+
+// The MSI-X capability and table entries.
+#define PCI_MSIX_CONTROL        0x02
+#define PCI_MSIX_TABLE          0x04
+#define PCI_MSIX_CONTROL_ENABLE (1 << 15)
+#define PCI_MSIX_CONTROL_SIZE(control) (((control) & 0x7ff) + 1)
+#define PCI_MSIX_TABLE_BIR(table)      ((table) & 0x7)
+#define PCI_MSIX_TABLE_OFFSET(table)   ((table) & ~0x7)
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_ENTRY_ADDR_LO  0x00
+#define PCI_MSIX_ENTRY_ADDR_HI  0x04
+#define PCI_MSIX_ENTRY_DATA     0x08
+#define PCI_MSIX_ENTRY_CONTROL  0x0c
+#define PCI_MSIX_ENTRY_MASKED   (1 << 0)
+
 struct pci_device {
     uint8_t bus;
     uint8_t slot;
@@ -24,5 +57,11 @@ struct pci_device {
 
 void pci_enable_bus_master(struct pci_device *dev);
 bool pci_find_device(struct pci_device *dev, uint16_t vendor, uint16_t device);
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id);
+error_t pci_enable_msi(struct pci_device *dev, unsigned index, int cpu);
+error_t pci_msix_table(struct pci_device *dev, unsigned *bar, uint32_t *offset,
+                       unsigned *num_entries);
+error_t pci_enable_msix(struct pci_device *dev, volatile void *table,
+                        unsigned entry, unsigned index, int cpu);
 
 #endif
@@ -11,6 +11,7 @@
 
 // FIXME:
 void on_new_data(void);
+void on_key_up(struct message *m);
 struct proc *blocked_proc = NULL;
 
 void main(void) {
@@ -41,6 +42,9 @@ void main(void) {
                     on_new_data();
                 }
                 break;
+            case KBD_ON_KEY_UP_MSG:
+                on_key_up(&m);
+                break;
             case ABI_HOOK_MSG: {
                 task_t task = m.abi_hook.task;
                 struct proc *proc = proc_lookup_by_task(task);
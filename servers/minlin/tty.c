@@ -42,18 +42,23 @@ static void putc(char ch) {
     update_cursor();
 }
 
-void on_new_data(void) {
-    struct message m;
-    error_t err = async_recv(kbd_server, &m);
-    ASSERT_OK(err);
-    ASSERT(m.type == KBD_ON_KEY_UP_MSG);
+/// Handles a KBD_ON_KEY_UP_MSG from the keyboard driver.
+void on_key_up(struct message *m) {
+    ASSERT(m->type == KBD_ON_KEY_UP_MSG);
 
-    char ch = m.kbd_on_key_up.keycode;
+    char ch = m->kbd_on_key_up.keycode;
     queue[wp++ % QUEUE_LEN] = ch;
     putc(ch);
     waitqueue_wake_all(&tty_inode->read_wq);
 }
 
+void on_new_data(void) {
+    struct message m;
+    error_t err = async_recv(kbd_server, &m);
+    ASSERT_OK(err);
+    on_key_up(&m);
+}
+
 static ssize_t read(struct file *file, uint8_t *buf, size_t len) {
     if (rp == wp) {
         return -EAGAIN;
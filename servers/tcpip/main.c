@@ -219,7 +219,7 @@ void main(void) {
 
                 m.type = TCPIP_ACCEPT_REPLY_MSG;
                 m.tcpip_accept_reply.new_handle = new_sock->client->handle;
-                ipc_reply(m.src, &m);
+                ipc_reply_deferred(m.src, &m);
                 break;
             }
             case TCPIP_READ_MSG: {
@@ -253,7 +253,7 @@ void main(void) {
             case TCPIP_REGISTER_DEVICE_MSG:
                 register_device(m.src, &m.tcpip_register_device.macaddr);
                 m.type = TCPIP_REGISTER_DEVICE_REPLY_MSG;
-                ipc_reply(m.src, &m);
+                ipc_reply_deferred(m.src, &m);
                 break;
             case NET_RX_MSG: {
                 struct driver *driver = get_driver_by_tid(m.src);
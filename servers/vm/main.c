@@ -1,4 +1,5 @@
 #include <list.h>
+#include <resea/io.h>
 #include <resea/ipc.h>
 #include <resea/malloc.h>
 #include <resea/printf.h>
@@ -19,9 +20,14 @@ struct page_area {
     vaddr_t vaddr;
     paddr_t paddr;
     size_t num_pages;
+    /// If it's true, the pages are mapped without MAP_W and cannot be granted
+    /// as writable (see grant_pages()).
+    bool readonly;
 };
 
 #define SERVICE_NAME_LEN 32
+/// The maximum number of pages granted at once.
+#define GRANT_PAGES_MAX 1024
 
 /// Task Control Block (TCB).
 struct task {
@@ -34,15 +40,13 @@ struct task {
     struct elf64_phdr *phdrs;
     vaddr_t free_vaddr;
     list_t page_areas;
-    vaddr_t ool_buf;
-    size_t ool_len;
-    task_t received_ool_from;
-    vaddr_t received_ool_buf;
-    size_t received_ool_len;
-    list_t ool_sender_queue;
-    list_elem_t ool_sender_next;
-    struct message ool_sender_m;
     char waiting_for[SERVICE_NAME_LEN];
+    /// The task owning the address space if it's a thread, or NULL. Threads
+    /// have no page areas: they use the owner's ones.
+    struct task *owner;
+    /// True if the thread has been destroyed but the owner has not yet reaped
+    /// it by REAP_THREAD_MSG. Its task ID is not reused until then.
+    bool zombie;
 };
 
 struct service {
@@ -69,6 +73,22 @@ static struct task *get_task_by_tid(task_t tid) {
     return task;
 }
 
+/// Returns the task which owns the address space of `task`.
+static struct task *vm_owner(struct task *task) {
+    return task->owner ? task->owner : task;
+}
+
+/// Looks for an unused task struct.
+static struct task *alloc_task(void) {
+    for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+        if (!tasks[i].in_use) {
+            return &tasks[i];
+        }
+    }
+
+    return NULL;
+}
+
 static void read_file(struct bootfs_file *file, offset_t off, void *buf, size_t len) {
     void *p =
         (void *) (((uintptr_t) __bootfs) + file->offset + off);
@@ -88,30 +108,55 @@ static void init_task_struct(struct task *task, const char *name,
     }
 
     task->free_vaddr = (vaddr_t) __free_vaddr;
-    task->ool_buf = 0;
-    task->ool_len = 0;
-    task->received_ool_buf = 0;
-    task->received_ool_len = 0;
-    task->received_ool_from = 0;
-    list_init(&task->ool_sender_queue);
-    list_nullify(&task->ool_sender_next);
     strncpy(task->name, name, sizeof(task->name));
     strncpy(task->waiting_for, "", sizeof(task->waiting_for));
     list_init(&task->page_areas);
+    task->owner = NULL;
+    task->zombie = false;
 }
 
-static task_t launch_task(struct bootfs_file *file) {
-    TRACE("launching %s...", file->name);
+/// Returns the value for the server in a list of "<server>:<value>" pairs
+/// such as CONFIG_AUTOSTART_AFFINITY, or -1 if it's not listed.
+static int autostart_param(const char *list, const char *name) {
+    const char *p = list;
+    size_t name_len = strlen(name);
+    while (*p != '\0') {
+        while (*p == ' ') {
+            p++;
+        }
 
-    // Look for an unused task ID.
-    struct task *task = NULL;
-    for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
-        if (!tasks[i].in_use) {
-            task = &tasks[i];
-            break;
+        bool match = !strncmp(p, name, name_len) && p[name_len] == ':';
+        while (*p != '\0' && *p != ':' && *p != ' ') {
+            p++;
+        }
+
+        int value = -1;
+        if (*p == ':') {
+            p++;
+            value = 0;
+            while (*p >= '0' && *p <= '9') {
+                value = value * 10 + (*p - '0');
+                p++;
+            }
+        }
+
+        if (match) {
+            return value;
+        }
+
+        while (*p != '\0' && *p != ' ') {
+            p++;
         }
     }
 
+    return -1;
+}
+
+static task_t launch_task(struct bootfs_file *file) {
+    TRACE("launching %s...", file->name);
+
+    // Look for an unused task ID.
+    struct task *task = alloc_task();
     if (!task) {
         PANIC("too many tasks");
     }
@@ -127,14 +172,56 @@ static task_t launch_task(struct bootfs_file *file) {
     }
 
     // Create a new task for the server.
-    error_t err =
-        task_create(task->tid, file->name, ehdr->e_entry, task_self(), TASK_IO);
+    unsigned flags = TASK_IO;
+    int prio = autostart_param(CONFIG_AUTOSTART_PRIORITY, file->name);
+    if (prio > TASK_PRIO_MAX) {
+        WARN("%s: invalid priority %d, ignoring", file->name, prio);
+    } else if (prio >= 0) {
+        flags |= TASK_PRIO(prio);
+    }
+
+    error_t err;
+    int cpu = autostart_param(CONFIG_AUTOSTART_AFFINITY, file->name);
+    if (cpu >= 0) {
+        err = task_create(task->tid, file->name, ehdr->e_entry, task_self(),
+                          flags | TASK_CPU(cpu));
+        if (err == ERR_INVALID_ARG) {
+            WARN("%s: CPU #%d is not available, ignoring the affinity",
+                 file->name, cpu);
+            cpu = -1;
+        }
+    }
+
+    if (cpu < 0) {
+        err = task_create(task->tid, file->name, ehdr->e_entry, task_self(),
+                          flags);
+    }
     ASSERT_OK(err);
 
     init_task_struct(task, file->name, file, file_header, ehdr);
     return task->tid;
 }
 
+/// Creates a thread in the address space of `owner`. The kernel lets it
+/// inherit the owner's priority and CPU affinity. Once destroyed, it remains as
+/// a zombie until the owner reaps it.
+static task_t spawn_thread(struct task *owner, vaddr_t ip, vaddr_t sp) {
+    struct task *thread = alloc_task();
+    if (!thread) {
+        return ERR_NO_MEMORY;
+    }
+
+    error_t err = task_create_thread(thread->tid, owner->tid, ip, sp,
+                                     task_self(), TASK_IO);
+    if (err != OK) {
+        return err;
+    }
+
+    init_task_struct(thread, owner->name, NULL, NULL, NULL);
+    thread->owner = owner;
+    return thread->tid;
+}
+
 static error_t map_page(task_t tid, vaddr_t vaddr, paddr_t paddr,
                         unsigned flags, bool overwrite) {
     flags |= overwrite ? (MAP_DELETE | MAP_UPDATE) : MAP_UPDATE;
@@ -150,6 +237,32 @@ static error_t map_page(task_t tid, vaddr_t vaddr, paddr_t paddr,
     }
 }
 
+/// Returns the page area containing `vaddr`. It returns NULL if the page is
+/// not yet allocated.
+static struct page_area *lookup_area(struct task *task, vaddr_t vaddr) {
+    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
+        if (area->vaddr <= vaddr
+            && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
+            return area;
+        }
+    }
+
+    return NULL;
+}
+
+/// Returns the physical address of the page at `vaddr` in the task's page
+/// areas. It returns 0 if the page is not yet allocated.
+static paddr_t lookup_page(struct task *task, vaddr_t vaddr) {
+    struct page_area *area = lookup_area(task, vaddr);
+    return area ? area->paddr + (vaddr - area->vaddr) : 0;
+}
+
+/// Returns true if the page at `vaddr` has been granted as read-only.
+static bool is_readonly_page(struct task *task, vaddr_t vaddr) {
+    struct page_area *area = lookup_area(task, vaddr);
+    return area && area->readonly;
+}
+
 static paddr_t pager(struct task *task, vaddr_t vaddr, unsigned fault) {
     vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
 
@@ -161,11 +274,15 @@ static paddr_t pager(struct task *task, vaddr_t vaddr, unsigned fault) {
         return 0;
     }
 
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->vaddr <= vaddr
-            && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
-            return area->paddr + (vaddr - area->vaddr);
-        }
+    if ((fault & EXP_PF_WRITE) && is_readonly_page(task, vaddr)) {
+        WARN("%s: tried to write into a read-only page at %p", task->name,
+             vaddr);
+        return 0;
+    }
+
+    paddr_t paddr = lookup_page(task, vaddr);
+    if (paddr) {
+        return paddr;
     }
 
     // Zeroed pages.
@@ -211,22 +328,51 @@ static paddr_t pager(struct task *task, vaddr_t vaddr, unsigned fault) {
 }
 
 static void kill(struct task *task) {
+    // Threads must be destroyed before the task owning the address space. The
+    // owner won't reap them anymore.
+    if (!task->owner) {
+        for (int i = 0; i < CONFIG_NUM_TASKS; i++) {
+            if (tasks[i].in_use && tasks[i].owner == task) {
+                kill(&tasks[i]);
+                tasks[i].in_use = false;
+            }
+        }
+    }
+
+    if (task->zombie) {
+        // Already destroyed.
+        return;
+    }
+
     task_destroy(task->tid);
-    task->in_use = false;
+    if (task->owner) {
+        // Keep the thread until the owner reaps it: the owner frees the
+        // thread's stack only after it has been destroyed.
+        task->zombie = true;
+    } else {
+        task->in_use = false;
+    }
+
     if (task->file_header) {
         free(task->file_header);
     }
+
+    // Release the physical pages owned by the task.
+    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
+        list_remove(&area->next);
+        pages_decref(area->paddr, area->num_pages);
+        free(area);
+    }
 }
 
 /// Allocates a virtual address space by so-called the bump pointer allocation
-/// algorithm.
-static vaddr_t alloc_virt_pages(struct task *task, size_t num_pages) {
+/// algorithm. It returns 0 if the task's virtual memory space has been
+/// exhausted.
+static vaddr_t try_alloc_virt_pages(struct task *task, size_t num_pages) {
     vaddr_t vaddr = task->free_vaddr;
     size_t size = num_pages * PAGE_SIZE;
-
-    if (vaddr + size >= (vaddr_t) __free_vaddr_end) {
-        // Task's virtual memory space has been exhausted.
-        kill(task);
+    if (num_pages > ((vaddr_t) __free_vaddr_end - vaddr) / PAGE_SIZE
+        || vaddr + size >= (vaddr_t) __free_vaddr_end) {
         return 0;
     }
 
@@ -234,11 +380,23 @@ static vaddr_t alloc_virt_pages(struct task *task, size_t num_pages) {
     return vaddr;
 }
 
+/// Same as try_alloc_virt_pages() but kills the task if its virtual memory
+/// space has been exhausted. Use it only for the task's own requests.
+static vaddr_t alloc_virt_pages(struct task *task, size_t num_pages) {
+    vaddr_t vaddr = try_alloc_virt_pages(task, num_pages);
+    if (!vaddr) {
+        kill(task);
+    }
+
+    return vaddr;
+}
+
 static paddr_t alloc_pages(struct task *task, vaddr_t vaddr, size_t num_pages) {
     struct page_area *area = malloc(sizeof(*area));
     area->vaddr = vaddr;
     area->paddr = pages_alloc(num_pages);
     area->num_pages = num_pages;
+    area->readonly = false;
     list_push_back(&task->page_areas, &area->next);
     return area->paddr;
 }
@@ -251,7 +409,7 @@ static error_t phy_alloc_pages(struct task *task, vaddr_t *vaddr, paddr_t *paddr
 
     *vaddr = alloc_virt_pages(task, num_pages);
     if (*paddr) {
-        pages_incref(paddr2pfn(*paddr), num_pages);
+        pages_incref(*paddr, num_pages);
     } else {
         *paddr = pages_alloc(num_pages);
     }
@@ -260,187 +418,125 @@ static error_t phy_alloc_pages(struct task *task, vaddr_t *vaddr, paddr_t *paddr
     area->vaddr = *vaddr;
     area->paddr = *paddr;
     area->num_pages = num_pages;
+    area->readonly = false;
     list_push_back(&task->page_areas, &area->next);
     return OK;
 }
 
-static paddr_t vaddr2paddr(struct task *task, vaddr_t vaddr) {
+/// Removes the page at `vaddr` from the task's page areas and returns its
+/// physical address. It returns 0 if the page is not yet allocated.
+static paddr_t remove_page(struct task *task, vaddr_t vaddr) {
     LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
         if (area->vaddr <= vaddr
             && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
-            return area->paddr + (vaddr - area->vaddr);
-        }
-    }
-
-    // The page is not mapped. Try filling it with pager.
-    return pager(task, vaddr, EXP_PF_USER | EXP_PF_WRITE /* FIXME: strip PF_WRITE */);
-}
-
-static error_t handle_ool_send(struct message *m);
-
-static error_t handle_ool_recv(struct message *m) {
-    struct task *task = get_task_by_tid(m->src);
-    ASSERT(task);
-
-//    TRACE("accept: %s: %p %d (old=%p)",
-//        task->name, m->ool_recv.addr, m->ool_recv.len, task->ool_buf);
-    if (task->ool_buf) {
-        return ERR_ALREADY_EXISTS;
-    }
+            size_t index = (vaddr - area->vaddr) / PAGE_SIZE;
+            paddr_t paddr = area->paddr + index * PAGE_SIZE;
+
+            // Split the area: pages after `vaddr` go to a new area.
+            if (index + 1 < area->num_pages) {
+                struct page_area *tail = malloc(sizeof(*tail));
+                tail->vaddr = vaddr + PAGE_SIZE;
+                tail->paddr = paddr + PAGE_SIZE;
+                tail->num_pages = area->num_pages - index - 1;
+                tail->readonly = area->readonly;
+                list_push_back(&task->page_areas, &tail->next);
+            }
 
-    task->ool_buf = m->ool_recv.addr;
-    task->ool_len = m->ool_recv.len;
+            area->num_pages = index;
+            if (!area->num_pages) {
+                list_remove(&area->next);
+                free(area);
+            }
 
-    struct task *sender = LIST_POP_FRONT(&task->ool_sender_queue, struct task,
-                                         ool_sender_next);
-    if (sender) {
-        struct message m;
-        memcpy(&m, &sender->ool_sender_m, sizeof(m));
-//        TRACE("%s -> %s: src = %d / %d", task->name, sender->name,
-//              sender->ool_sender_m.src, m.src);
-        error_t err = handle_ool_send(&m);
-        switch (err) {
-            case OK:
-                ipc_reply(sender->tid, &m);
-                break;
-            case DONT_REPLY:
-                // Do nothing.
-                break;
-            default:
-                OOPS_OK(err);
-                ipc_reply_err(sender->tid, err);
+            return paddr;
         }
     }
 
-    m->type = OOL_RECV_REPLY_MSG;
-    return OK;
+    return 0;
 }
 
-static error_t handle_ool_verify(struct message *m) {
-    struct task *task = get_task_by_tid(m->src);
-    ASSERT(task);
-
-//    TRACE("verify: %s: id=%p len=%d (src=%d)", task->name,
-//          m->ool_verify.id, m->ool_verify.len, m->src);
-    if (m->ool_verify.src != task->received_ool_from
-        || m->ool_verify.id != task->received_ool_buf
-        || m->ool_verify.len != task->received_ool_len) {
+/// Maps the sender's pages into `dst`'s address space without copying them.
+/// If GRANT_MOVE is set, the pages are unmapped from `src` and the ownership
+/// is transferred to `dst`. Otherwise, the pages are shared between them. If
+/// GRANT_READONLY is set, `dst` cannot write into the pages. A grant never
+/// widens the permission: read-only pages can only be granted as read-only.
+static error_t grant_pages(struct task *src, struct task *dst, vaddr_t vaddr,
+                           size_t num_pages, unsigned flags,
+                           vaddr_t *granted) {
+    if (!IS_ALIGNED(vaddr, PAGE_SIZE) || !num_pages
+        || num_pages > GRANT_PAGES_MAX) {
         return ERR_INVALID_ARG;
     }
 
-    m->type = OOL_VERIFY_REPLY_MSG;
-    m->ool_verify_reply.received_at = task->received_ool_buf;
-
-    task->received_ool_buf = 0;
-    task->received_ool_len = 0;
-    task->received_ool_from = 0;
-    return OK;
-}
-
-uint8_t __src_page[PAGE_SIZE] __aligned(PAGE_SIZE);
-uint8_t __dst_page[PAGE_SIZE] __aligned(PAGE_SIZE);
-
-static error_t handle_ool_send(struct message *m) {
-    struct task *src_task = get_task_by_tid(m->src);
-    ASSERT(src_task);
+    // Make sure that all pages are available before modifying the address
+    // spaces. Pages not yet accessed by the sender are filled here.
+    for (size_t i = 0; i < num_pages; i++) {
+        vaddr_t page = vaddr + i * PAGE_SIZE;
+        if (!pager(src, page, EXP_PF_USER)) {
+            return ERR_NOT_FOUND;
+        }
 
-    struct task *dst_task = get_task_by_tid(m->ool_send.dst);
-    if (!dst_task) {
-        return ERR_NOT_FOUND;
+        if (!(flags & GRANT_READONLY) && is_readonly_page(src, page)) {
+            return ERR_NOT_PERMITTED;
+        }
     }
 
-//    TRACE("do_copy: %s -> %s: %p -> %p, len=%d",
-//        src_task->name, dst_task->name,
-//        m->ool_send.addr, dst_task->ool_buf,
-//        m->ool_send.len);
-    if (!dst_task->ool_buf) {
-        memcpy(&src_task->ool_sender_m, m, sizeof(*m));
-        list_push_back(&dst_task->ool_sender_queue, &src_task->ool_sender_next);
-        return DONT_REPLY;
+    // Moved pages are removed from the sender's page areas: check that all of
+    // them are there before modifying either address space.
+    if (flags & GRANT_MOVE) {
+        for (size_t i = 0; i < num_pages; i++) {
+            if (!lookup_page(src, vaddr + i * PAGE_SIZE)) {
+                return ERR_NOT_FOUND;
+            }
+        }
     }
 
-    size_t len = m->ool_send.len;
-    vaddr_t src_buf = m->ool_send.addr;
-    vaddr_t dst_buf = dst_task->ool_buf;
-    DEBUG_ASSERT(len <= dst_task->ool_len);
+    // Don't kill `dst` even if its address space is exhausted: the grant is
+    // not its own request.
+    vaddr_t dst_vaddr = try_alloc_virt_pages(dst, num_pages);
+    if (!dst_vaddr) {
+        return ERR_NO_MEMORY;
+    }
 
-    size_t remaining = len;
-    while (remaining > 0) {
-        offset_t src_off = src_buf % PAGE_SIZE;
-        offset_t dst_off = dst_buf % PAGE_SIZE;
-        size_t copy_len = MIN(remaining, MIN(PAGE_SIZE - src_off, PAGE_SIZE - dst_off));
+    for (size_t i = 0; i < num_pages; i++) {
+        vaddr_t src_page = vaddr + i * PAGE_SIZE;
+        vaddr_t dst_page = dst_vaddr + i * PAGE_SIZE;
 
-        void *src_ptr;
-        if (src_task->tid == INIT_TASK) {
-            src_ptr = (void *) src_buf;
+        paddr_t paddr;
+        if (flags & GRANT_MOVE) {
+            paddr = remove_page(src, src_page);
+            ASSERT_OK(task_map(src->tid, src_page, 0, 0, MAP_DELETE));
         } else {
-            paddr_t src_paddr = vaddr2paddr(src_task, ALIGN_DOWN(src_buf, PAGE_SIZE));
-            if (!src_paddr) {
-                kill(src_task);
-                return DONT_REPLY;
-            }
-
-            ASSERT_OK(map_page(INIT_TASK, (vaddr_t) __src_page, src_paddr,
-                               MAP_W, true));
-            src_ptr = &__src_page[src_off];
+            paddr = pager(src, src_page, EXP_PF_USER);
+            pages_incref(paddr, 1);
         }
 
-        void *dst_ptr;
-        if (dst_task->tid == INIT_TASK) {
-            dst_ptr = (void *) dst_buf;
-        } else {
-            paddr_t dst_paddr = vaddr2paddr(dst_task, ALIGN_DOWN(dst_buf, PAGE_SIZE));
-            if (!dst_paddr) {
-                kill(dst_task);
-                return ERR_UNAVAILABLE;
-            }
-
-            // Temporarily map the pages into the our address space.
-            ASSERT_OK(map_page(INIT_TASK, (vaddr_t) __dst_page, dst_paddr,
-                               MAP_W, true));
-            dst_ptr = &__dst_page[dst_off];
-        }
+        ASSERT(paddr);
+        struct page_area *area = malloc(sizeof(*area));
+        area->vaddr = dst_page;
+        area->paddr = paddr;
+        area->num_pages = 1;
+        area->readonly = (flags & GRANT_READONLY) != 0;
+        list_push_back(&dst->page_areas, &area->next);
 
-        // Copy between the tasks.
-        memcpy(dst_ptr, src_ptr, copy_len);
-        remaining -= copy_len;
-        dst_buf += copy_len;
-        src_buf += copy_len;
+        unsigned map_flags = (flags & GRANT_READONLY) ? 0 : MAP_W;
+        ASSERT_OK(map_page(dst->tid, dst_page, paddr, map_flags, false));
     }
 
-    dst_task->received_ool_buf = dst_task->ool_buf;
-    dst_task->received_ool_len = m->ool_send.len;
-    dst_task->received_ool_from = src_task->tid;
-    dst_task->ool_buf = 0;
-    dst_task->ool_len = 0;
-
-    m->type = OOL_SEND_REPLY_MSG;
-    m->ool_send_reply.id = dst_task->received_ool_buf;
+    *granted = dst_vaddr;
     return OK;
 }
 
-error_t call_self(struct message *m) {
-    m->src = INIT_TASK;
-    error_t err;
-    switch (m->type) {
-        case OOL_RECV_MSG:
-            err = handle_ool_recv(m);
-            break;
-        case OOL_VERIFY_MSG:
-            err = handle_ool_verify(m);
-            break;
-        case OOL_SEND_MSG:
-            err = handle_ool_send(m);
-            break;
-        default:
-            UNREACHABLE();
-    }
-
-    if (err != OK) {
-        PANIC("call_self failed (%s)", err2str(err));
+/// Unmaps the pages and releases the ownership of them.
+static void release_pages(struct task *task, vaddr_t vaddr, size_t num_pages) {
+    for (size_t i = 0; i < num_pages; i++) {
+        vaddr_t page = vaddr + i * PAGE_SIZE;
+        paddr_t paddr = remove_page(task, page);
+        if (paddr) {
+            ASSERT_OK(task_map(task->tid, page, 0, 0, MAP_DELETE));
+            pages_decref(paddr, 1);
+        }
     }
-
-    return err;
 }
 
 static void handle_message(const struct message *m) {
@@ -448,48 +544,6 @@ static void handle_message(const struct message *m) {
     bzero(&r, sizeof(r));
 
     switch (m->type) {
-        case OOL_RECV_MSG: {
-            memcpy(&r, m, sizeof(r));
-            error_t err = handle_ool_recv(&r);
-            switch (err) {
-                case DONT_REPLY:
-                    break;
-                case OK:
-                    ipc_reply(m->src, &r);
-                    break;
-                default:
-                    ipc_reply_err(m->src, err);
-            }
-            break;
-        }
-        case OOL_VERIFY_MSG: {
-            memcpy(&r, m, sizeof(r));
-            error_t err = handle_ool_verify(&r);
-            switch (err) {
-                case DONT_REPLY:
-                    break;
-                case OK:
-                    ipc_reply(m->src, &r);
-                    break;
-                default:
-                    ipc_reply_err(m->src, err);
-            }
-            break;
-        }
-        case OOL_SEND_MSG: {
-            memcpy(&r, m, sizeof(r));
-            error_t err = handle_ool_send(&r);
-            switch (err) {
-                case DONT_REPLY:
-                    break;
-                case OK:
-                    ipc_reply(m->src, &r);
-                    break;
-                default:
-                    ipc_reply_err(m->src, err);
-            }
-            break;
-        }
         case NOP_MSG:
             r.type = NOP_REPLY_MSG;
             r.nop_reply.value = m->nop.value * 7;
@@ -535,14 +589,17 @@ static void handle_message(const struct message *m) {
             ASSERT(m->page_fault.task == task->tid);
 
             paddr_t paddr =
-                pager(task, m->page_fault.vaddr, m->page_fault.fault);
+                pager(vm_owner(task), m->page_fault.vaddr, m->page_fault.fault);
             if (!paddr) {
                 ipc_reply_err(m->src, ERR_NOT_FOUND);
                 break;
             }
 
             vaddr_t aligned_vaddr = ALIGN_DOWN(m->page_fault.vaddr, PAGE_SIZE);
-            ASSERT_OK(map_page(task->tid, aligned_vaddr, paddr, MAP_W, false));
+            unsigned map_flags =
+                is_readonly_page(vm_owner(task), aligned_vaddr) ? 0 : MAP_W;
+            ASSERT_OK(map_page(task->tid, aligned_vaddr, paddr, map_flags,
+                               false));
             r.type = PAGE_FAULT_REPLY_MSG;
 
             ipc_reply(task->tid, &r);
@@ -605,7 +662,7 @@ static void handle_message(const struct message *m) {
             break;
         }
         case ALLOC_PAGES_MSG: {
-            struct task *task = get_task_by_tid(m->src);
+            struct task *task = vm_owner(get_task_by_tid(m->src));
             ASSERT(task);
 
             vaddr_t vaddr;
@@ -623,6 +680,89 @@ static void handle_message(const struct message *m) {
             ipc_reply(m->src, &r);
             break;
         }
+        case GRANT_PAGES_MSG: {
+            struct task *src = vm_owner(get_task_by_tid(m->src));
+            ASSERT(src);
+
+            task_t dst_tid = m->grant_pages.dst;
+            if (dst_tid <= 0 || dst_tid > CONFIG_NUM_TASKS
+                || dst_tid == INIT_TASK || !tasks[dst_tid - 1].in_use
+                || tasks[dst_tid - 1].zombie) {
+                ipc_reply_err(m->src, ERR_INVALID_TASK);
+                break;
+            }
+
+            vaddr_t granted;
+            error_t err =
+                grant_pages(src, vm_owner(&tasks[dst_tid - 1]),
+                            m->grant_pages.vaddr, m->grant_pages.num_pages,
+                            m->grant_pages.flags, &granted);
+            if (err != OK) {
+                ipc_reply_err(m->src, err);
+                break;
+            }
+
+            r.type = GRANT_PAGES_REPLY_MSG;
+            r.grant_pages_reply.vaddr = granted;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case RELEASE_PAGES_MSG: {
+            struct task *task = vm_owner(get_task_by_tid(m->src));
+            ASSERT(task);
+
+            if (!IS_ALIGNED(m->release_pages.vaddr, PAGE_SIZE)) {
+                ipc_reply_err(m->src, ERR_INVALID_ARG);
+                break;
+            }
+
+            release_pages(task, m->release_pages.vaddr,
+                          m->release_pages.num_pages);
+            r.type = RELEASE_PAGES_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case SPAWN_THREAD_MSG: {
+            struct task *owner = vm_owner(get_task_by_tid(m->src));
+            if (owner->tid == INIT_TASK) {
+                // We don't have a pager.
+                ipc_reply_err(m->src, ERR_NOT_PERMITTED);
+                break;
+            }
+
+            task_t tid =
+                spawn_thread(owner, m->spawn_thread.ip, m->spawn_thread.sp);
+            if (IS_ERROR(tid)) {
+                ipc_reply_err(m->src, tid);
+                break;
+            }
+
+            r.type = SPAWN_THREAD_REPLY_MSG;
+            r.spawn_thread_reply.task = tid;
+            ipc_reply(m->src, &r);
+            break;
+        }
+        case REAP_THREAD_MSG: {
+            struct task *owner = vm_owner(get_task_by_tid(m->src));
+            task_t tid = m->reap_thread.task;
+            if (tid <= 0 || tid > CONFIG_NUM_TASKS || !tasks[tid - 1].in_use
+                || tasks[tid - 1].owner != owner) {
+                ipc_reply_err(m->src, ERR_INVALID_TASK);
+                break;
+            }
+
+            struct task *thread = &tasks[tid - 1];
+            if (!thread->zombie) {
+                // The thread is still alive.
+                ipc_reply_err(m->src, ERR_IN_USE);
+                break;
+            }
+
+            thread->in_use = false;
+            r.type = REAP_THREAD_REPLY_MSG;
+            ipc_reply(m->src, &r);
+            break;
+        }
         case LAUNCH_TASK_MSG: {
             // Look for the program in the apps directory.
             char *name = (char *) m->launch_task.name;
@@ -12,15 +12,44 @@ bool is_mappable_paddr(paddr_t paddr) {
     return IS_ALIGNED(paddr, PAGE_SIZE) && (is_user_pages || is_mmio_pages);
 }
 
+/// Returns whether the physical page is managed by the page allocator.
+/// MMIO pages are not tracked.
+static bool is_managed_paddr(paddr_t paddr) {
+    return paddr >= PAGES_BASE_ADDR;
+}
+
 pfn_t paddr2pfn(paddr_t paddr) {
-    ASSERT(is_mappable_paddr(paddr));
-    return paddr / PAGE_SIZE;
+    ASSERT(is_mappable_paddr(paddr) && is_managed_paddr(paddr));
+    return (paddr - PAGES_BASE_ADDR) / PAGE_SIZE;
+}
+
+static void incref(pfn_t pfn, size_t num_pages) {
+    ASSERT(pfn + num_pages <= PAGES_MAX);
+    for (size_t i = 0; i < num_pages; i++) {
+        pages[pfn + i].ref_count++;
+    }
+}
+
+/// Increments the reference counters of the physical pages: the pages are
+/// mapped into another task (or a task has acquired them).
+void pages_incref(paddr_t paddr, size_t num_pages) {
+    if (is_managed_paddr(paddr)) {
+        incref(paddr2pfn(paddr), num_pages);
+    }
 }
 
-void pages_incref(pfn_t pfn, size_t num_pages) {
+/// Decrements the reference counters of the physical pages. A page is freed
+/// once no tasks own the page.
+void pages_decref(paddr_t paddr, size_t num_pages) {
+    if (!is_managed_paddr(paddr)) {
+        return;
+    }
+
+    pfn_t pfn = paddr2pfn(paddr);
     ASSERT(pfn + num_pages <= PAGES_MAX);
     for (size_t i = 0; i < num_pages; i++) {
-        pages[pfn + i].ref_count = 1;
+        ASSERT(pages[pfn + i].ref_count > 0);
+        pages[pfn + i].ref_count--;
     }
 }
 
@@ -40,7 +69,7 @@ paddr_t pages_alloc(size_t num_pages) {
 
         if (j == num_pages) {
             // Found sufficiently large free physical pages.
-            pages_incref(i, num_pages);
+            incref(i, num_pages);
             paddr_t paddr = PAGES_BASE_ADDR + i * PAGE_SIZE;
             return paddr;
         }
@@ -13,7 +13,8 @@ struct page {
 
 bool is_mappable_paddr(paddr_t paddr);
 pfn_t paddr2pfn(paddr_t paddr);
-void pages_incref(pfn_t pfn, size_t num_pages);
+void pages_incref(paddr_t paddr, size_t num_pages);
+void pages_decref(paddr_t paddr, size_t num_pages);
 paddr_t pages_alloc(size_t num_pages);
 void pages_init(void);
 
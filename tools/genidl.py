@@ -366,6 +366,15 @@ struct {{ msg | msg_name }}_reply_fields {{ "{" }}
 {%- endfor %}
 
 #define IDL_MSGID_MAX {{ msgid_max }}
+#define IDL_MSGID2LEN \\
+    {{ "{" }} \\
+    {% for m in msgs %} \\
+        [{{ m.args_id }}] = sizeof(struct {{ m | msg_name }}_fields), \\
+        {%- if not m.oneway %}
+        [{{ m.rets_id }}] = sizeof(struct {{ m | msg_name }}_reply_fields), \\
+        {%- endif %}
+    {% endfor %} \\
+    {{ "}" }}
 #define IDL_MSGID2STR \\
     (const char *[]){{ "{" }} \\
     {% for m in msgs %} \\
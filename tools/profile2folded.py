@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+    Symbolizes profiler samples (CONFIG_PROFILER) and prints them as folded
+    stacks, the input format of flamegraph.pl and speedscope:
+
+        tcpip;tcp_process 42
+        tcpip;ipc_recv;[kernel] ipc_slowpath 3
+        (idle);[kernel] arch_idle 1000
+
+    The input is a kernel log which contains "profile: <hex>" lines printed by
+    the shell's "profile dump" command, or raw samples with --binary. Symbols
+    are read from the symbol files generated by nm2symbols.py in the build
+    directory: <task name>.symbols for user samples and resea.symbols for
+    kernel samples.
+"""
+import argparse
+import bisect
+import os
+import re
+import struct
+import sys
+from collections import Counter
+
+# struct profile_sample in libs/common/include/message.h.
+SAMPLE = struct.Struct("<QQiI16s")
+assert SAMPLE.size == 40
+
+class SymbolTable:
+    def __init__(self, path):
+        self.addrs = []
+        self.names = []
+        if not os.path.exists(path):
+            return
+
+        symbols = {}
+        for line in open(path).read().strip().split("\n"):
+            cols = line.split(" ", 1)
+            if len(cols) == 2:
+                symbols[int(cols[0], 16)] = cols[1].strip()
+
+        for addr, name in sorted(symbols.items()):
+            self.addrs.append(addr)
+            self.names.append(name)
+
+    def resolve(self, addr):
+        i = bisect.bisect_right(self.addrs, addr) - 1
+        if i < 0:
+            return hex(addr)
+        return self.names[i]
+
+def parse_log(f):
+    for line in f:
+        m = re.search(r"profile: ([0-9a-f]{80})", line)
+        if m:
+            yield SAMPLE.unpack(bytes.fromhex(m.group(1)))
+
+def parse_binary(f):
+    data = f.read()
+    for offset in range(0, len(data) - SAMPLE.size + 1, SAMPLE.size):
+        yield SAMPLE.unpack_from(data, offset)
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Converts profiler samples into folded stacks.")
+    parser.add_argument("input", help="The kernel log (or raw samples with --binary).")
+    parser.add_argument("--binary", action="store_true",
+        help="The input is raw samples.")
+    parser.add_argument("--build-dir", default="build",
+        help="The directory which contains *.symbols files.")
+    parser.add_argument("--kernel", default="resea",
+        help="The name of the kernel symbol file.")
+    parser.add_argument("--per-cpu", action="store_true",
+        help="Put the CPU at the root of stacks.")
+    args = parser.parse_args()
+
+    if args.binary:
+        with open(args.input, "rb") as f:
+            samples = list(parse_binary(f))
+    else:
+        with open(args.input, errors="ignore") as f:
+            samples = list(parse_log(f))
+
+    if not samples:
+        sys.exit("no samples found")
+
+    tables = {}
+    def symbols(name):
+        if name not in tables:
+            path = os.path.join(args.build_dir, name + ".symbols")
+            tables[name] = SymbolTable(path)
+        return tables[name]
+
+    stacks = Counter()
+    for user_ip, kernel_ip, task, cpu, name in samples:
+        name = name.rstrip(b"\0").decode("ascii", errors="replace")
+        if not name:
+            name = f"#{task}"
+
+        # A kernel sample is put on top of the user frame which has entered
+        # the kernel, if any.
+        stack = [name]
+        if user_ip:
+            stack.append(symbols(name).resolve(user_ip))
+        if kernel_ip:
+            stack.append("[kernel] " + symbols(args.kernel).resolve(kernel_ip))
+
+        if args.per_cpu:
+            stack.insert(0, f"CPU {cpu}")
+        stacks[";".join(stack)] += 1
+
+    for stack, count in sorted(stacks.items()):
+        print(f"{stack} {count}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""
+    Converts kernel trace records (CONFIG_TRACE_BUFFER) into the Chrome Trace
+    Event Format, which can be opened in chrome://tracing or Perfetto UI.
+
+    The input is a kernel log which contains "trace: <hex>" lines printed by
+    the shell's trace command, or raw records with --binary.
+"""
+import argparse
+import json
+import re
+import struct
+import sys
+
+# struct trace_record in libs/common/include/message.h.
+RECORD = struct.Struct("<QHHiQQ")
+assert RECORD.size == 32
+
+TRACE_IPC_SEND = 1
+TRACE_IPC_RECV = 2
+TRACE_SWITCH = 3
+TRACE_IRQ = 4
+TRACE_PAGE_FAULT = 5
+TRACE_NOTIFY = 6
+TRACE_TIMER = 7
+TRACE_LOST = 8
+TRACE_CLOCK = 9
+
+def parse_log(f):
+    for line in f:
+        m = re.search(r"trace: ([0-9a-f]{64})", line)
+        if m:
+            yield RECORD.unpack(bytes.fromhex(m.group(1)))
+
+def parse_binary(f):
+    data = f.read()
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        yield RECORD.unpack_from(data, offset)
+
+def task_name(names, tid):
+    return names.get(tid, f"#{tid}")
+
+def convert(records, names):
+    cycles_per_ms = None
+    for cycles, type_, cpu, task, arg0, arg1 in records:
+        if type_ == TRACE_CLOCK and arg0 > 0:
+            cycles_per_ms = arg0
+    if not cycles_per_ms:
+        sys.exit("no TRACE_CLOCK records found")
+
+    # Records are ordered by CPU, not by time.
+    records = sorted((r for r in records if r[1] != TRACE_CLOCK),
+                     key=lambda r: r[0])
+    if not records:
+        return []
+
+    base = records[0][0]
+    def ts(cycles):
+        return (cycles - base) * 1000 / cycles_per_ms
+
+    events = []
+    cpus = set()
+    running = {} # cpu -> (task, ts)
+    sends = {} # (src, dst, type) -> flow ID
+    flow_id = 0
+
+    def instant(cpu, name, t, args):
+        events.append({
+            "name": name, "ph": "i", "s": "t", "ts": t,
+            "pid": 0, "tid": cpu, "args": args,
+        })
+
+    for cycles, type_, cpu, task, arg0, arg1 in records:
+        t = ts(cycles)
+        cpus.add(cpu)
+        if type_ == TRACE_SWITCH:
+            if cpu in running:
+                prev, start = running[cpu]
+                events.append({
+                    "name": task_name(names, prev), "ph": "X", "ts": start,
+                    "dur": t - start, "pid": 0, "tid": cpu,
+                })
+            running[cpu] = (task, t)
+        elif type_ == TRACE_IPC_SEND:
+            name = f"send: {task_name(names, task)} -> {task_name(names, arg0)}"
+            instant(cpu, name, t, {"type": arg1})
+            flow_id += 1
+            sends[(task, arg0, arg1)] = flow_id
+            events.append({
+                "name": "ipc", "cat": "ipc", "ph": "s", "id": flow_id,
+                "ts": t, "pid": 0, "tid": cpu,
+            })
+        elif type_ == TRACE_IPC_RECV:
+            name = f"recv: {task_name(names, task)} <- {task_name(names, arg0)}"
+            instant(cpu, name, t, {"type": arg1})
+            id_ = sends.pop((arg0, task, arg1), None)
+            if id_ is not None:
+                events.append({
+                    "name": "ipc", "cat": "ipc", "ph": "f", "bp": "e",
+                    "id": id_, "ts": t, "pid": 0, "tid": cpu,
+                })
+        elif type_ == TRACE_IRQ:
+            instant(cpu, f"irq {arg0}", t, {"task": task})
+        elif type_ == TRACE_PAGE_FAULT:
+            instant(cpu, f"page fault: {task_name(names, task)}", t,
+                    {"addr": hex(arg0), "ip": hex(arg1)})
+        elif type_ == TRACE_NOTIFY:
+            instant(cpu, f"notify: {task_name(names, task)}", t,
+                    {"notifications": hex(arg0)})
+        elif type_ == TRACE_TIMER:
+            instant(cpu, f"timer: {task_name(names, task)}", t,
+                    {"index": arg0})
+        elif type_ == TRACE_LOST:
+            instant(cpu, "lost records", t, {"count": arg0})
+
+    for cpu in sorted(cpus):
+        events.append({
+            "name": "thread_name", "ph": "M", "pid": 0, "tid": cpu,
+            "args": {"name": f"CPU {cpu}"},
+        })
+
+    return events
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Converts kernel trace records into a Chrome/Perfetto timeline.")
+    parser.add_argument("input", help="The kernel log (or raw records with --binary).")
+    parser.add_argument("--binary", action="store_true",
+        help="The input is raw trace records.")
+    parser.add_argument("--name", action="append", default=[],
+        metavar="TID=NAME", help="The name of a task.")
+    parser.add_argument("-o", dest="output", default="trace.json",
+        help="The output file.")
+    args = parser.parse_args()
+
+    names = {}
+    for name in args.name:
+        tid, name = name.split("=", 1)
+        names[int(tid)] = name
+
+    if args.binary:
+        with open(args.input, "rb") as f:
+            records = list(parse_binary(f))
+    else:
+        with open(args.input, errors="ignore") as f:
+            records = list(parse_log(f))
+
+    events = convert(records, names)
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ns"}, f)
+
+if __name__ == "__main__":
+    main()